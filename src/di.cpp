@@ -21,231 +21,2898 @@
 #include "di.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <map>
+#include <memory>
+#include <new>
 #include <iostream>
+#include <stdexcept>
+#include <unordered_set>
 
 #include <ltdl.h>
 
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+
 namespace di
 {
 
-//
-// Registry
-//
+/**
+ * Serialize libltdl calls, libltdl is not thread safe.
+ */
+static std::mutex ltdl_mutex;
+
+/**
+ * Protect the list of all registries.
+ */
+static std::mutex registries_mutex;
+
+
+//
+// Interned strings
+//
+
+/**
+ * Interned string, with its reference count.
+ * References are taken without locking, by holders of another reference.
+ * Only the last one is released under the mutex of interned strings, so
+ * lookups never find a string being released.
+ */
+struct interned_node : std::string
+{
+	explicit interned_node(const std::string& str):std::string(str){}
+	explicit interned_node(std::string&& str):std::string(std::move(str)){}
+
+	mutable std::atomic<std::size_t> refs{1};
+};
+
+/** Hash and equality of interned strings, by value. */
+struct interned_hash
+{
+	std::size_t operator()(const std::string* str)const{return std::hash<std::string>()(*str);}
+};
+
+struct interned_equal
+{
+	bool operator()(const std::string* a, const std::string* b)const{return *a == *b;}
+};
+
+typedef std::unordered_set<const std::string*, interned_hash, interned_equal> interned_set;
+
+/**
+ * Interned strings and their mutex.
+ * Never destroyed, interned strings may be used until the very end of the program.
+ */
+static interned_set& interned(std::unique_lock<std::mutex>& lock)
+{
+	static std::mutex* mutex = new std::mutex;
+	static interned_set* strings = new interned_set;
+	lock = std::unique_lock<std::mutex>(*mutex);
+	return *strings;
+}
+
+/**
+ * Intern a string, taking a reference on it.
+ */
+template<typename String>
+static const std::string* acquire_interned(String&& str)
+{
+	std::unique_lock<std::mutex> lock;
+	interned_set& strings = interned(lock);
+	auto it = strings.find(&str);
+	if(it != strings.end())
+	{
+		static_cast<const interned_node*>(*it)->refs.fetch_add(1, std::memory_order_relaxed);
+		return *it;
+	}
+	std::unique_ptr<interned_node> node(new interned_node(std::forward<String>(str)));
+	strings.insert(node.get());
+	return node.release();
+}
+
+/**
+ * Take another reference on an interned string.
+ */
+static void retain_interned(const std::string* str)
+{
+	static_cast<const interned_node*>(str)->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Release a reference on an interned string, without locking unless it
+ * may be the last one.
+ * \return false if the reference was not released, as it may be the last one.
+ */
+static bool try_release_interned(const std::string* str)
+{
+	std::atomic<std::size_t>& refs = static_cast<const interned_node*>(str)->refs;
+	std::size_t count = refs.load(std::memory_order_relaxed);
+	while(count > 1)
+	{
+		if(refs.compare_exchange_weak(count, count - 1, std::memory_order_release, std::memory_order_relaxed))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Release a reference on an interned string, the mutex of interned strings held.
+ */
+static void release_interned(interned_set& strings, const std::string* str)
+{
+	const interned_node* node = static_cast<const interned_node*>(str);
+	if(node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		strings.erase(str);
+		delete node;
+	}
+}
+
+static void release_interned(const std::string* str)
+{
+	if(!try_release_interned(str))
+	{
+		std::unique_lock<std::mutex> lock;
+		release_interned(interned(lock), str);
+	}
+}
+
+/**
+ * Release the references of property entries, locking at most once.
+ */
+static void release_interned(const property_map::entry* first, const property_map::entry* last)
+{
+	std::unique_lock<std::mutex> lock;
+	interned_set* strings = nullptr;
+	for(; first != last; ++first)
+	{
+		for(const std::string* str : {first->key, first->value})
+		{
+			if(!try_release_interned(str))
+			{
+				if(strings == nullptr)
+				{
+					strings = &interned(lock);
+				}
+				release_interned(*strings, str);
+			}
+		}
+	}
+}
+
+void interned_string::retain()
+{
+	retain_interned(_str);
+}
+
+void interned_string::release()
+{
+	release_interned(_str);
+}
+
+interned_string intern(const std::string& str)
+{
+	return interned_string(acquire_interned(str));
+}
+
+interned_string intern(std::string&& str)
+{
+	return interned_string(acquire_interned(std::move(str)));
+}
+
+interned_string find_interned(const std::string& str)
+{
+	std::unique_lock<std::mutex> lock;
+	interned_set& strings = interned(lock);
+	auto it = strings.find(&str);
+	if(it == strings.end())
+	{
+		return interned_string();
+	}
+	retain_interned(*it);
+	return interned_string(*it);
+}
+
+//
+// Property map
+//
+
+property_map::property_map(const properties_t& prop)
+{
+	for(const auto& p : prop)
+	{
+		insert(_size, entry{acquire_interned(p.first), acquire_interned(p.second)});
+	}
+}
+
+property_map::property_map(properties_t&& prop)
+{
+	// Keys of a map cannot be moved out, values can.
+	for(auto& p : prop)
+	{
+		insert(_size, entry{acquire_interned(p.first), acquire_interned(std::move(p.second))});
+	}
+	prop.clear();
+}
+
+property_map::property_map(properties_init_list_t prop)
+{
+	for(const auto& p : prop)
+	{
+		// Keep the first value of duplicated keys, as properties_t does.
+		std::size_t pos = lower_bound(p.first);
+		if(pos == _size || *data()[pos].key != p.first)
+		{
+			insert(pos, entry{acquire_interned(p.first), acquire_interned(p.second)});
+		}
+	}
+}
+
+property_map::property_map(const property_map& other)
+{
+	*this = other;
+}
+
+property_map::property_map(property_map&& other)
+{
+	*this = std::move(other);
+}
+
+property_map::~property_map()
+{
+	release_interned(data(), data() + _size);
+	if(_capacity > inline_capacity)
+	{
+		delete [] _heap;
+	}
+}
+
+property_map& property_map::operator = (const property_map& other)
+{
+	if(&other != this)
+	{
+		release_interned(data(), data() + _size);
+		_size = 0;
+		if(_capacity < other._size)
+		{
+			entry* heap = new entry[other._size];
+			if(_capacity > inline_capacity)
+			{
+				delete [] _heap;
+			}
+			_heap = heap;
+			_capacity = other._size;
+		}
+		for(const entry* it = other.data(); it != other.data() + other._size; ++it)
+		{
+			retain_interned(it->key);
+			retain_interned(it->value);
+		}
+		std::copy(other.data(), other.data() + other._size, data());
+		_size = other._size;
+	}
+	return *this;
+}
+
+property_map& property_map::operator = (property_map&& other)
+{
+	if(&other != this)
+	{
+		if(other._capacity > inline_capacity)
+		{
+			release_interned(data(), data() + _size);
+			if(_capacity > inline_capacity)
+			{
+				delete [] _heap;
+			}
+			_heap = other._heap;
+			_capacity = other._capacity;
+			_size = other._size;
+			other._capacity = inline_capacity;
+			other._size = 0;
+		}
+		else
+		{
+			*this = other;
+		}
+	}
+	return *this;
+}
+
+std::size_t property_map::lower_bound(const std::string& key)const
+{
+	const entry* first = data();
+	return std::lower_bound(first, first + _size, key, [](const entry& e, const std::string& key){return *e.key < key;}) - first;
+}
+
+property_map::const_iterator property_map::find(const std::string& key)const
+{
+	std::size_t pos = lower_bound(key);
+	return pos < _size && *data()[pos].key == key ? begin() + pos : end();
+}
+
+const std::string& property_map::at(const std::string& key)const
+{
+	const_iterator it = find(key);
+	if(it == end())
+	{
+		throw std::out_of_range("property_map::at: no property " + key);
+	}
+	return (*it).second;
+}
+
+void property_map::set(const std::string& key, const std::string& value)
+{
+	std::size_t pos = lower_bound(key);
+	if(pos < _size && *data()[pos].key == key)
+	{
+		const std::string* previous = data()[pos].value;
+		data()[pos].value = acquire_interned(value);
+		release_interned(previous);
+	}
+	else
+	{
+		insert(pos, entry{acquire_interned(key), acquire_interned(value)});
+	}
+}
+
+std::size_t property_map::erase(const std::string& key)
+{
+	std::size_t pos = lower_bound(key);
+	if(pos < _size && *data()[pos].key == key)
+	{
+		entry* first = data();
+		release_interned(first + pos, first + pos + 1);
+		std::copy(first + pos + 1, first + _size, first + pos);
+		--_size;
+		return 1;
+	}
+	return 0;
+}
+
+void property_map::insert(std::size_t pos, const entry& e)
+{
+	if(_size == _capacity)
+	{
+		std::size_t capacity = _capacity * 2;
+		entry* heap = new entry[capacity];
+		std::copy(data(), data() + _size, heap);
+		if(_capacity > inline_capacity)
+		{
+			delete [] _heap;
+		}
+		_heap = heap;
+		_capacity = capacity;
+	}
+	entry* first = data();
+	std::copy_backward(first + pos, first + _size, first + _size + 1);
+	first[pos] = e;
+	++_size;
+}
+
+properties_t property_map::to_map()const
+{
+	properties_t res;
+	for(const entry* it = data(); it != data() + _size; ++it)
+	{
+		res.emplace_hint(res.end(), *it->key, *it->value);
+	}
+	return res;
+}
+
+//
+// Property query
+//
+
+property_query& property_query::equals(const std::string& key, const std::string& value)
+{
+	interned_string k = find_interned(key);
+	interned_string v = find_interned(value);
+	bool resolved_key = bool(k), resolved_value = bool(v);
+	_conditions.push_back(condition{equal, std::move(k), std::move(v), resolved_key ? std::string() : key, resolved_value ? std::string() : value});
+	return *this;
+}
+
+property_query& property_query::has(const std::string& key)
+{
+	interned_string k = find_interned(key);
+	bool resolved = bool(k);
+	_conditions.push_back(condition{present, std::move(k), interned_string(), resolved ? std::string() : key, std::string()});
+	return *this;
+}
+
+property_query& property_query::prefix(const std::string& key, const std::string& prefix)
+{
+	interned_string k = find_interned(key);
+	bool resolved = bool(k);
+	_conditions.push_back(condition{starts_with, std::move(k), interned_string(), resolved ? std::string() : key, prefix});
+	return *this;
+}
+
+bool property_query::match(const component_descriptor& desc)const
+{
+	for(const condition& cond : _conditions)
+	{
+		interned_string key_holder, value_holder;
+		const std::string* key = cond.resolved_key(key_holder);
+		property_map::const_iterator it = key ? desc.prop.find(*key) : desc.prop.end();
+		if(it == desc.prop.end())
+		{
+			return false;
+		}
+		// Values are interned, equal values are the same string.
+		const std::string& value = (*it).second;
+		if((cond.type == equal && &value != cond.resolved_value(value_holder))
+			|| (cond.type == starts_with && value.compare(0, cond.value_text.size(), cond.value_text) != 0))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//
+// Epoch
+//
+
+/**
+ * Per thread epoch record.
+ * Records are never freed, they are reused by new threads when released.
+ */
+struct epoch_record
+{
+	/** Epoch announced by the owning thread, 0 when not reading. */
+	std::atomic<std::uint64_t> announced{0};
+	std::atomic<bool> used{true};
+	epoch_record* next = nullptr;
+	/** Number of nested read sections, only accessed by the owning thread. */
+	unsigned depth = 0;
+};
+
+static std::atomic<std::uint64_t> global_epoch{1};
+static std::atomic<epoch_record*> epoch_records{nullptr};
+
+static epoch_record* acquire_epoch_record()
+{
+	for(epoch_record* rec = epoch_records.load(); rec != nullptr; rec = rec->next)
+	{
+		bool used = false;
+		if(!rec->used.load(std::memory_order_relaxed) && rec->used.compare_exchange_strong(used, true))
+		{
+			return rec;
+		}
+	}
+	epoch_record* rec = new epoch_record;
+	rec->next = epoch_records.load();
+	while(!epoch_records.compare_exchange_weak(rec->next, rec));
+	return rec;
+}
+
+/**
+ * Owner of the epoch record of a thread, releasing it at thread exit.
+ */
+struct epoch_record_owner
+{
+	epoch_record* rec = acquire_epoch_record();
+
+	~epoch_record_owner()
+	{
+		rec->used.store(false);
+	}
+};
+
+static thread_local epoch_record_owner local_epoch_record;
+
+void epoch::enter()
+{
+	epoch_record* rec = local_epoch_record.rec;
+	if(rec->depth++ == 0)
+	{
+		rec->announced.store(global_epoch.load());
+	}
+}
+
+void epoch::leave()
+{
+	epoch_record* rec = local_epoch_record.rec;
+	if(--rec->depth == 0)
+	{
+		rec->announced.store(0, std::memory_order_release);
+	}
+}
+
+std::uint64_t epoch::retire()
+{
+	return global_epoch.fetch_add(1);
+}
+
+bool epoch::releasable(std::uint64_t retired)
+{
+	// Readers which announced a later epoch started after the retirement
+	// and cannot see the retired memory.
+	for(epoch_record* rec = epoch_records.load(); rec != nullptr; rec = rec->next)
+	{
+		std::uint64_t announced = rec->announced.load();
+		if(announced != 0 && announced <= retired)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//
+// Lookup statistics
+//
+
+/** Add to a counter only written by its own thread. */
+static void bump(std::atomic<std::uint64_t>& counter, std::uint64_t n)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * Statistics of a thread, readable by other threads.
+ */
+struct thread_statistics
+{
+	std::atomic<std::uint64_t> lookups[lookup_statistics::kind_count];
+	std::atomic<std::uint64_t> counters[lookup_statistics::counter_count];
+	std::atomic<std::uint64_t> latency[lookup_statistics::kind_count][lookup_statistics::latency_buckets];
+
+	thread_statistics();
+	~thread_statistics();
+
+	lookup_statistics::snapshot get()const
+	{
+		lookup_statistics::snapshot res;
+		for(std::size_t k = 0; k < lookup_statistics::kind_count; ++k)
+		{
+			res.lookups[k] = lookups[k].load(std::memory_order_relaxed);
+			for(std::size_t b = 0; b < lookup_statistics::latency_buckets; ++b)
+			{
+				res.latency[k][b] = latency[k][b].load(std::memory_order_relaxed);
+			}
+		}
+		for(std::size_t c = 0; c < lookup_statistics::counter_count; ++c)
+		{
+			res.counters[c] = counters[c].load(std::memory_order_relaxed);
+		}
+		return res;
+	}
+
+	void clear()
+	{
+		for(auto& counter : lookups)
+		{
+			counter.store(0, std::memory_order_relaxed);
+		}
+		for(auto& counter : counters)
+		{
+			counter.store(0, std::memory_order_relaxed);
+		}
+		for(auto& buckets : latency)
+		{
+			for(auto& counter : buckets)
+			{
+				counter.store(0, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/** False once the statistics of the thread are destroyed, at thread exit. */
+	static bool& alive()
+	{
+		static thread_local bool alive = true;
+		return alive;
+	}
+
+	static thread_statistics* local()
+	{
+		static thread_local thread_statistics stats;
+		return alive() ? &stats : nullptr;
+	}
+};
+
+// Never destroyed, threads may exit until the very end of the program.
+static std::mutex& statistics_mutex()
+{
+	static std::mutex* mutex = new std::mutex;
+	return *mutex;
+}
+
+/** Statistics of running threads. */
+static std::vector<thread_statistics*>& statistics_threads()
+{
+	static std::vector<thread_statistics*>* threads = new std::vector<thread_statistics*>;
+	return *threads;
+}
+
+/** Statistics of exited threads. */
+static lookup_statistics::snapshot& statistics_retired()
+{
+	static lookup_statistics::snapshot* retired = new lookup_statistics::snapshot;
+	return *retired;
+}
+
+thread_statistics::thread_statistics()
+{
+	clear();
+	std::lock_guard<std::mutex> lock(statistics_mutex());
+	statistics_threads().push_back(this);
+}
+
+thread_statistics::~thread_statistics()
+{
+	alive() = false;
+	std::lock_guard<std::mutex> lock(statistics_mutex());
+	std::vector<thread_statistics*>& threads = statistics_threads();
+	threads.erase(std::find(threads.begin(), threads.end(), this));
+	statistics_retired() += get();
+}
+
+lookup_statistics::snapshot& lookup_statistics::snapshot::operator += (const snapshot& other)
+{
+	for(std::size_t k = 0; k < kind_count; ++k)
+	{
+		lookups[k] += other.lookups[k];
+		for(std::size_t b = 0; b < latency_buckets; ++b)
+		{
+			latency[k][b] += other.latency[k][b];
+		}
+	}
+	for(std::size_t c = 0; c < counter_count; ++c)
+	{
+		counters[c] += other.counters[c];
+	}
+	return *this;
+}
+
+lookup_statistics::timer::~timer()
+{
+	record(_kind, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count());
+}
+
+bool lookup_statistics::enabled()
+{
+#ifdef DI_INSTRUMENTATION
+	return true;
+#else
+	return false;
+#endif
+}
+
+void lookup_statistics::count(counter c, std::uint64_t n)
+{
+	thread_statistics* stats = thread_statistics::local();
+	if(stats != nullptr)
+	{
+		bump(stats->counters[c], n);
+	}
+}
+
+void lookup_statistics::record(kind k, std::uint64_t ns)
+{
+	thread_statistics* stats = thread_statistics::local();
+	if(stats != nullptr)
+	{
+		std::size_t bucket = 0;
+		while(bucket + 1 < latency_buckets && (ns >> bucket) != 0)
+		{
+			++bucket;
+		}
+		bump(stats->lookups[k], 1);
+		bump(stats->latency[k][bucket], 1);
+	}
+}
+
+lookup_statistics::snapshot lookup_statistics::collect()
+{
+	std::lock_guard<std::mutex> lock(statistics_mutex());
+	snapshot res = statistics_retired();
+	for(const thread_statistics* stats : statistics_threads())
+	{
+		res += stats->get();
+	}
+	return res;
+}
+
+void lookup_statistics::reset()
+{
+	std::lock_guard<std::mutex> lock(statistics_mutex());
+	statistics_retired() = snapshot();
+	for(thread_statistics* stats : statistics_threads())
+	{
+		stats->clear();
+	}
+}
+
+/**
+ * Upper bound, in ns, of the latency of a fraction of the lookups of a histogram.
+ */
+static std::uint64_t latency_percentile(const std::uint64_t* buckets, std::uint64_t count, double fraction)
+{
+	std::uint64_t seen = 0;
+	for(std::size_t b = 0; b < lookup_statistics::latency_buckets; ++b)
+	{
+		seen += buckets[b];
+		if(seen >= count * fraction)
+		{
+			return std::uint64_t(1) << b;
+		}
+	}
+	return std::uint64_t(1) << (lookup_statistics::latency_buckets - 1);
+}
+
+void lookup_statistics::dump(std::ostream& out)
+{
+	snapshot stats = collect();
+	std::uint64_t total = 0;
+	out << "lookup statistics" << (enabled() ? "" : " (instrumentation disabled)") << std::endl;
+	out << "  kind                 lookups   p50 <ns   p99 <ns" << std::endl;
+	for(std::size_t k = 0; k < kind_count; ++k)
+	{
+		std::uint64_t count = stats.lookups[k];
+		total += count;
+		if(count == 0)
+		{
+			continue;
+		}
+		std::string kind_name = name(kind(k));
+		out << "  " << kind_name << std::string(kind_name.size() < 18 ? 18 - kind_name.size() : 1, ' ')
+			<< std::setw(10) << count
+			<< std::setw(10) << latency_percentile(stats.latency[k], count, 0.5)
+			<< std::setw(10) << latency_percentile(stats.latency[k], count, 0.99) << std::endl;
+	}
+	for(std::size_t c = 0; c < counter_count; ++c)
+	{
+		std::string counter_name = name(counter(c));
+		out << "  " << counter_name << std::string(counter_name.size() < 18 ? 18 - counter_name.size() : 1, ' ')
+			<< std::setw(10) << stats.counters[c];
+		if(total > 0 && c != cache_hits && c != cache_misses)
+		{
+			out << "  (" << double(stats.counters[c]) / total << " per lookup)";
+		}
+		out << std::endl;
+	}
+}
+
+const char* lookup_statistics::name(kind k)
+{
+	static const char* names[kind_count] = {
+		"find(id)", "find(name)", "find<T>()", "find_all<T>()", "find_if<T>()", "find_all_if<T>()",
+		"find(query)", "find_all(query)", "visit<T>()", "foreach()"
+	};
+	return k < kind_count ? names[k] : "";
+}
+
+const char* lookup_statistics::name(counter c)
+{
+	static const char* names[counter_count] = {
+		"visited", "casts", "levels", "cache hits", "cache misses"
+	};
+	return c < counter_count ? names[c] : "";
+}
+
+//
+// Component factory
+//
+
+/**
+ * Serialize creations of lazy components. Recursive as creating a
+ * component may create its dependencies.
+ */
+static std::recursive_mutex creation_mutex;
+
+/** Factories creating their component in the current thread, outermost first. */
+static thread_local std::vector<const component_factory*> creating;
+
+/** Serial of the last created factory. */
+static std::atomic<std::uint64_t> factory_serial{0};
+
+/** Count of destroyed factories which created per thread instances. */
+static std::atomic<std::uint64_t> released_factories{0};
+
+/**
+ * Per thread instances of the current thread.
+ */
+struct thread_instances_t
+{
+	/** Per thread instance, and a token expiring with its factory. */
+	struct instance
+	{
+		std::weak_ptr<void> factory;
+		component_ptr_t comp;
+	};
+
+	/** Factory serials, by instance. Declared first to outlive the instances. */
+	std::unordered_map<const component*, std::uint64_t> holders;
+	/** Instances, by factory serial. */
+	std::unordered_map<std::uint64_t, instance> instances;
+	/** Count of released factories when instances were last swept. */
+	std::uint64_t swept = 0;
+
+	static thread_local bool alive;
+
+	thread_instances_t(){alive = true;}
+	~thread_instances_t(){alive = false;}
+
+	/**
+	 * Remove the instance of a factory.
+	 * 
+eturn The instance, to be destroyed once removed: its destruction
+	 * may destroy other factories.
+	 */
+	component_ptr_t release(std::uint64_t serial)
+	{
+		component_ptr_t comp;
+		auto it = instances.find(serial);
+		if(it != instances.end())
+		{
+			comp = std::move(it->second.comp);
+			holders.erase(comp.get());
+			instances.erase(it);
+		}
+		return comp;
+	}
+
+	/**
+	 * Release instances of destroyed factories, if any was destroyed since
+	 * the last sweep.
+	 */
+	void sweep()
+	{
+		std::uint64_t released = released_factories.load(std::memory_order_acquire);
+		if(released == swept)
+		{
+			return;
+		}
+		swept = released;
+		std::vector<component_ptr_t> dead;
+		for(auto it = instances.begin(); it != instances.end();)
+		{
+			if(it->second.factory.expired())
+			{
+				dead.push_back(std::move(it->second.comp));
+				holders.erase(dead.back().get());
+				it = instances.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+};
+
+thread_local bool thread_instances_t::alive = false;
+
+static thread_instances_t& thread_instances()
+{
+	static thread_local thread_instances_t instances;
+	return instances;
+}
+
+/**
+ * Factory serials of created singleton instances, by instance, and their mutex.
+ * Never destroyed, factories may be destroyed until the very end of the program.
+ */
+static std::unordered_map<const component*, std::uint64_t>& singleton_holders(std::unique_lock<std::mutex>& lock)
+{
+	static std::mutex* mutex = new std::mutex;
+	static std::unordered_map<const component*, std::uint64_t>* holders = new std::unordered_map<const component*, std::uint64_t>;
+	lock = std::unique_lock<std::mutex>(*mutex);
+	return *holders;
+}
+
+component_factory::component_factory(function_t create, const std::string& name, component_lifetime lifetime):
+	_create(std::move(create)), _name(name), _lifetime(lifetime), _serial(++factory_serial)
+{
+	if(_lifetime == per_thread)
+	{
+		_alive = std::make_shared<char>();
+	}
+}
+
+component_factory::~component_factory()
+{
+	if(_lifetime == per_thread && created())
+	{
+		// Expire before counting, for sweeping threads to see it expired.
+		_alive.reset();
+		released_factories.fetch_add(1, std::memory_order_release);
+		if(thread_instances_t::alive)
+		{
+			thread_instances().release(_serial);
+		}
+	}
+	if(_lifetime == singleton && created())
+	{
+		std::unique_lock<std::mutex> lock;
+		std::unordered_map<const component*, std::uint64_t>& holders = singleton_holders(lock);
+		auto it = holders.find(_comp.get());
+		if(it != holders.end() && it->second == _serial)
+		{
+			holders.erase(it);
+		}
+	}
+}
+
+std::string component_factory::name()const
+{
+	return _name.empty() ? registry::factory_name(_serial) : _name;
+}
+
+const component_ptr_t& component_factory::create()
+{
+	switch(_lifetime)
+	{
+	case singleton:
+		{
+			if(_prepare)
+			{
+				_prepare();
+			}
+			std::lock_guard<std::recursive_mutex> lock(creation_mutex);
+			if(!_created.load(std::memory_order_relaxed))
+			{
+				_comp = invoke();
+				{
+					std::unique_lock<std::mutex> holders_lock;
+					singleton_holders(holders_lock).emplace(_comp.get(), _serial);
+				}
+				_created.store(true, std::memory_order_release);
+			}
+			return _comp;
+		}
+	case per_thread:
+		{
+			thread_instances_t& local = thread_instances();
+			local.sweep();
+			auto it = local.instances.find(_serial);
+			if(it == local.instances.end())
+			{
+				if(_prepare)
+				{
+					_prepare();
+				}
+				// Created before insertion: creation may insert dependencies.
+				component_ptr_t comp = invoke();
+				local.holders.emplace(comp.get(), _serial);
+				it = local.instances.emplace(_serial, thread_instances_t::instance{_alive, std::move(comp)}).first;
+				_created.store(true, std::memory_order_release);
+			}
+			return it->second.comp;
+		}
+	default:
+		{
+			static thread_local component_ptr_t last;
+			if(_prepare)
+			{
+				_prepare();
+			}
+			last = invoke();
+			return last;
+		}
+	}
+}
+
+component_ptr_t component_factory::invoke()
+{
+	auto found = std::find(creating.begin(), creating.end(), this);
+	if(found != creating.end())
+	{
+		std::string cycle;
+		for(auto it = found; it != creating.end(); ++it)
+		{
+			cycle += (*it)->name() + " -> ";
+		}
+		throw resolution_error("dependency cycle: " + cycle + name());
+	}
+
+	creating.push_back(this);
+	component_ptr_t comp;
+	try
+	{
+		comp = _create();
+	}
+	catch(...)
+	{
+		creating.pop_back();
+		throw;
+	}
+	creating.pop_back();
+	if(_lifetime == transient)
+	{
+		_created.store(true, std::memory_order_release);
+	}
+	return comp;
+}
+
+bool component_factory::holds(const component* comp)const
+{
+	switch(_lifetime)
+	{
+	case singleton:
+		return created() && _comp.get() == comp;
+	case per_thread:
+		{
+			const std::unordered_map<std::uint64_t, thread_instances_t::instance>& instances = thread_instances().instances;
+			auto it = instances.find(_serial);
+			return it != instances.end() && it->second.comp.get() == comp;
+		}
+	default:
+		return false;
+	}
+}
+
+std::uint64_t component_factory::holder(const component* comp)
+{
+	const std::unordered_map<const component*, std::uint64_t>& local = thread_instances().holders;
+	auto it = local.find(comp);
+	if(it != local.end())
+	{
+		return it->second;
+	}
+	std::unique_lock<std::mutex> lock;
+	const std::unordered_map<const component*, std::uint64_t>& holders = singleton_holders(lock);
+	auto found = holders.find(comp);
+	return found != holders.end() ? found->second : 0;
+}
+
+//
+// Component pool
+//
+
+/**
+ * Free list of memory blocks of a given size, for the current thread.
+ * Blocks may be freed by another thread than the one which allocated them.
+ */
+template<std::size_t Size>
+struct block_list
+{
+	struct node
+	{
+		node* next;
+	};
+
+	/** Maximal count of free blocks kept by a thread. */
+	static const std::size_t limit = 64;
+
+	node* head = nullptr;
+	std::size_t count = 0;
+
+	~block_list()
+	{
+		alive() = false;
+		while(head != nullptr)
+		{
+			node* next = head->next;
+			::operator delete(head);
+			head = next;
+		}
+	}
+
+	/** False once the list of the thread is destroyed, at thread exit. */
+	static bool& alive()
+	{
+		static thread_local bool alive = true;
+		return alive;
+	}
+
+	static block_list* get()
+	{
+		static thread_local block_list list;
+		return alive() ? &list : nullptr;
+	}
+};
+
+/**
+ * Allocator of pooled component control blocks, recycling them in
+ * per-thread free lists.
+ */
+template<typename T>
+struct block_allocator
+{
+	typedef T value_type;
+	typedef block_list<(sizeof(T) > sizeof(void*) ? sizeof(T) : sizeof(void*))> list_t;
+
+	block_allocator() = default;
+	template<typename U> block_allocator(const block_allocator<U>&){}
+
+	T* allocate(std::size_t n)
+	{
+		list_t* list = list_t::get();
+		if(n == 1 && list != nullptr && list->head != nullptr)
+		{
+			typename list_t::node* block = list->head;
+			list->head = block->next;
+			--list->count;
+			return reinterpret_cast<T*>(block);
+		}
+		return static_cast<T*>(::operator new(n * sizeof(T) > sizeof(typename list_t::node) ? n * sizeof(T) : sizeof(typename list_t::node)));
+	}
+
+	void deallocate(T* ptr, std::size_t n)
+	{
+		list_t* list = list_t::get();
+		if(n == 1 && list != nullptr && list->count < list_t::limit)
+		{
+			typename list_t::node* block = reinterpret_cast<typename list_t::node*>(ptr);
+			block->next = list->head;
+			list->head = block;
+			++list->count;
+			return;
+		}
+		::operator delete(ptr);
+	}
+
+	template<typename U> bool operator == (const block_allocator<U>&)const {return true;}
+	template<typename U> bool operator != (const block_allocator<U>&)const {return false;}
+};
+
+struct component_pool::state
+{
+	state(function_t create, std::size_t capacity, std::size_t thread_capacity):
+		create(std::move(create)), capacity(capacity), thread_capacity(std::min(capacity, thread_capacity))
+	{
+	}
+
+	~state()
+	{
+		for(component* comp : idle)
+		{
+			delete comp;
+		}
+	}
+
+	/**
+	 * Take an idle instance shared by threads, if any.
+	 */
+	component* take()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(idle.empty())
+		{
+			return nullptr;
+		}
+		component* comp = idle.back();
+		idle.pop_back();
+		return comp;
+	}
+
+	/**
+	 * Share a released instance with other threads, or destroy it if the pool is full or closed.
+	 */
+	void put(component* comp)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if(!closed && idle.size() < capacity)
+			{
+				idle.push_back(comp);
+				return;
+			}
+		}
+		delete comp;
+	}
+
+	/**
+	 * Release an instance, in the cache of the current thread if possible.
+	 */
+	void release(component* comp);
+
+	function_t create;
+	std::size_t capacity;
+	std::size_t thread_capacity;
+	std::mutex mutex;
+	std::vector<component*> idle;
+	std::atomic<std::size_t> created{0};
+	std::atomic<bool> closed{false};
+};
+
+/**
+ * Idle instances cached by the current thread, for each pool it used.
+ */
+struct pool_caches
+{
+	struct cache
+	{
+		std::shared_ptr<component_pool::state> pool;
+		std::vector<component*> idle;
+	};
+
+	std::vector<cache> caches;
+
+	~pool_caches()
+	{
+		alive() = false;
+		for(cache& c : caches)
+		{
+			for(component* comp : c.idle)
+			{
+				c.pool->put(comp);
+			}
+		}
+	}
+
+	/** False once the caches of the thread are destroyed, at thread exit. */
+	static bool& alive()
+	{
+		static thread_local bool alive = true;
+		return alive;
+	}
+
+	static pool_caches* get()
+	{
+		static thread_local pool_caches caches;
+		return alive() ? &caches : nullptr;
+	}
+
+	/**
+	 * Retrieve the cache of a pool, creating it if needed.
+	 */
+	cache& find(const std::shared_ptr<component_pool::state>& pool)
+	{
+		for(cache& c : caches)
+		{
+			if(c.pool == pool)
+			{
+				return c;
+			}
+		}
+		// Forget caches of destroyed pools before adding a new one.
+		caches.erase(std::remove_if(caches.begin(), caches.end(), [](cache& c){
+				if(!c.pool->closed.load(std::memory_order_acquire))
+				{
+					return false;
+				}
+				for(component* comp : c.idle)
+				{
+					delete comp;
+				}
+				return true;
+			}), caches.end());
+		caches.push_back(cache{pool, std::vector<component*>()});
+		caches.back().idle.reserve(pool->thread_capacity);
+		return caches.back();
+	}
+};
+
+void component_pool::state::release(component* comp)
+{
+	if(closed.load(std::memory_order_acquire))
+	{
+		delete comp;
+		return;
+	}
+	pool_caches* caches = pool_caches::get();
+	if(caches != nullptr)
+	{
+		for(pool_caches::cache& c : caches->caches)
+		{
+			if(c.pool.get() == this)
+			{
+				if(c.idle.size() < thread_capacity)
+				{
+					c.idle.push_back(comp);
+					return;
+				}
+				break;
+			}
+		}
+	}
+	put(comp);
+}
+
+/**
+ * Deleter of pooled instances, returning them to their pool.
+ */
+struct pool_recycler
+{
+	std::shared_ptr<component_pool::state> pool;
+
+	void operator()(component* comp)const
+	{
+		pool->release(comp);
+	}
+};
+
+component_pool::component_pool(function_t create, std::size_t capacity, std::size_t thread_capacity):
+	_state(std::make_shared<state>(std::move(create), capacity, thread_capacity))
+{
+}
+
+component_pool::~component_pool()
+{
+	std::vector<component*> idle;
+	{
+		std::lock_guard<std::mutex> lock(_state->mutex);
+		_state->closed.store(true, std::memory_order_release);
+		idle.swap(_state->idle);
+	}
+	for(component* comp : idle)
+	{
+		delete comp;
+	}
+}
+
+component_ptr_t component_pool::acquire()
+{
+	component* comp = nullptr;
+	pool_caches* caches = pool_caches::get();
+	if(caches != nullptr)
+	{
+		pool_caches::cache& c = caches->find(_state);
+		if(!c.idle.empty())
+		{
+			comp = c.idle.back();
+			c.idle.pop_back();
+		}
+	}
+	if(comp == nullptr)
+	{
+		comp = _state->take();
+	}
+	if(comp == nullptr)
+	{
+		comp = _state->create();
+		++_state->created;
+	}
+	return component_ptr_t(comp, pool_recycler{_state}, block_allocator<component>());
+}
+
+std::size_t component_pool::capacity()const
+{
+	return _state->capacity;
+}
+
+std::size_t component_pool::idle()const
+{
+	std::lock_guard<std::mutex> lock(_state->mutex);
+	return _state->idle.size();
+}
+
+std::size_t component_pool::created()const
+{
+	return _state->created;
+}
+
+std::string type_name(const std::type_info& type)
+{
+#ifdef __GNUG__
+	int status = 0;
+	char* demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+	if(demangled != nullptr)
+	{
+		std::string res(demangled);
+		std::free(demangled);
+		return res;
+	}
+#endif
+	return type.name();
+}
+
+//
+// Registry
+//
+
+std::atomic<std::uint64_t> registry::_serials{0};
+std::atomic<component_id> registry::_idcount{0};
+std::vector<registry*> registry::_registries;
+registry registry::_singleton;
+
+class registry::writer
+{
+public:
+	writer(registry& reg):
+	_reg(reg)
+	{
+		if(_reg._policy == concurrent)
+		{
+			_reg._write_mutex.lock();
+			_table = new table(*_reg._table.load());
+		}
+		else
+		{
+			_table = _reg._table.load(std::memory_order_relaxed);
+		}
+	}
+
+	~writer()
+	{
+		if(_reg._policy == concurrent)
+		{
+			table* old = _reg._table.exchange(_table);
+			_reg.invalidate();
+			_reg._retired.emplace_back(epoch::retire(), old);
+			_reg.reclaim();
+			_reg._write_mutex.unlock();
+		}
+		else
+		{
+			_reg.invalidate();
+		}
+	}
+
+	table* operator->(){return _table;}
+	table& operator*(){return *_table;}
+
+private:
+	registry& _reg;
+	table*    _table;
+};
+
+registry::registry(registry* parent, sync_policy policy):
+_parent(parent),
+_policy(policy),
+_serial(_serials++),
+_table(new table),
+_anchor(std::make_shared<registry_anchor>())
+{
+	_anchor->reg = this;
+
+	std::lock_guard<std::mutex> registries_lock(registries_mutex);
+	if(_registries.size()==0)
+	{
+		std::lock_guard<std::mutex> lock(ltdl_mutex);
+		if(lt_dlinit()!=0)
+		{
+			std::cerr << "Error while initializing libltdl" << std::endl;
+		}
+	}
+	_registries.push_back(this);
+}
+
+registry::~registry()
+{
+	_anchor->reg = nullptr;
+
+	std::unique_lock<std::mutex> registries_lock(registries_mutex);
+	// Child registries are usually destroyed before the older ones, look from the end.
+	auto it = std::find(_registries.rbegin(), _registries.rend(), this);
+	if(it != _registries.rend())
+	{
+		_registries.erase(std::next(it).base());
+	}
+
+	if(_registries.size()==0)
+	{
+		std::lock_guard<std::mutex> lock(ltdl_mutex);
+		if(lt_dlexit()!=0)
+		{
+			std::cerr << "Error while exiting libltdl" << std::endl;
+		}
+	}
+	registries_lock.unlock();
+
+	for(auto& retired : _retired_views)
+	{
+		delete retired.second;
+	}
+	delete _view.load();
+
+	for(auto& retired : _retired)
+	{
+		delete retired.second;
+	}
+	delete _table.load();
+}
+
+void registry::reclaim()
+{
+	auto it = std::remove_if(_retired.begin(), _retired.end(), [](const std::pair<std::uint64_t, table*>& retired){
+			if(epoch::releasable(retired.first))
+			{
+				delete retired.second;
+				return true;
+			}
+			return false;
+		});
+	_retired.erase(it, _retired.end());
+}
+
+/** Number of ids reserved at once by a thread. */
+static const component_id id_block_size = 256;
+
+/** Block of ids reserved by a thread, [next, end[ are still available. */
+struct id_block
+{
+	component_id next;
+	component_id end;
+};
+
+static thread_local id_block local_ids = {0, 0};
+
+component_id registry::next_id()
+{
+	id_block& block = local_ids;
+	if(block.next == block.end)
+	{
+		block.next = _idcount.fetch_add(id_block_size, std::memory_order_relaxed);
+		block.end = block.next + id_block_size;
+	}
+	return block.next++;
+}
+
+/**
+ * Key of the typed lookup cache: registry serial and looked up type.
+ */
+struct cache_key
+{
+	std::uint64_t         serial;
+	const std::type_info* type;
+
+	bool operator == (const cache_key& other)const
+	{
+		return serial == other.serial && type == other.type;
+	}
+};
+
+struct cache_key_hash
+{
+	std::size_t operator () (const cache_key& key)const
+	{
+		return std::hash<const std::type_info*>()(key.type) ^ (std::hash<std::uint64_t>()(key.serial) * 31);
+	}
+};
+
+/** Maximum number of entries in the lookup cache of a thread, the cache is cleared beyond. */
+static const std::size_t cache_max_size = 1024;
+
+registry::cache_entry& registry::cache(const std::type_info* type)const
+{
+	static thread_local std::unordered_map<cache_key, cache_entry, cache_key_hash> local_cache;
+	cache_key key{_serial, type};
+	auto found = local_cache.find(key);
+	if(found != local_cache.end())
+	{
+		return found->second;
+	}
+	if(local_cache.size() >= cache_max_size)
+	{
+		// Drop entries of destroyed registries and of types no more looked up.
+		local_cache.clear();
+	}
+	return local_cache[key];
+}
+
+registry& registry::parent(registry* parent)
+{
+	// The generation must keep increasing, even if the new parents have
+	// a lower generation than the previous ones.
+	std::uint64_t previous = generation();
+	std::uint64_t inherited = parent != nullptr ? parent->generation() : 0;
+	std::uint64_t own = _generation.load() + 1;
+	if(own + inherited <= previous)
+	{
+		own = previous + 1 - inherited;
+	}
+	_parent = parent;
+	_generation.store(own, std::memory_order_release);
+	return *this;
+}
+
+registry& registry::flatten(bool flat)
+{
+	_flat = flat;
+	return *this;
+}
+
+void registry::invalidate()
+{
+	_generation.fetch_add(1, std::memory_order_release);
+}
+
+const registry::table& registry::rebuild_view(epoch::guard& guard)const
+{
+	std::lock_guard<std::mutex> lock(_view_mutex);
+
+	// The generation is read first, so any modification made while the view
+	// is built outdates it.
+	std::uint64_t stamp = generation();
+	flat_view* current = _view.load(std::memory_order_acquire);
+	if(current != nullptr && current->stamp == stamp)
+	{
+		return current->tbl;
+	}
+
+	// Add components level after level, each in registration order, so the
+	// registration order of the view is the lookup order of the hierarchy.
+	flat_view* v = new flat_view{stamp, table()};
+	std::vector<const slot*> slots;
+	for(const registry* reg = this; reg != nullptr; reg = reg->parent())
+	{
+		const table& tbl = reg->read(guard);
+		slots.clear();
+		for(const slot& sl : tbl.components)
+		{
+			if(sl.desc)
+			{
+				slots.push_back(&sl);
+			}
+		}
+		std::sort(slots.begin(), slots.end(), [](const slot* a, const slot* b){return a->seq < b->seq;});
+		for(const slot* sl : slots)
+		{
+			v->tbl.add(sl->desc);
+		}
+	}
+
+	flat_view* old = _view.exchange(v, std::memory_order_acq_rel);
+	if(old != nullptr)
+	{
+		_retired_views.emplace_back(epoch::retire(), old);
+	}
+	auto it = std::remove_if(_retired_views.begin(), _retired_views.end(), [](const std::pair<std::uint64_t, flat_view*>& retired){
+			if(epoch::releasable(retired.first))
+			{
+				delete retired.second;
+				return true;
+			}
+			return false;
+		});
+	_retired_views.erase(it, _retired_views.end());
+	return v->tbl;
+}
+
+registry& registry::get()
+{
+	return registry::_singleton;
+}
+
+std::size_t registry::size()const
+{
+	std::size_t res = 0;
+	epoch::guard guard;
+	for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+	{
+		res += reg->lookup(guard).count;
+	}
+	return res;
+}
+
+component_ptr_t registry::find(component_id id) const
+{
+	DI_LOOKUP(find_id);
+	epoch::guard guard;
+	for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+	{
+		const table& tbl = reg->lookup(guard);
+		const component_descriptor* desc = tbl.at(tbl.find(id));
+		if(desc != nullptr)
+		{
+			DI_COUNT(visited, 1);
+			component_ptr_t holder;
+			return desc->instance(holder);
+		}
+	}
+	return component_ptr_t();
+}
+
+component_ptr_t registry::find(const std::string& name) const
+{
+	DI_LOOKUP(find_name);
+	epoch::guard guard;
+	for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+	{
+		const table& tbl = reg->lookup(guard);
+		const component_descriptor* desc = tbl.at(tbl.find(name));
+		if(desc != nullptr)
+		{
+			DI_COUNT(visited, 1);
+			component_ptr_t holder;
+			return desc->instance(holder);
+		}
+	}
+	return component_ptr_t();
+}
+
+component_ptr_t registry::find(const property_query& query) const
+{
+	DI_LOOKUP(find_query);
+	component_ptr_t res;
+	epoch::guard guard;
+	for(const registry* reg=this; reg!=nullptr && !res; reg = reg->lookup_parent())
+	{
+		reg->lookup(guard).walk_query(query, [&](const component_descriptor& desc){
+			res = desc.instance(res);
+			return !res;
+		});
+	}
+	return res;
+}
+
+std::vector<component_ptr_t> registry::find_all(const property_query& query) const
+{
+	DI_LOOKUP(find_all_query);
+	std::vector<component_ptr_t> res;
+	epoch::guard guard;
+	for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+	{
+		reg->lookup(guard).walk_query(query, [&](const component_descriptor& desc){
+			component_ptr_t holder;
+			res.push_back(desc.instance(holder));
+			return true;
+		});
+	}
+	return res;
+}
+
+const component_descriptor* registry::get(component_id id) const
+{
+	epoch::guard guard;
+	const table& tbl = read(guard);
+	return tbl.at(tbl.find(id));
+}
+
+const component_descriptor* registry::get(const std::string& name) const
+{
+	epoch::guard guard;
+	const table& tbl = read(guard);
+	return tbl.at(tbl.find(name));
+}
+
+const component_descriptor* registry::get(const component* comp) const
+{
+	epoch::guard guard;
+	const table& tbl = read(guard);
+	return tbl.at(tbl.find(comp));
+}
+
+/**
+ * Find, in a range of a multimap index, the slot registered first.
+ */
+template<typename Range, typename Components>
+static std::size_t first_registered(Range range, const Components& components, std::size_t none)
+{
+	std::size_t res = none;
+	for(auto it = range.first; it != range.second; ++it)
+	{
+		if(res == none || components[it->second].seq < components[res].seq)
+		{
+			res = it->second;
+		}
+	}
+	return res;
+}
+
+/**
+ * Remove, from a range of a multimap index, the entry of a slot.
+ */
+template<typename Index, typename Range>
+static void unindex(Index& index, Range range, std::size_t pos)
+{
+	for(auto it = range.first; it != range.second; ++it)
+	{
+		if(it->second == pos)
+		{
+			index.erase(it);
+			return;
+		}
+	}
+}
+
+void registry::interface_list::erase(std::uint64_t seq)
+{
+	auto it = std::lower_bound(entries.begin(), entries.end(), seq, [](const interface_entry& entry, std::uint64_t seq){return entry.seq < seq;});
+	if(it == entries.end() || it->seq != seq || it->erased())
+	{
+		return;
+	}
+	it->slot = npos;
+	// Compact once erased entries are the majority, so each erasure costs
+	// a constant amortized time besides the search.
+	if(++erased > entries.size() / 2)
+	{
+		entries.erase(std::remove_if(entries.begin(), entries.end(), [](const interface_entry& entry){return entry.erased();}), entries.end());
+		erased = 0;
+	}
+}
+
+std::size_t registry::table::find(component_id id)const
+{
+	auto it = by_id.find(id);
+	return it != by_id.end() ? it->second : npos;
+}
+
+std::size_t registry::table::find(const std::string& name)const
+{
+	return first_registered(by_name.equal_range(name), components, npos);
+}
+
+std::size_t registry::table::find(const component* comp)const
+{
+	std::size_t pos = first_registered(by_ptr.equal_range(comp), components, npos);
+	if(lazy > 0 && comp != nullptr)
+	{
+		// Lazy components are indexed by factory, their instances by the factory holding them.
+		std::uint64_t serial = component_factory::holder(comp);
+		if(serial != 0)
+		{
+			std::size_t found = first_registered(by_factory.equal_range(serial), components, npos);
+			if(found != npos && (pos == npos || components[found].seq < components[pos].seq))
+			{
+				pos = found;
+			}
+		}
+	}
+	return pos;
+}
+
+const registry::interface_list* registry::table::candidates(const property_query& query, bool& none)const
+{
+	const interface_list* res = nullptr;
+	for(const property_query::condition& cond : query._conditions)
+	{
+		interned_string key_holder, value_holder;
+		auto key = by_property.find(cond.resolved_key(key_holder));
+		if(key == by_property.end())
+		{
+			none = true;
+			return nullptr;
+		}
+		const interface_list* list = &key->second.all;
+		if(cond.type == property_query::equal)
+		{
+			auto value = key->second.by_value.find(cond.resolved_value(value_holder));
+			if(value == key->second.by_value.end())
+			{
+				none = true;
+				return nullptr;
+			}
+			list = &value->second;
+		}
+		if(res == nullptr || list->size() < res->size())
+		{
+			res = list;
+		}
+	}
+	return res;
+}
+
+std::size_t registry::table::add(component_descriptor&& desc)
+{
+	return add(std::make_shared<const component_descriptor>(std::move(desc)));
+}
+
+std::size_t registry::table::add(std::shared_ptr<const component_descriptor> desc)
+{
+	std::size_t pos;
+	if(free.empty())
+	{
+		pos = components.size();
+		components.emplace_back();
+	}
+	else
+	{
+		pos = free.back();
+		free.pop_back();
+	}
+	slot& sl = components[pos];
+	sl.desc = std::move(desc);
+	sl.seq = next_seq++;
+	++count;
+
+	const component_descriptor& added = *sl.desc;
+	by_name.emplace(added.name, pos);
+	by_id.emplace(added.id, pos);
+	if(added.factory)
+	{
+		++lazy;
+		by_factory.emplace(added.factory->serial(), pos);
+	}
+	else
+	{
+		by_ptr.emplace(added.comp.get(), pos);
+	}
+	for(property_map::value_type prop : added.prop)
+	{
+		property_index& index = by_property[&prop.first];
+		index.all.push_back(interface_entry{pos, sl.seq, nullptr});
+		index.by_value[&prop.second].push_back(interface_entry{pos, sl.seq, nullptr});
+	}
+	if(added.provides.empty())
+	{
+		// Lazy components cannot be matched by dynamic_cast before being created,
+		// only by the names of the types they provide, if known.
+		if(!added.factory)
+		{
+			untyped.push_back(interface_entry{pos, sl.seq, nullptr});
+		}
+		else
+		{
+			for(const std::string& type : added.factory->types())
+			{
+				interface_list& list = by_type_name[type];
+				if(list.entries.empty() || list.entries.back().slot != pos)
+				{
+					list.push_back(interface_entry{pos, sl.seq, nullptr});
+				}
+			}
+		}
+	}
+	else
+	{
+		for(auto it = added.provides.begin(); it != added.provides.end(); ++it)
+		{
+			// Ignore interfaces declared more than once.
+			if(std::find_if(added.provides.begin(), it, [&](const component_interface& intf){return intf.type == it->type;}) == it)
+			{
+				by_interface[it->type].push_back(interface_entry{pos, sl.seq, it->cast});
+			}
+		}
+	}
+	return pos;
+}
+
+void registry::table::reserve(std::size_t n)
+{
+	std::size_t size = count + n;
+	if(n > free.size())
+	{
+		components.reserve(components.size() + n - free.size());
+	}
+	by_name.reserve(size);
+	by_id.reserve(size);
+	by_ptr.reserve(size);
+}
+
+void registry::table::remove(std::size_t pos)
+{
+	slot& sl = components[pos];
+	const component_descriptor& desc = *sl.desc;
+	unindex(by_name, by_name.equal_range(desc.name), pos);
+	by_id.erase(desc.id);
+	if(desc.factory)
+	{
+		--lazy;
+		unindex(by_factory, by_factory.equal_range(desc.factory->serial()), pos);
+	}
+	else
+	{
+		unindex(by_ptr, by_ptr.equal_range(desc.comp.get()), pos);
+	}
+	for(property_map::value_type prop : desc.prop)
+	{
+		auto key = by_property.find(&prop.first);
+		if(key != by_property.end())
+		{
+			key->second.all.erase(sl.seq);
+			auto value = key->second.by_value.find(&prop.second);
+			if(value != key->second.by_value.end())
+			{
+				value->second.erase(sl.seq);
+				if(value->second.empty())
+				{
+					key->second.by_value.erase(value);
+				}
+			}
+			if(key->second.all.empty())
+			{
+				by_property.erase(key);
+			}
+		}
+	}
+	if(desc.provides.empty())
+	{
+		if(!desc.factory)
+		{
+			untyped.erase(sl.seq);
+		}
+		else
+		{
+			for(const std::string& type : desc.factory->types())
+			{
+				auto found = by_type_name.find(type);
+				if(found != by_type_name.end())
+				{
+					found->second.erase(sl.seq);
+					if(found->second.empty())
+					{
+						by_type_name.erase(found);
+					}
+				}
+			}
+		}
+	}
+	else
+	{
+		for(const component_interface& intf : desc.provides)
+		{
+			auto found = by_interface.find(intf.type);
+			if(found != by_interface.end())
+			{
+				found->second.erase(sl.seq);
+				if(found->second.empty())
+				{
+					by_interface.erase(found);
+				}
+			}
+		}
+	}
+	sl.desc.reset();
+	free.push_back(pos);
+	--count;
+}
+
+const component_descriptor& registry::set(const component_descriptor& desc)
+{
+	component_descriptor added(desc);
+	added.id = next_id();
+	writer tbl(*this);
+	return *tbl->at(tbl->add(std::move(added)));
+}
+
+const component_descriptor& registry::set(component_descriptor&& desc)
+{
+	component_descriptor added(std::move(desc));
+	added.id = next_id();
+	writer tbl(*this);
+	return *tbl->at(tbl->add(std::move(added)));
+}
+
+const component_descriptor& registry::set(const std::string& name, component_ptr_t comp)
+{
+	writer tbl(*this);
+	return *tbl->at(tbl->add(component_descriptor(next_id(), name, std::move(comp))));
+}
+
+const component_descriptor& registry::set(const std::string& name, component_ptr_t comp, const properties_t& prop)
+{
+	writer tbl(*this);
+	return *tbl->at(tbl->add(component_descriptor(next_id(), name, std::move(comp), prop)));
+}
+
+const component_descriptor& registry::set(const std::string& name, component_ptr_t comp, properties_t&& prop)
+{
+	writer tbl(*this);
+	return *tbl->at(tbl->add(component_descriptor(next_id(), name, std::move(comp), std::move(prop))));
+}
+
+const component_descriptor& registry::set(const std::string& name, component_ptr_t comp, properties_init_list_t prop)
+{
+	writer tbl(*this);
+	return *tbl->at(tbl->add(component_descriptor(next_id(), name, std::move(comp), prop)));
+}
+
+std::vector<component_id> registry::set_batch(std::vector<component_descriptor>&& descs)
+{
+	std::vector<component_id> ids;
+	ids.reserve(descs.size());
+	for(component_descriptor& desc : descs)
+	{
+		desc.id = next_id();
+		ids.push_back(desc.id);
+	}
+
+	writer tbl(*this);
+	tbl->reserve(descs.size());
+	for(component_descriptor& desc : descs)
+	{
+		tbl->add(std::move(desc));
+	}
+	descs.clear();
+	return ids;
+}
+
+component_handle registry::handle(component_id id) const
+{
+	epoch::guard guard;
+	const table& tbl = read(guard);
+	std::size_t pos = tbl.find(id);
+	return pos != npos ? component_handle(_anchor, pos, id, tbl.components[pos].desc) : component_handle();
+}
+
+component_handle registry::set_handle(component_descriptor&& desc)
+{
+	desc.id = next_id();
+	writer tbl(*this);
+	std::size_t pos = tbl->add(std::move(desc));
+	return component_handle(_anchor, pos, tbl->components[pos].desc->id, tbl->components[pos].desc);
+}
+
+void registry::publish(std::vector<std::shared_ptr<const component_descriptor>>&& descs)
+{
+	writer tbl(*this);
+	tbl->reserve(descs.size());
+	for(std::shared_ptr<const component_descriptor>& desc : descs)
+	{
+		tbl->add(std::move(desc));
+	}
+	descs.clear();
+}
+
+std::string registry::factory_name(std::uint64_t serial)
+{
+	std::lock_guard<std::mutex> lock(registries_mutex);
+	for(const registry* reg : _registries)
+	{
+		if(reg == nullptr)
+		{
+			continue;
+		}
+		epoch::guard guard;
+		const table& tbl = reg->read(guard);
+		std::size_t pos = first_registered(tbl.by_factory.equal_range(serial), tbl.components, npos);
+		if(pos != npos)
+		{
+			return tbl.components[pos].desc->name;
+		}
+	}
+	return std::string();
+}
+
+void registry::erase(component_id id)
+{
+	std::lock_guard<std::mutex> lock(registries_mutex);
+	bool found = false;
+	for(registry* reg : _registries)
+	{
+		if(reg!=nullptr && reg->get(id)!=nullptr)
+		{
+			reg->erase(npos, id);
+			found = true;
+		}
+	}
+	if(!found)
+	{
+		component_loader::discard(id);
+	}
+}
+
+void registry::erase(const component_handle& handle)
+{
+	registry* reg = handle._anchor ? handle._anchor->reg.load() : nullptr;
+	if(reg != nullptr)
+	{
+		reg->erase(handle._slot, handle._id);
+	}
+}
+
+void registry::erase(std::size_t pos, component_id id)
+{
+	writer tbl(*this);
+	const component_descriptor* desc = pos < tbl->components.size() ? tbl->at(pos) : nullptr;
+	if(desc == nullptr || desc->id != id)
+	{
+		pos = tbl->find(id);
+	}
+	if(pos != npos)
+	{
+		tbl->remove(pos);
+	}
+	else
+	{
+		component_loader::discard(id);
+	}
+}
+
+//
+// Arena
+//
+
+const std::size_t arena::chunk_size;
+
+arena::~arena()
+{
+	while(_chunks != nullptr)
+	{
+		chunk* previous = _chunks->previous;
+		::operator delete(_chunks);
+		_chunks = previous;
+	}
+}
+
+void* arena::allocate_chunk(std::size_t size, std::size_t align)
+{
+	std::size_t header = (sizeof(chunk) + align - 1) & ~(align - 1);
+	std::size_t capacity = std::max(chunk_size, header + size);
+	chunk* c = static_cast<chunk*>(::operator new(capacity));
+	c->previous = _chunks;
+	_chunks = c;
+	_current = reinterpret_cast<char*>(c);
+	_capacity = capacity;
+	_pos = header + size;
+	return _current + header;
+}
+
+//
+// Scoped registry
+//
+
+scoped_registry::~scoped_registry()
+{
+	for(entry* e = _first; e != nullptr; e = e->next)
+	{
+		e->~entry();
+	}
+}
+
+void scoped_registry::set(const std::string& name, component_ptr_t comp, const interfaces_t& provides)
+{
+	char* str = static_cast<char*>(_arena.allocate(name.size(), 1));
+	std::copy(name.begin(), name.end(), str);
+
+	component_interface* intfs = nullptr;
+	if(!provides.empty())
+	{
+		intfs = static_cast<component_interface*>(_arena.allocate(provides.size() * sizeof(component_interface), alignof(component_interface)));
+		std::uninitialized_copy(provides.begin(), provides.end(), intfs);
+	}
+
+	entry* e = new(_arena.allocate(sizeof(entry), alignof(entry))) entry{str, name.size(), std::move(comp), intfs, provides.size(), nullptr};
+	if(_last != nullptr)
+	{
+		_last->next = e;
+	}
+	else
+	{
+		_first = e;
+	}
+	_last = e;
+	++_size;
+}
+
+component_ptr_t scoped_registry::find(const std::string& name)const
+{
+	for(const entry* e = _first; e != nullptr; e = e->next)
+	{
+		if(e->name_size == name.size() && std::equal(name.begin(), name.end(), e->name))
+		{
+			return e->comp;
+		}
+	}
+	return _parent.find(name);
+}
+
+//
+// component_loader
+//
+
+thread_local std::vector<component_loader::frame> component_loader::_registries;
+
+/** Steady clock, in nanoseconds. */
+static std::uint64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Registrations of the module being profiled by a thread.
+ */
+struct profiled_registrations
+{
+	/** Start of the first registration, 0 if none. */
+	std::uint64_t first = 0;
+	std::uint64_t time = 0;
+	std::size_t count = 0;
+};
+
+static thread_local profiled_registrations* profiled = nullptr;
+
+/**
+ * Time a registration of a component, when the module registering it is profiled.
+ */
+class registration_timer
+{
+public:
+	registration_timer():_start(profiled != nullptr ? now_ns() : 0)
+	{
+		if(profiled != nullptr && profiled->first == 0)
+		{
+			profiled->first = _start;
+		}
+	}
+
+	~registration_timer()
+	{
+		if(profiled != nullptr)
+		{
+			profiled->time += now_ns() - _start;
+			++profiled->count;
+		}
+	}
+
+private:
+	std::uint64_t _start;
+};
+
+void component_loader::push_registry(registry& reg)
+{
+	_registries.push_back(frame{&reg, {}});
+}
+
+void component_loader::pop_registry()
+{
+	frame top = std::move(_registries.back());
+	_registries.pop_back();
+	if(!top.pending.empty())
+	{
+		top.reg->publish(std::move(top.pending));
+	}
+}
+
+bool component_loader::discard(component_id id)
+{
+	for(auto frame = _registries.rbegin(); frame != _registries.rend(); ++frame)
+	{
+		for(auto it = frame->pending.begin(); it != frame->pending.end(); ++it)
+		{
+			if((*it)->id == id)
+			{
+				frame->pending.erase(it);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+component_handle component_loader::set(const component_descriptor& desc)
+{
+	return set(component_descriptor(desc));
+}
+
+component_handle component_loader::set(component_descriptor&& desc)
+{
+	registration_timer timer;
+	if(_registries.empty() || _registries.back().reg->policy() != registry::concurrent)
+	{
+		registry* reg = _registries.empty() ? &registry::get() : _registries.back().reg;
+		return reg->set_handle(std::move(desc));
+	}
+	// Each write copies the table of a concurrent registry, publish them once.
+	frame& top = _registries.back();
+	desc.id = registry::next_id();
+	top.pending.push_back(std::make_shared<const component_descriptor>(std::move(desc)));
+	return component_handle(top.reg->_anchor, registry::npos, top.pending.back()->id, top.pending.back());
+}
+
+component_handle component_loader::set(const std::string& name, component_ptr_t comp)
+{
+	return set(component_descriptor(-1, name, std::move(comp)));
+}
+
+component_handle component_loader::set(const std::string& name, component_ptr_t comp, const properties_t& prop)
+{
+	return set(component_descriptor(-1, name, std::move(comp), prop));
+}
+
+component_handle component_loader::set(const std::string& name, component_ptr_t comp, properties_t&& prop)
+{
+	return set(component_descriptor(-1, name, std::move(comp), std::move(prop)));
+}
+
+component_handle component_loader::set(const std::string& name, component_ptr_t comp, properties_init_list_t prop)
+{
+	return set(component_descriptor(-1, name, std::move(comp), prop));
+}
+
+//
+// component_loader::locker
+//
+
+component_loader::locker::locker(registry& reg)
+{
+	component_loader::push_registry(reg);
+}
+
+component_loader::locker::~locker()
+{
+	component_loader::pop_registry();
+}
+
+
+//
+// component_manifest
+//
+
+struct component_manifest::raw_header
+{
+	char magic[4];
+	std::uint32_t version;
+	std::uint32_t module_count;
+	std::uint32_t component_count;
+	std::uint32_t type_count;
+	std::uint32_t property_count;
+	std::uint32_t strings_size;
+	std::uint32_t reserved;
+};
+
+struct component_manifest::raw_module
+{
+	std::uint32_t path;
+	std::uint32_t first_component;
+	std::uint32_t component_count;
+};
+
+struct component_manifest::raw_component
+{
+	std::uint32_t name;
+	std::uint32_t module;
+	std::uint32_t first_type;
+	std::uint32_t type_count;
+	std::uint32_t first_property;
+	std::uint32_t property_count;
+};
+
+struct component_manifest::raw_property
+{
+	std::uint32_t key;
+	std::uint32_t value;
+};
+
+struct component_manifest::raw_type_entry
+{
+	std::uint32_t type;
+	std::uint32_t component;
+};
+
+// File layout: header, modules, components, types of components (string
+// offsets), properties, component indexes sorted by name, type entries
+// sorted by type then component, then NUL terminated strings.
+static const char manifest_magic[4] = {'D', 'I', 'R', 'P'};
+
+const char* component_manifest::record::name()const
+{
+	return _manifest.string(_raw.name);
+}
+
+const char* component_manifest::record::module()const
+{
+	return _manifest.module(_raw.module);
+}
+
+std::size_t component_manifest::record::module_index()const
+{
+	return _raw.module;
+}
 
-component_id registry::_idcount = 0;
-std::vector<registry*> registry::_registries;
-registry registry::_singleton;
+std::size_t component_manifest::record::type_count()const
+{
+	return _raw.type_count;
+}
 
-registry::registry(registry* parent):
-_parent(parent)
+const char* component_manifest::record::type(std::size_t n)const
 {
-	if(_registries.size()==0)
-	{
-		if(lt_dlinit()!=0)
-		{
-			std::cerr << "Error while initializing libltdl" << std::endl;
-		}
-	}
-	_registries.push_back(this);
+	return _manifest.string(_manifest.types()[_raw.first_type + n]);
 }
 
-registry::~registry()
+std::size_t component_manifest::record::property_count()const
 {
-	for(auto it = _registries.begin(); it!=_registries.end();)
-	{
-		if(*it == this)
-		{
-			_registries.erase(it);
-		}
-		else
-		{
-			++it;
-		}
-	}
+	return _raw.property_count;
+}
 
-	if(_registries.size()==0)
+const char* component_manifest::record::key(std::size_t n)const
+{
+	return _manifest.string(_manifest.properties()[_raw.first_property + n].key);
+}
+
+const char* component_manifest::record::value(std::size_t n)const
+{
+	return _manifest.string(_manifest.properties()[_raw.first_property + n].value);
+}
+
+const char* component_manifest::record::property(const char* key)const
+{
+	for(std::size_t n = 0; n < _raw.property_count; ++n)
 	{
-		if(lt_dlexit()!=0)
+		if(std::strcmp(this->key(n), key) == 0)
 		{
-			std::cerr << "Error while exiting libltdl" << std::endl;
+			return value(n);
 		}
 	}
+	return nullptr;
 }
 
-registry& registry::get()
+std::vector<component_manifest::writer::entry> component_manifest::writer::describe(const registry& reg)
 {
-	return registry::_singleton;
+	std::vector<entry> entries;
+	reg.foreach([&](const component_descriptor& desc){
+			entry e;
+			e.name = desc.name;
+			for(const component_interface& intf : desc.provides)
+			{
+				if(intf.type != typeid(component))
+				{
+					e.types.push_back(intf.type.name());
+				}
+			}
+			if(desc.provides.empty() && desc.comp)
+			{
+				const component& comp = *desc.comp;
+				e.types.push_back(typeid(comp).name());
+			}
+			for(const auto& prop : desc.prop)
+			{
+				e.prop.emplace_back(prop.first, prop.second);
+			}
+			entries.push_back(std::move(e));
+		});
+	return entries;
 }
 
-std::size_t registry::size()const
+void component_manifest::writer::add(const std::string& module, const registry& reg)
 {
-	return _components.size() + (_parent!=nullptr?_parent->size():0);
+	add(module, describe(reg));
 }
 
-component_ptr_t registry::find(component_id id) const
+void component_manifest::writer::add(const std::string& module, std::vector<entry> entries)
 {
-	for(const registry* reg=this; reg!=nullptr; reg = reg->parent())
-	{
-		for(comp_holder::const_iterator it = reg->_components.begin(); it!=reg->_components.end(); ++it)
-		{
-			if(it->id == id)
-			{
-				return it->comp;
-			}
-		}
-	}
-	return component_ptr_t();
+	_modules.emplace_back(module, std::move(entries));
 }
 
-component_ptr_t registry::find(const std::string& name) const
+std::string component_manifest::writer::data()const
 {
-	for(const registry* reg=this; reg!=nullptr; reg = reg->parent())
+	std::string strings;
+	std::map<std::string, std::uint32_t> offsets;
+	auto intern = [&](const std::string& str){
+		auto it = offsets.find(str);
+		if(it != offsets.end())
+		{
+			return it->second;
+		}
+		std::uint32_t offset = strings.size();
+		strings.append(str).push_back('\0');
+		offsets.emplace(str, offset);
+		return offset;
+	};
+
+	std::vector<raw_module> modules;
+	std::vector<raw_component> components;
+	std::vector<std::uint32_t> types;
+	std::vector<raw_property> properties;
+	std::vector<raw_type_entry> type_entries;
+	std::vector<const std::string*> names;
+	std::vector<const std::string*> type_names;
+	for(const auto& module : _modules)
 	{
-		for(comp_holder::const_iterator it = reg->_components.begin(); it!=reg->_components.end(); ++it)
+		modules.push_back(raw_module{intern(module.first), std::uint32_t(components.size()), std::uint32_t(module.second.size())});
+		for(const entry& e : module.second)
 		{
-			if(it->name == name)
+			std::uint32_t index = components.size();
+			components.push_back(raw_component{intern(e.name), std::uint32_t(modules.size() - 1),
+					std::uint32_t(types.size()), std::uint32_t(e.types.size()),
+					std::uint32_t(properties.size()), std::uint32_t(e.prop.size())});
+			names.push_back(&e.name);
+			for(const std::string& type : e.types)
+			{
+				type_entries.push_back(raw_type_entry{intern(type), index});
+				type_names.push_back(&type);
+				types.push_back(type_entries.back().type);
+			}
+			for(const auto& prop : e.prop)
 			{
-				return it->comp;
+				properties.push_back(raw_property{intern(prop.first), intern(prop.second)});
 			}
 		}
 	}
-	return component_ptr_t();
+
+	std::vector<std::uint32_t> name_index(components.size());
+	for(std::uint32_t n = 0; n < name_index.size(); ++n)
+	{
+		name_index[n] = n;
+	}
+	std::stable_sort(name_index.begin(), name_index.end(), [&](std::uint32_t a, std::uint32_t b){
+			return *names[a] < *names[b];
+		});
+	std::vector<std::uint32_t> type_index(type_entries.size());
+	for(std::uint32_t n = 0; n < type_index.size(); ++n)
+	{
+		type_index[n] = n;
+	}
+	std::stable_sort(type_index.begin(), type_index.end(), [&](std::uint32_t a, std::uint32_t b){
+			return *type_names[a] < *type_names[b];
+		});
+	std::vector<raw_type_entry> sorted_types;
+	for(std::uint32_t n : type_index)
+	{
+		sorted_types.push_back(type_entries[n]);
+	}
+
+	raw_header header;
+	std::memcpy(header.magic, manifest_magic, sizeof(header.magic));
+	header.version = version;
+	header.module_count = modules.size();
+	header.component_count = components.size();
+	header.type_count = types.size();
+	header.property_count = properties.size();
+	header.strings_size = strings.size();
+	header.reserved = 0;
+
+	std::string res;
+	auto append = [&res](const void* data, std::size_t size){
+		res.append(static_cast<const char*>(data), size);
+	};
+	append(&header, sizeof(header));
+	append(modules.data(), modules.size() * sizeof(raw_module));
+	append(components.data(), components.size() * sizeof(raw_component));
+	append(types.data(), types.size() * sizeof(std::uint32_t));
+	append(properties.data(), properties.size() * sizeof(raw_property));
+	append(name_index.data(), name_index.size() * sizeof(std::uint32_t));
+	append(sorted_types.data(), sorted_types.size() * sizeof(raw_type_entry));
+	res += strings;
+	return res;
 }
 
-const component_descriptor* registry::get(component_id id) const
+bool component_manifest::writer::write(const std::string& filename)const
 {
-	auto it = std::find_if(_components.cbegin(), _components.cend(), [&](const component_descriptor& desc){return desc.id == id;});
-	return it != _components.cend() ? &*it : nullptr;
+	std::ofstream file(filename, std::ios_base::binary | std::ios_base::trunc);
+	std::string content = data();
+	file.write(content.data(), content.size());
+	return bool(file);
 }
 
-const component_descriptor* registry::get(const std::string& name) const
+component_manifest::~component_manifest()
 {
-	auto it = std::find_if(_components.cbegin(), _components.cend(), [&](const component_descriptor& desc){return desc.name == name;});
-	return it != _components.cend() ? &*it : nullptr;
+	close();
 }
 
-const component_descriptor* registry::get(const component* comp) const
+bool component_manifest::open(const std::string& filename)
 {
-	auto it = std::find_if(_components.cbegin(), _components.cend(), [&](const component_descriptor& desc){return desc.comp.get() == comp;});
-	return it != _components.cend() ? &*it : nullptr;
+	close();
+
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		return false;
+	}
+	struct stat st;
+	void* data = MAP_FAILED;
+	if(::fstat(fd, &st) == 0 && std::size_t(st.st_size) >= sizeof(raw_header))
+	{
+		data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	::close(fd);
+	if(data == MAP_FAILED)
+	{
+		return false;
+	}
+	_data = static_cast<const char*>(data);
+	_size = st.st_size;
+
+	// Check the header and that all tables are within the file.
+	const raw_header& head = header();
+	std::uint64_t tables = sizeof(raw_header)
+		+ std::uint64_t(head.module_count) * sizeof(raw_module)
+		+ std::uint64_t(head.component_count) * (sizeof(raw_component) + sizeof(std::uint32_t))
+		+ std::uint64_t(head.type_count) * (sizeof(std::uint32_t) + sizeof(raw_type_entry))
+		+ std::uint64_t(head.property_count) * sizeof(raw_property);
+	bool valid = std::memcmp(head.magic, manifest_magic, sizeof(head.magic)) == 0
+		&& head.version == version
+		&& tables + head.strings_size == _size
+		&& (head.strings_size == 0 || _data[_size - 1] == '\0');
+	for(std::size_t n = 0; valid && n < head.module_count; ++n)
+	{
+		valid = std::uint64_t(modules()[n].first_component) + modules()[n].component_count <= head.component_count;
+	}
+	for(std::size_t n = 0; valid && n < head.component_count; ++n)
+	{
+		const raw_component& comp = components()[n];
+		valid = comp.module < head.module_count
+			&& std::uint64_t(comp.first_type) + comp.type_count <= head.type_count
+			&& std::uint64_t(comp.first_property) + comp.property_count <= head.property_count
+			&& names()[n] < head.component_count;
+	}
+	for(std::size_t n = 0; valid && n < head.type_count; ++n)
+	{
+		valid = type_entries()[n].component < head.component_count;
+	}
+	if(!valid)
+	{
+		close();
+		return false;
+	}
+	_strings = _data + tables;
+	return true;
 }
 
-const component_descriptor& registry::set(const component_descriptor& desc)
+void component_manifest::close()
 {
-	return *_components.emplace(_components.end(), _idcount++, desc.name, desc.comp, desc.prop);
+	if(_data != nullptr)
+	{
+		::munmap(const_cast<char*>(_data), _size);
+	}
+	_data = nullptr;
+	_size = 0;
+	_strings = nullptr;
 }
 
-const component_descriptor& registry::set(component_descriptor&& desc)
+const char* component_manifest::string(std::uint32_t offset)const
 {
-	return *_components.emplace(_components.end(), _idcount++, std::move(desc.name), std::move(desc.comp), std::move(desc.prop));
+	return offset < header().strings_size ? _strings + offset : "";
 }
 
-const component_descriptor& registry::set(const std::string& name, component_ptr_t comp)
+const component_manifest::raw_header& component_manifest::header()const
 {
-	return *_components.emplace(_components.end(), _idcount++, name, comp);
+	return *reinterpret_cast<const raw_header*>(_data);
 }
 
-const component_descriptor& registry::set(const std::string& name, component_ptr_t comp, const properties_t& prop)
+const component_manifest::raw_module* component_manifest::modules()const
 {
-	return *_components.emplace(_components.end(), _idcount++, name, comp, prop);
+	return reinterpret_cast<const raw_module*>(_data + sizeof(raw_header));
 }
 
-const component_descriptor& registry::set(const std::string& name, component_ptr_t comp, properties_t&& prop)
+const component_manifest::raw_component* component_manifest::components()const
 {
-	return *_components.emplace(_components.end(), _idcount++, name, comp, prop);
+	return reinterpret_cast<const raw_component*>(modules() + header().module_count);
 }
 
-const component_descriptor& registry::set(const std::string& name, component_ptr_t comp, properties_init_list_t prop)
+const std::uint32_t* component_manifest::types()const
 {
-	return *_components.emplace(_components.end(), _idcount++, name, comp, prop);
+	return reinterpret_cast<const std::uint32_t*>(components() + header().component_count);
 }
 
-void registry::erase(component_id id)
+const component_manifest::raw_property* component_manifest::properties()const
 {
-	for(registry* reg : _registries)
-	{
-		if(reg!=nullptr && reg->_components.size()>0)
-		{
-			for(auto it = reg->_components.begin(); it != reg->_components.end(); )
-			{
-				if(it->id == id)
-				{
-					reg->_components.erase(it);
-				}
-				else
-				{
-					++it;
-				}
-			}
-		}
-	}
+	return reinterpret_cast<const raw_property*>(types() + header().type_count);
 }
 
-//
-// component_loader
-//
+const std::uint32_t* component_manifest::names()const
+{
+	return reinterpret_cast<const std::uint32_t*>(properties() + header().property_count);
+}
 
-std::stack<registry*> component_loader::_registries;
+const component_manifest::raw_type_entry* component_manifest::type_entries()const
+{
+	return reinterpret_cast<const raw_type_entry*>(names() + header().component_count);
+}
 
-void component_loader::push_registry(registry& reg)
+std::size_t component_manifest::module_count()const
 {
-	_registries.push(&reg);
+	return is_open() ? header().module_count : 0;
 }
 
-void component_loader::pop_registry()
+const char* component_manifest::module(std::size_t n)const
 {
-	_registries.pop();
+	return string(modules()[n].path);
 }
 
-component_id component_loader::set(const component_descriptor& desc)
+std::size_t component_manifest::component_count()const
 {
-	return ( _registries.empty() ? &registry::get() : _registries.top() )->set(desc).id;
+	return is_open() ? header().component_count : 0;
 }
 
-component_id component_loader::set(component_descriptor&& desc)
+component_manifest::record component_manifest::get(std::size_t n)const
 {
-	return ( _registries.empty() ? &registry::get() : _registries.top() )->set(desc).id;
+	return record(*this, components()[n]);
 }
 
-component_id component_loader::set(const std::string& name, component_ptr_t comp)
+std::size_t component_manifest::find(const std::string& name)const
 {
-	return ( _registries.empty() ? &registry::get() : _registries.top() )->set(name, comp).id;
+	if(!is_open())
+	{
+		return npos;
+	}
+	const std::uint32_t* begin = names();
+	const std::uint32_t* end = begin + component_count();
+	const std::uint32_t* it = std::lower_bound(begin, end, name.c_str(), [this](std::uint32_t comp, const char* name){
+			return std::strcmp(string(components()[comp].name), name) < 0;
+		});
+	if(it != end && name == string(components()[*it].name))
+	{
+		return *it;
+	}
+	return npos;
 }
 
-component_id component_loader::set(const std::string& name, component_ptr_t comp, const properties_t& prop)
+std::vector<std::size_t> component_manifest::find_all(const std::type_info& type)const
 {
-	return ( _registries.empty() ? &registry::get() : _registries.top() )->set(name, comp, prop).id;
+	std::vector<std::size_t> res;
+	if(!is_open())
+	{
+		return res;
+	}
+	const raw_type_entry* begin = type_entries();
+	const raw_type_entry* end = begin + header().type_count;
+	const raw_type_entry* it = std::lower_bound(begin, end, type.name(), [this](const raw_type_entry& entry, const char* name){
+			return std::strcmp(string(entry.type), name) < 0;
+		});
+	for(; it != end && std::strcmp(string(it->type), type.name()) == 0; ++it)
+	{
+		res.push_back(it->component);
+	}
+	return res;
 }
 
-component_id component_loader::set(const std::string& name, component_ptr_t comp, properties_t&& prop)
+const char* component_manifest::provider(const std::string& name)const
 {
-	return ( _registries.empty() ? &registry::get() : _registries.top() )->set(name, comp, prop).id;
+	std::size_t comp = find(name);
+	return comp != npos ? get(comp).module() : nullptr;
 }
 
-component_id component_loader::set(const std::string& name, component_ptr_t comp, properties_init_list_t prop)
+const char* component_manifest::provider(const std::type_info& type)const
 {
-	return ( _registries.empty() ? &registry::get() : _registries.top() )->set(name, comp, prop).id;
+	std::vector<std::size_t> comps = find_all(type);
+	return comps.empty() ? nullptr : get(comps.front()).module();
 }
 
+
 //
-// component_loader::locker
+// simple_component_loader
 //
 
-component_loader::locker::locker(registry& reg)
+/**
+ * Open a library, recording its timings in a profile if any.
+ * The registry stack and the ltdl mutex must be held by the caller.
+ * \return true if the library is correctly opened.
+ */
+/** Count of threads which loaded a profiled module. */
+static std::atomic<unsigned> loading_threads{0};
+
+/**
+ * Sequential index of the current thread among those loading profiled
+ * modules, from 1, assigned by its first profiled load.
+ */
+static unsigned loading_thread()
 {
-	component_loader::push_registry(reg);
+	static thread_local unsigned index = ++loading_threads;
+	return index;
 }
 
-component_loader::locker::~locker()
+static bool open_module(const std::string& filename, load_profile* profile)
 {
-	component_loader::pop_registry();
-}
+	if(profile == nullptr)
+	{
+		return lt_dlopenext(filename.c_str()) != nullptr;
+	}
 
+	profiled_registrations registrations;
+	profiled = &registrations;
+	std::uint64_t start = now_ns();
+	bool loaded = lt_dlopenext(filename.c_str()) != nullptr;
+	std::uint64_t end = now_ns();
+	profiled = nullptr;
 
-//
-// simple_component_loader
-//
+	load_profile::module mod;
+	mod.path = filename;
+	mod.loaded = loaded;
+	mod.thread = loading_thread();
+	mod.start = start;
+	mod.components = registrations.count;
+	mod.registration = registrations.time;
+	if(registrations.first != 0)
+	{
+		mod.open = registrations.first - start;
+		mod.constructors = end - registrations.first - registrations.time;
+	}
+	else
+	{
+		mod.open = end - start;
+	}
+	profile->add(mod);
+	return loaded;
+}
+
+/**
+ * Test if a module is already loaded in the process, by libltdl or not.
+ * Opening it again would not run its static constructors again.
+ */
+static bool module_loaded(const std::string& filename)
+{
+#ifdef RTLD_NOLOAD
+	if(void* handle = dlopen(filename.c_str(), RTLD_LAZY | RTLD_NOLOAD))
+	{
+		dlclose(handle);
+		return true;
+	}
+#endif
+	return false;
+}
 
 simple_component_loader::simple_component_loader(registry& reg):
 _reg(reg)
@@ -255,7 +2922,8 @@ _reg(reg)
 bool simple_component_loader::load(const std::string& filename)
 {
 	component_loader::locker lock(_reg);
-	return lt_dlopenext(filename.c_str()) != nullptr;
+	std::lock_guard<std::mutex> ltdl(ltdl_mutex);
+	return open_module(filename, _profile);
 }
 
 void simple_component_loader::load(const std::vector<std::string>& filenames)
@@ -263,8 +2931,8 @@ void simple_component_loader::load(const std::vector<std::string>& filenames)
 	component_loader::locker lock(_reg);
 	for(std::string filename : filenames)
 	{
-		lt_dlhandle handle = lt_dlopenext(filename.c_str());
-		if(handle==nullptr)
+		std::lock_guard<std::mutex> ltdl(ltdl_mutex);
+		if(!open_module(filename, _profile))
 		{
 			std::cerr << "Error while loading " << filename << " : " << lt_dlerror() << std::endl;
 		}
@@ -280,7 +2948,10 @@ static int load_all_cb(const char *filename, std::vector<std::string>* paths)
 void simple_component_loader::load_all(const std::string& dirname)
 {
 	std::vector<std::string> paths;
-	lt_dlforeachfile(dirname.c_str(), (int(*)(const char *, void*))load_all_cb, (void*)&paths);
+	{
+		std::lock_guard<std::mutex> ltdl(ltdl_mutex);
+		lt_dlforeachfile(dirname.c_str(), (int(*)(const char *, void*))load_all_cb, (void*)&paths);
+	}
 	load(paths);
 }
 
@@ -302,10 +2973,259 @@ static int load_all_test_cb(const char *filename, load_all_test_st* st)
 
 void simple_component_loader::load_all(const std::string& dirname, filter_t& filter)
 {
-	load_all_test_st test{filter};
-	lt_dlforeachfile(dirname.c_str(), (int(*)(const char *, void*))load_all_test_cb, (void*)&test);
+	load_all_test_st test{filter, std::vector<std::string>()};
+	{
+		std::lock_guard<std::mutex> ltdl(ltdl_mutex);
+		lt_dlforeachfile(dirname.c_str(), (int(*)(const char *, void*))load_all_test_cb, (void*)&test);
+	}
 	load(test.paths);
 
 }
 
+std::string simple_component_loader::provider(const std::string& name)const
+{
+	const char* path = _manifest != nullptr ? _manifest->provider(name) : nullptr;
+	return path != nullptr ? path : std::string();
+}
+
+std::string simple_component_loader::provider(const std::type_info& type)const
+{
+	const char* path = _manifest != nullptr ? _manifest->provider(type) : nullptr;
+	return path != nullptr ? path : std::string();
+}
+
+bool simple_component_loader::load_provider(const std::string& name)
+{
+	std::string path = provider(name);
+	return !path.empty() && load(path);
+}
+
+struct simple_component_loader::deferred_module
+{
+	deferred_module(const std::string& path, load_profile* profile):path(path), profile(profile)
+	{
+	}
+
+	/**
+	 * Load the module if not already done.
+	 * Called before creations, without the creation lock: module constructors
+	 * may create lazy components while the ltdl mutex is held.
+	 */
+	void load()
+	{
+		std::lock_guard<std::recursive_mutex> lock(mutex);
+		if(loaded)
+		{
+			return;
+		}
+		component_loader::locker stack(reg);
+		std::lock_guard<std::mutex> ltdl(ltdl_mutex);
+		// Its components were registered elsewhere when it was loaded.
+		if(module_loaded(path))
+		{
+			throw resolution_error("module " + path + " was loaded before its placeholders were resolved");
+		}
+		if(!open_module(path, profile))
+		{
+			const char* error = lt_dlerror();
+			throw resolution_error("cannot load module " + path + " : " + (error != nullptr ? error : "unknown error"));
+		}
+		loaded = true;
+	}
+
+	/**
+	 * Retrieve one of the components of the loaded module.
+	 * Called by factories, with the creation lock held.
+	 */
+	component_ptr_t find(const std::string& name)
+	{
+		load();
+		component_ptr_t comp = reg.find(name);
+		if(!comp)
+		{
+			throw resolution_error("component " + name + " not found in module " + path);
+		}
+		return comp;
+	}
+
+	std::string path;
+	load_profile* profile;
+	registry reg;
+	/** Serialize loads, recursive to report modules resolving their own placeholders. */
+	std::recursive_mutex mutex;
+	bool loaded = false;
+};
+
+std::size_t simple_component_loader::load_lazy(const component_manifest& manifest)
+{
+	std::vector<std::shared_ptr<deferred_module>> modules;
+	for(std::size_t n = 0; n < manifest.module_count(); ++n)
+	{
+		if(module_loaded(manifest.module(n)))
+		{
+			throw resolution_error(std::string("module ") + manifest.module(n) + " is already loaded, its components cannot be deferred");
+		}
+	}
+	for(std::size_t n = 0; n < manifest.module_count(); ++n)
+	{
+		modules.push_back(std::make_shared<deferred_module>(manifest.module(n), _profile));
+	}
+
+	std::vector<component_descriptor> placeholders;
+	placeholders.reserve(manifest.component_count());
+	for(std::size_t n = 0; n < manifest.component_count(); ++n)
+	{
+		component_manifest::record rec = manifest.get(n);
+		std::shared_ptr<deferred_module> module = modules[rec.module_index()];
+		std::string name = rec.name();
+		component_factory_ptr_t factory = std::make_shared<component_factory>([module, name](){
+				return module->find(name);
+			}, name);
+		std::vector<std::string> types;
+		for(std::size_t t = 0; t < rec.type_count(); ++t)
+		{
+			types.push_back(rec.type(t));
+		}
+		factory->types(std::move(types));
+		factory->prepare([module](){
+				module->load();
+			});
+		properties_t prop;
+		for(std::size_t p = 0; p < rec.property_count(); ++p)
+		{
+			prop.emplace(rec.key(p), rec.value(p));
+		}
+		placeholders.emplace_back(-1, name, factory, std::move(prop), interfaces_t());
+	}
+	_reg.set_batch(std::move(placeholders));
+	return manifest.component_count();
+}
+
+//
+// load_profile
+//
+
+void load_profile::add(const module& mod)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_modules.push_back(mod);
+}
+
+void load_profile::clear()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_modules.clear();
+}
+
+void load_profile::report(std::ostream& out)const
+{
+	std::vector<module> modules;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		modules = _modules;
+	}
+	std::stable_sort(modules.begin(), modules.end(), [](const module& a, const module& b){
+			return a.total() > b.total();
+		});
+
+	std::uint64_t total = 0;
+	std::size_t components = 0;
+	out << "     total ms   open ms   ctors ms  register ms  components  module" << std::endl;
+	for(const module& mod : modules)
+	{
+		total += mod.total();
+		components += mod.components;
+		out << std::fixed << std::setprecision(3)
+			<< std::setw(13) << mod.total() / 1e6
+			<< std::setw(10) << mod.open / 1e6
+			<< std::setw(11) << mod.constructors / 1e6
+			<< std::setw(13) << mod.registration / 1e6
+			<< std::setw(12) << mod.components
+			<< "  " << mod.path << (mod.loaded ? "" : " (not loaded)") << std::endl;
+	}
+	out << std::setw(13) << total / 1e6 << "  " << modules.size() << " module(s), " << components << " component(s)" << std::endl;
+	out.unsetf(std::ios_base::floatfield);
+}
+
+/**
+ * Write a string as a JSON string.
+ */
+static void write_json_string(std::ostream& out, const std::string& str)
+{
+	out << '"';
+	for(char c : str)
+	{
+		if(c == '"' || c == '\\')
+		{
+			out << '\\' << c;
+		}
+		else if(static_cast<unsigned char>(c) < 0x20)
+		{
+			out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec << std::setfill(' ');
+		}
+		else
+		{
+			out << c;
+		}
+	}
+	out << '"';
+}
+
+/**
+ * Write a complete event of a Chrome trace, times in nanoseconds.
+ */
+static void write_trace_event(std::ostream& out, const char* sep, const std::string& name, const char* category,
+		unsigned thread, std::uint64_t start, std::uint64_t duration)
+{
+	out << sep << std::endl << "{\"name\":";
+	write_json_string(out, name);
+	out << ",\"cat\":\"" << category << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread
+		<< ",\"ts\":" << start / 1e3 << ",\"dur\":" << duration / 1e3;
+}
+
+void load_profile::write_trace(std::ostream& out)const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	// Modules never timed, as crashed ones, have no start and are left out.
+	std::uint64_t origin = 0;
+	for(const module& mod : _modules)
+	{
+		if(mod.start != 0 && (origin == 0 || mod.start < origin))
+		{
+			origin = mod.start;
+		}
+	}
+
+	out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+	const char* sep = "";
+	for(const module& mod : _modules)
+	{
+		if(mod.start == 0)
+		{
+			continue;
+		}
+		std::uint64_t start = mod.start - origin;
+		write_trace_event(out, sep, mod.path, "module", mod.thread, start, mod.total());
+		out << ",\"args\":{\"components\":" << mod.components << ",\"loaded\":" << (mod.loaded ? "true" : "false")
+			<< ",\"registration_us\":" << mod.registration / 1e3 << "}}";
+		sep = ",";
+		write_trace_event(out, sep, "open", "open", mod.thread, start, mod.open);
+		out << "}";
+		if(mod.components > 0)
+		{
+			write_trace_event(out, sep, "constructors", "constructors", mod.thread, start + mod.open, mod.constructors + mod.registration);
+			out << "}";
+		}
+	}
+	out << std::endl << "],\"displayTimeUnit\":\"ms\"}" << std::endl;
+	out.unsetf(std::ios_base::floatfield);
+}
+
+bool load_profile::write_trace(const std::string& filename)const
+{
+	std::ofstream file(filename, std::ios_base::trunc);
+	write_trace(file);
+	return static_cast<bool>(file);
+}
+
 } // namespace di
@@ -21,13 +21,25 @@
 #ifndef _DI_HPP_
 #define _DI_HPP_
 
+#include "di-config.hpp"
+
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <memory>
-#include <stack>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <tuple>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace di
@@ -49,45 +61,479 @@ typedef std::shared_ptr<di::component> component_ptr_t;
 typedef std::map<std::string, std::string> properties_t;
 typedef std::initializer_list<std::pair<const std::string, std::string>> properties_init_list_t;
 
+/**
+ * Reference to an interned string.
+ * Equal interned strings are the same string, they can be compared by
+ * address. Interned strings are reference counted: a string is released
+ * with its last reference.
+ */
+class interned_string
+{
+public:
+	interned_string() = default;
+	interned_string(const interned_string& other):_str(other._str){if(_str != nullptr){retain();}}
+	interned_string(interned_string&& other):_str(other._str){other._str = nullptr;}
+	~interned_string(){if(_str != nullptr){release();}}
+
+	interned_string& operator = (interned_string other){std::swap(_str, other._str); return *this;}
+
+	/** The interned string, null if none. */
+	const std::string* get()const{return _str;}
+	const std::string& operator*()const{return *_str;}
+	const std::string* operator->()const{return _str;}
+	explicit operator bool()const{return _str != nullptr;}
+
+private:
+	friend interned_string intern(const std::string& str);
+	friend interned_string intern(std::string&& str);
+	friend interned_string find_interned(const std::string& str);
+
+	/** Adopt a reference already taken. */
+	explicit interned_string(const std::string* str):_str(str){}
+
+	void retain();
+	void release();
+
+	const std::string* _str = nullptr;
+};
+
+/**
+ * Intern a string.
+ * 
+eturn A reference to the unique instance of the string.
+ */
+interned_string intern(const std::string& str);
+interned_string intern(std::string&& str);
+
+/**
+ * Look up an interned string, without interning it.
+ * 
+eturn A reference to the unique instance of the string, null if it is not interned.
+ */
+interned_string find_interned(const std::string& str);
+
+/**
+ * Compact property map, used to keep component properties.
+ * Keys and values are interned strings, kept in a vector sorted by key,
+ * inline for up to 4 properties. Copying a property map only copies
+ * pointers and takes references on them.
+ * It can be read as a properties_t: iteration is in key order and yields
+ * (key, value) pairs of string references.
+ */
+class property_map
+{
+public:
+	/** Property, as key and value interned strings, each holding a reference. */
+	struct entry
+	{
+		const std::string* key;
+		const std::string* value;
+	};
+
+	typedef std::pair<const std::string&, const std::string&> value_type;
+
+	class const_iterator
+	{
+	public:
+		typedef std::random_access_iterator_tag iterator_category;
+		typedef property_map::value_type value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef value_type reference;
+
+		/** Holder of a dereferenced pair, for operator->. */
+		struct pointer
+		{
+			value_type pair;
+			const value_type* operator->()const{return &pair;}
+		};
+
+		const_iterator() = default;
+		explicit const_iterator(const entry* it):_it(it){}
+
+		value_type operator*()const{return value_type(*_it->key, *_it->value);}
+		pointer operator->()const{return pointer{**this};}
+
+		const_iterator& operator++(){++_it; return *this;}
+		const_iterator operator++(int){const_iterator res(*this); ++_it; return res;}
+		const_iterator& operator--(){--_it; return *this;}
+		const_iterator operator--(int){const_iterator res(*this); --_it; return res;}
+		const_iterator& operator+=(difference_type n){_it += n; return *this;}
+		const_iterator operator+(difference_type n)const{return const_iterator(_it + n);}
+		difference_type operator-(const const_iterator& other)const{return _it - other._it;}
+
+		bool operator==(const const_iterator& other)const{return _it == other._it;}
+		bool operator!=(const const_iterator& other)const{return _it != other._it;}
+
+	private:
+		const entry* _it = nullptr;
+	};
+	typedef const_iterator iterator;
+
+	property_map() = default;
+	property_map(const properties_t& prop);
+	property_map(properties_t&& prop);
+	property_map(properties_init_list_t prop);
+	property_map(const property_map& other);
+	property_map(property_map&& other);
+	~property_map();
+
+	property_map& operator = (const property_map& other);
+	property_map& operator = (property_map&& other);
+
+	std::size_t size()const{return _size;}
+	bool empty()const{return _size == 0;}
+
+	const_iterator begin()const{return const_iterator(data());}
+	const_iterator end()const{return const_iterator(data() + _size);}
+
+	const_iterator find(const std::string& key)const;
+	std::size_t count(const std::string& key)const{return find(key) != end() ? 1 : 0;}
+
+	/**
+	 * Value of a property.
+	 * \throw std::out_of_range if there is no such property.
+	 */
+	const std::string& at(const std::string& key)const;
+
+	/**
+	 * Set a property, replacing its previous value if any.
+	 */
+	void set(const std::string& key, const std::string& value);
+
+	/**
+	 * Remove a property.
+	 * \return Number of removed properties.
+	 */
+	std::size_t erase(const std::string& key);
+
+	/**
+	 * Copy properties in a properties_t.
+	 */
+	properties_t to_map()const;
+	operator properties_t()const{return to_map();}
+
+private:
+	static const std::size_t inline_capacity = 4;
+
+	const entry* data()const{return _capacity > inline_capacity ? _heap : _inline;}
+	entry* data(){return _capacity > inline_capacity ? _heap : _inline;}
+
+	/** Position where the key is or should be inserted. */
+	std::size_t lower_bound(const std::string& key)const;
+
+	void insert(std::size_t pos, const entry& e);
+
+	std::size_t _size = 0;
+	std::size_t _capacity = inline_capacity;
+	union
+	{
+		entry  _inline[inline_capacity];
+		entry* _heap;
+	};
+};
+
+/**
+ * Interface provided by a component.
+ * Associates an interface type with the function converting the component
+ * pointer to a pointer to this interface, so typed lookups of declared
+ * interfaces do not need any dynamic_cast.
+ */
+struct component_interface
+{
+	std::type_index type;
+	void* (*cast)(component*);
+};
+
+typedef std::vector<component_interface> interfaces_t;
+
+/**
+ * Convert a component, known to be a C, to one of its interfaces I.
+ */
+template<typename C, typename I>
+void* interface_cast(component* comp)
+{
+	return static_cast<I*>(static_cast<C*>(comp));
+}
+
+/**
+ * Build the list of interfaces provided by a component of type C.
+ * The list always contains di::component and C itself, followed by Interfaces.
+ */
+template<typename C, typename... Interfaces>
+interfaces_t interfaces_of()
+{
+	return {
+		{typeid(component), &interface_cast<C, component>},
+		{typeid(C), &interface_cast<C, C>},
+		{typeid(Interfaces), &interface_cast<C, Interfaces>}...
+	};
+}
+
+/**
+ * Error raised when a component cannot be created because one of its
+ * dependencies is missing or depends on it.
+ */
+class resolution_error : public std::runtime_error
+{
+public:
+	explicit resolution_error(const std::string& what):
+	std::runtime_error(what)
+	{}
+};
+
+/**
+ * Readable name of a type.
+ */
+std::string type_name(const std::type_info& type);
+
+/**
+ * Lifetime of the instances of a lazy component.
+ */
+enum component_lifetime
+{
+	/** One instance, shared by all users. */
+	singleton,
+	/** One instance per thread, created by the first request of each thread. */
+	per_thread,
+	/** A new instance for each request. */
+	transient
+};
+
+/**
+ * Factory of a lazy component.
+ * Creates the component the first time it is requested, once, even if
+ * requested by many threads at the same time. If the creation function
+ * throws, the component is not created and next requests try again.
+ * Creations are serialized: a creation function may request other lazy
+ * components, but requesting its own component, even indirectly, raises
+ * a resolution_error describing the cycle.
+ * Per thread and transient factories create instances according to their
+ * lifetime instead, without serialization. Per thread instances are
+ * released when their thread exits, or when their factory is destroyed:
+ * at once for the destroying thread, and by the next per thread request
+ * for other threads.
+ */
+class component_factory
+{
+public:
+	typedef std::function<component_ptr_t()> function_t;
+
+	explicit component_factory(function_t create, const std::string& name = std::string(), component_lifetime lifetime = singleton);
+	~component_factory();
+
+	/**
+	 * Name of the created component, for error messages.
+	 * Factories created without a name, like those of component instances,
+	 * are named after the component registering them.
+	 */
+	std::string name()const;
+
+	component_lifetime lifetime()const{return _lifetime;}
+
+	/** Unique serial of the factory, never reused. */
+	std::uint64_t serial()const{return _serial;}
+
+	/**
+	 * Names, as given by std::type_info::name(), of types provided by the
+	 * created component, when they are only known by name, like for
+	 * placeholders of modules not loaded yet. Components registered without
+	 * declared interfaces are matched by typed lookups on these names, then
+	 * converted by dynamic_cast once created.
+	 * Must be set before registration.
+	 */
+	const std::vector<std::string>& types()const{return _types;}
+	component_factory& types(std::vector<std::string> types){_types = std::move(types); return *this;}
+
+	/**
+	 * Function called before each creation, outside of the creation lock,
+	 * for work which must not wait for other creations, like opening the
+	 * module providing the component: module constructors may create lazy
+	 * components themselves. A creation requested while another one is in
+	 * progress in the same thread still runs it under the creation lock.
+	 * If it throws, the component is not created.
+	 * Must be set before registration.
+	 */
+	component_factory& prepare(std::function<void()> prepare){_prepare = std::move(prepare); return *this;}
+
+	component_factory(const component_factory&) = delete;
+	component_factory& operator = (const component_factory&) = delete;
+
+	/**
+	 * Retrieve the component, creating it if needed.
+	 * \param holder Receives new transient instances, to keep them alive.
+	 */
+	const component_ptr_t& get(component_ptr_t& holder)
+	{
+		if(_lifetime == transient)
+		{
+			return holder = invoke();
+		}
+		return get();
+	}
+
+	/**
+	 * Retrieve the component, creating it if needed.
+	 * A transient instance is only kept until the next request of a
+	 * transient component by the same thread, prefer get(holder).
+	 */
+	const component_ptr_t& get()
+	{
+		if(_lifetime == singleton && _created.load(std::memory_order_acquire))
+		{
+			return _comp;
+		}
+		return create();
+	}
+
+	/**
+	 * Test if an instance of the component was created.
+	 */
+	bool created()const
+	{
+		return _created.load(std::memory_order_acquire);
+	}
+
+	/**
+	 * Test if a component is the instance of this factory, for the current
+	 * thread if per thread. Never true for transient components.
+	 */
+	bool holds(const component* comp)const;
+
+	/**
+	 * Serial of the factory holding a component: of its singleton instance, or
+	 * of its per thread instance for the current thread.
+	 * \return 0 if no factory holds the component.
+	 */
+	static std::uint64_t holder(const component* comp);
+
+private:
+	const component_ptr_t& create();
+
+	/**
+	 * Call the creation function, detecting cycles.
+	 */
+	component_ptr_t invoke();
+
+	function_t        _create;
+	std::function<void()> _prepare;
+	std::string       _name;
+	component_lifetime _lifetime;
+	std::vector<std::string> _types;
+	/** Unique serial of the factory, identifying its per thread instances. */
+	std::uint64_t     _serial;
+	component_ptr_t   _comp;
+	std::atomic<bool> _created{false};
+	/** Expires with a per thread factory, for threads to release its instances. */
+	std::shared_ptr<void> _alive;
+};
+
+typedef std::shared_ptr<component_factory> component_factory_ptr_t;
+
+/**
+ * Bounded pool of recycled component instances, for transient components.
+ * Acquired instances return to the pool when their last reference is
+ * released instead of being destroyed, and are handed out again as is:
+ * pooled components must be reusable without reconstruction.
+ * Each thread keeps up to 'thread_capacity' idle instances of the pool,
+ * other released instances are shared by all threads up to 'capacity',
+ * extra instances are destroyed. Idle instances cached by threads are
+ * released when their thread exits.
+ */
+class component_pool
+{
+public:
+	typedef std::function<component*()> function_t;
+
+	component_pool(function_t create, std::size_t capacity, std::size_t thread_capacity = 8);
+	~component_pool();
+
+	component_pool(const component_pool&) = delete;
+	component_pool& operator = (const component_pool&) = delete;
+
+	/**
+	 * Retrieve an idle instance, creating one if there is none.
+	 */
+	component_ptr_t acquire();
+
+	std::size_t capacity()const;
+
+	/** Number of idle instances shared by threads. */
+	std::size_t idle()const;
+
+	/** Number of instances created by the pool. */
+	std::size_t created()const;
+
+	struct state;
+private:
+	std::shared_ptr<state> _state;
+};
+
 /**
  * Component descriptor.
  * Internal structure used to keep component properties in registry.
  * Each component has:
  * - a unique numeric identifier 'id'
  * - a name 'name', which should be unique
- * - its shared pointer 'comp'
- * - a key/value property map 'prop'
+ * - its shared pointer 'comp', null for lazy components
+ * - a key/value property map 'prop', whose strings are interned
+ * - the list of its declared interfaces 'provides', empty if it declares none.
+ *   Components without declared interfaces are matched by dynamic_cast.
+ * - the factory of lazy components 'factory', null for other components.
+ *   Lazy components are created by the first lookup hitting them, by name,
+ *   by id or by type. As they cannot be matched by dynamic_cast before being
+ *   created, typed lookups only find them through their declared interfaces.
  */
 struct component_descriptor
 {
 	component_id    id;
 	std::string     name;
 	component_ptr_t comp;
-	properties_t    prop;
+	property_map    prop;
+	interfaces_t    provides;
+	component_factory_ptr_t factory;
+
+	// Names and pointers are taken by value and moved in: temporaries are
+	// not copied on their way to the registry.
+
+	component_descriptor(component_id id, std::string name, component_ptr_t comp):
+	id(id), name(std::move(name)), comp(std::move(comp))
+	{}
+
+	component_descriptor(component_id id, std::string name, component_ptr_t comp, const properties_t& prop):
+	id(id), name(std::move(name)), comp(std::move(comp)), prop(prop)
+	{}
+
+	component_descriptor(component_id id, std::string name, component_ptr_t comp, properties_t&& prop):
+	id(id), name(std::move(name)), comp(std::move(comp)), prop(std::move(prop))
+	{}
 
-	component_descriptor(component_id id, const std::string& name, component_ptr_t comp):
-	id(id), name(name), comp(comp)
+	component_descriptor(component_id id, std::string name, component_ptr_t comp, properties_init_list_t prop):
+	id(id), name(std::move(name)), comp(std::move(comp)), prop(prop)
 	{}
 
-	component_descriptor(component_id id, const std::string& name, component_ptr_t comp, const properties_t& prop):
-	id(id), name(name), comp(comp), prop(prop)
+	component_descriptor(component_id id, std::string name, component_ptr_t comp, const properties_t& prop, interfaces_t provides):
+	id(id), name(std::move(name)), comp(std::move(comp)), prop(prop), provides(std::move(provides))
 	{}
 
-	component_descriptor(component_id id, const std::string& name, component_ptr_t comp, properties_t&& prop):
-	id(id), name(name), comp(comp), prop(std::move(prop))
+	component_descriptor(component_id id, std::string name, component_ptr_t comp, properties_t&& prop, interfaces_t provides):
+	id(id), name(std::move(name)), comp(std::move(comp)), prop(std::move(prop)), provides(std::move(provides))
 	{}
 
-	component_descriptor(component_id id, const std::string& name, component_ptr_t comp, properties_init_list_t prop):
-	id(id), name(name), comp(comp), prop(prop)
+	component_descriptor(component_id id, std::string name, component_factory_ptr_t factory, const properties_t& prop, interfaces_t provides):
+	id(id), name(std::move(name)), prop(prop), provides(std::move(provides)), factory(std::move(factory))
+	{}
+
+	component_descriptor(component_id id, std::string name, component_factory_ptr_t factory, properties_t&& prop, interfaces_t provides):
+	id(id), name(std::move(name)), prop(std::move(prop)), provides(std::move(provides)), factory(std::move(factory))
 	{}
 
 
 	component_descriptor(const component_descriptor& desc):
-		id(desc.id), name(desc.name), comp(desc.comp), prop(desc.prop)
+		id(desc.id), name(desc.name), comp(desc.comp), prop(desc.prop), provides(desc.provides), factory(desc.factory)
 	{}
 
 	component_descriptor(component_descriptor&& desc):
-		id(desc.id), name(std::move(desc.name)), comp(std::move(desc.comp)), prop(std::move(desc.prop))
+		id(desc.id), name(std::move(desc.name)), comp(std::move(desc.comp)), prop(std::move(desc.prop)), provides(std::move(desc.provides)), factory(std::move(desc.factory))
 	{}
 
 	component_descriptor& operator = (const component_descriptor& desc)
@@ -96,6 +542,8 @@ struct component_descriptor
 		name = desc.name;
 		comp = desc.comp;
 		prop = desc.prop;
+		provides = desc.provides;
+		factory = desc.factory;
 		return *this;
 	}
 
@@ -105,383 +553,2141 @@ struct component_descriptor
 		name = std::move(desc.name);
 		comp = std::move(desc.comp);
 		prop = std::move(desc.prop);
+		provides = std::move(desc.provides);
+		factory = std::move(desc.factory);
 		return *this;
 	}
 
+	/**
+	 * Retrieve the component, creating it first if it is lazy and not yet created.
+	 * \param holder Receives new instances of transient components.
+	 */
+	const component_ptr_t& instance(component_ptr_t& holder)const
+	{
+		return factory ? factory->get(holder) : comp;
+	}
+
+	/**
+	 * Retrieve the component, creating it first if it is lazy and not yet created.
+	 * See component_factory::get() for transient components.
+	 */
+	const component_ptr_t& instance()const
+	{
+		return factory ? factory->get() : comp;
+	}
+
+	/**
+	 * Test if the component is transient, a new instance being created by each lookup.
+	 */
+	bool is_transient()const
+	{
+		return factory && factory->lifetime() == transient;
+	}
 
 
 };
 
 /**
- * Component registry.
- * Container which holds components.
+ * Declarative query on component properties.
+ * A component matches the query when it matches all of its conditions.
+ * Registries answer queries with indexes on properties, without visiting
+ * components missing any of the queried properties nor, if the query has
+ * an equality condition, components with other values.
+ * An empty query matches all components.
  */
-class registry
+class property_query
 {
 public:
-	registry(registry* parent = nullptr);
-	~registry();
-
-	typedef std::vector<component_descriptor> comp_holder;
+	property_query() = default;
 
 	/**
-	 * Retrieve default registry singleton.
+	 * Require a property with a given value.
 	 */
-	static registry& get();
-
-	registry* parent(){return _parent;}
-	const registry* parent()const{return _parent;}
-	registry& parent(registry* parent){_parent = parent;}
+	property_query& equals(const std::string& key, const std::string& value);
 
 	/**
-	 * Retrieve number of registered components.
+	 * Require a property, whatever its value.
 	 */
-	std::size_t size()const;
+	property_query& has(const std::string& key);
 
 	/**
-	 * Find a component from its unique id.
-	 */
-	const component_descriptor* get(component_id id) const;
-	/**
-	 * Find a component from it name.
-	 */
-	const component_descriptor* get(const std::string& name) const;
-	/**
-	 * Find a component from its pointer.
+	 * Require a property whose value starts with a prefix.
 	 */
-	const component_descriptor* get(const component* comp) const;
+	property_query& prefix(const std::string& key, const std::string& prefix);
 
 	/**
-	 * Register a new component.
+	 * Test if a component matches the query.
 	 */
-	const component_descriptor& set(const component_descriptor& desc);
-	const component_descriptor& set(component_descriptor&& desc);
-	const component_descriptor& set(const std::string& name, component_ptr_t comp);
-	const component_descriptor& set(const std::string& name, component_ptr_t comp, const properties_t& prop);
-	const component_descriptor& set(const std::string& name, component_ptr_t comp, properties_t&& prop);
-	const component_descriptor& set(const std::string& name, component_ptr_t comp, properties_init_list_t prop);
+	bool match(const component_descriptor& desc)const;
+
+	bool empty()const{return _conditions.empty();}
+
+private:
+	friend class registry;
+
+	enum kind
+	{
+		equal,
+		present,
+		starts_with
+	};
 
 	/**
-	 * Unregister an already registered component.
+	 * Query strings are not interned, queries would keep strings of no
+	 * component alive. A key or value not interned yet cannot match any
+	 * component: it is kept as text and looked up again when the query is
+	 * evaluated.
 	 */
-	static void erase(component_id id);
+	struct condition
+	{
+		kind               type;
+		/** Interned key, null if not interned yet. */
+		interned_string    key;
+		/** Interned value for equality conditions, null if not interned yet. */
+		interned_string    value;
+		/** Key text, when not interned yet. */
+		std::string        key_text;
+		/** Value text when not interned yet, value prefix for prefix conditions. */
+		std::string        value_text;
+
+		/**
+		 * Interned key or value, null if still not interned.
+		 * \param holder Keeps a string looked up again alive.
+		 */
+		const std::string* resolved_key(interned_string& holder)const{return key ? key.get() : (holder = find_interned(key_text)).get();}
+		const std::string* resolved_value(interned_string& holder)const{return value ? value.get() : (holder = find_interned(value_text)).get();}
+	};
+
+	std::vector<condition> _conditions;
+};
 
+/**
+ * Epoch based memory reclamation.
+ * Readers of concurrent registries run inside an epoch::guard. Memory retired
+ * by a writer at a given epoch is released only when no reader which entered
+ * its guard at or before this epoch is still inside it.
+ * Readers never block and never write shared memory but their own record.
+ */
+class epoch
+{
+public:
 	/**
-	 * Find a component from its unique id.
+	 * Read section guard.
+	 * The section is entered on demand and left on destruction. Nested
+	 * sections of a same thread are allowed.
 	 */
-	component_ptr_t find(component_id id) const;
+	class guard
+	{
+	public:
+		guard() = default;
+		guard(const guard&) = delete;
+		guard& operator = (const guard&) = delete;
+
+		~guard()
+		{
+			if(_entered)
+			{
+				epoch::leave();
+			}
+		}
+
+		void enter()
+		{
+			if(!_entered)
+			{
+				epoch::enter();
+				_entered = true;
+			}
+		}
+
+	private:
+		bool _entered = false;
+	};
+
 	/**
-	 * Find a component from its name (the first found).
+	 * Advance the global epoch.
+	 * Must be called after unpublishing memory to retire.
+	 * \return Epoch at which the memory is retired.
 	 */
-	component_ptr_t find(const std::string& name) const;
+	static std::uint64_t retire();
 
 	/**
-	 * Find a component from a type.
+	 * Test if memory retired at the given epoch can be released.
 	 */
-	template<typename T>
-	std::shared_ptr<T> find()const
+	static bool releasable(std::uint64_t retired);
+
+private:
+	static void enter();
+	static void leave();
+};
+
+
+/**
+ * Lookup statistics, collected per thread when libdi is configured with
+ * --enable-instrumentation, which defines DI_INSTRUMENTATION in
+ * di-config.hpp for the library and the code using it alike. Otherwise
+ * lookups are not instrumented at all and statistics stay empty.
+ * Each thread updates its own counters without synchronization, they are
+ * summed on demand by collect().
+ */
+class lookup_statistics
+{
+public:
+	/** Kinds of lookups. */
+	enum kind
+	{
+		find_id, find_name, find_type, find_all_type, find_if, find_all_if,
+		find_query, find_all_query, visit, foreach,
+		kind_count
+	};
+
+	/** Work done by lookups. */
+	enum counter
+	{
+		/** Descriptors visited. */
+		visited,
+		/** dynamic_cast attempts. */
+		casts,
+		/** Registries walked, a registry and each of its parents counting for one. */
+		levels,
+		/** Typed lookups answered by the lookup cache. */
+		cache_hits,
+		/** Typed lookups missing the lookup cache. */
+		cache_misses,
+		counter_count
+	};
+
+	/** Latency buckets: bucket n counts lookups taking less than 2^n ns, the last one the others. */
+	static const std::size_t latency_buckets = 24;
+
+	/**
+	 * Statistics, of a thread or summed over threads.
+	 */
+	struct snapshot
+	{
+		std::uint64_t lookups[kind_count] = {};
+		std::uint64_t counters[counter_count] = {};
+		std::uint64_t latency[kind_count][latency_buckets] = {};
+
+		snapshot& operator += (const snapshot& other);
+	};
+
+	/**
+	 * Times a lookup and counts it, on destruction.
+	 */
+	class timer
+	{
+	public:
+		explicit timer(kind k):_kind(k), _start(std::chrono::steady_clock::now()){}
+		~timer();
+
+		timer(const timer&) = delete;
+		timer& operator = (const timer&) = delete;
+	private:
+		kind _kind;
+		std::chrono::steady_clock::time_point _start;
+	};
+
+	/** True if libdi itself was compiled with DI_INSTRUMENTATION. */
+	static bool enabled();
+
+	static void count(counter c, std::uint64_t n = 1);
+	static void record(kind k, std::uint64_t ns);
+
+	/** Statistics summed over all threads, including exited ones. */
+	static snapshot collect();
+
+	/** Reset statistics of all threads. */
+	static void reset();
+
+	/** Print statistics summed over all threads. */
+	static void dump(std::ostream& out);
+
+	static const char* name(kind k);
+	static const char* name(counter c);
+};
+
+#ifdef DI_INSTRUMENTATION
+#define DI_LOOKUP(kind)        ::di::lookup_statistics::timer di_lookup_timer(::di::lookup_statistics::kind)
+#define DI_COUNT(counter, n)   ::di::lookup_statistics::count(::di::lookup_statistics::counter, n)
+#else
+#define DI_LOOKUP(kind)
+#define DI_COUNT(counter, n)
+#endif
+
+
+class registry;
+
+/**
+ * Anchor of a registry.
+ * Shared with component handles, it points to the registry holding their
+ * components, or to nothing once the registry is destroyed.
+ */
+struct registry_anchor
+{
+	std::atomic<registry*> reg;
+};
+
+/**
+ * Handle on a registered component.
+ * Allows to erase the component from its registry in constant time.
+ */
+class component_handle
+{
+public:
+	component_handle() = default;
+
+	/** Id of the component, -1 for an empty handle. */
+	component_id id()const{return _id;}
+
+	explicit operator bool()const{return _id != -1;}
+
+	/** Registry holding the component, null if empty or if the registry is destroyed. */
+	registry* owner()const{return _anchor ? _anchor->reg.load() : nullptr;}
+
+	/**
+	 * Descriptor of the component as registered, null for an empty handle.
+	 * The handle keeps it alive, even once the component is erased.
+	 */
+	const component_descriptor* descriptor()const{return _desc.get();}
+
+private:
+	friend class registry;
+	friend class component_loader;
+
+	component_handle(std::shared_ptr<registry_anchor> anchor, std::size_t slot, component_id id, std::shared_ptr<const component_descriptor> desc):
+	_anchor(std::move(anchor)), _desc(std::move(desc)), _slot(slot), _id(id)
+	{}
+
+	std::shared_ptr<registry_anchor> _anchor;
+	std::shared_ptr<const component_descriptor> _desc;
+	/** Slot of the component in the registry, as a hint. */
+	std::size_t _slot = 0;
+	component_id _id = -1;
+};
+
+
+/**
+ * Component registry.
+ * Container which holds components.
+ *
+ * A registry is either unsynchronized (default) or concurrent.
+ * An unsynchronized registry must not be modified while it is read.
+ * A concurrent registry can be read and modified from any thread: readers
+ * never block and work on an immutable snapshot of the component table,
+ * writers are serialized and atomically publish a modified copy of it.
+ * Each write of a concurrent registry thus costs a copy of its table, in
+ * time and memory proportional to its component count: register many
+ * components with set_batch(). Components registered by a module while it
+ * is loaded are published at once, when the load completes.
+ * Descriptor pointers returned by get() stay valid until the component is
+ * erased and, for concurrent registries, no more read in progress.
+ */
+class registry
+{
+public:
+	/**
+	 * Synchronization policy of a registry.
+	 */
+	enum sync_policy
+	{
+		unsynchronized,
+		concurrent
+	};
+
+	registry(registry* parent = nullptr, sync_policy policy = unsynchronized);
+	~registry();
+
+	/**
+	 * Retrieve default registry singleton.
+	 */
+	static registry& get();
+
+	registry* parent(){return _parent;}
+	const registry* parent()const{return _parent;}
+	registry& parent(registry* parent);
+
+	sync_policy policy()const{return _policy;}
+
+	/**
+	 * Flatten the registry and its parents.
+	 * A flattened registry maintains a view merging its components and
+	 * those of all its parents, so lookups through it search one table
+	 * whatever its depth; only the generations of its parents are read, to
+	 * check the view is current. The view is rebuilt by the first lookup
+	 * following a modification of the registry or of one of its parents.
+	 * Flatten registries with deep hierarchies and rare modifications, like
+	 * the upper levels of a hierarchy; their children look up their own
+	 * components then the view of their flattened parent.
+	 * Like parent(), must not be changed while the registry is in use.
+	 */
+	registry& flatten(bool flat);
+	bool flattened()const{return _flat;}
+
+	/**
+	 * Retrieve number of registered components.
+	 */
+	std::size_t size()const;
+
+	/**
+	 * Generation of the registry and its parents.
+	 * Increases each time a component is registered in or erased from the
+	 * registry or one of its parents, or a parent is changed.
+	 * Read along the parent chain: writers do not update their descendants.
+	 */
+	std::uint64_t generation()const
+	{
+		std::uint64_t res = 0;
+		for(const registry* reg=this; reg!=nullptr; reg = reg->parent())
+		{
+			res += reg->_generation.load(std::memory_order_acquire);
+		}
+		return res;
+	}
+
+	/**
+	 * Find a component from its unique id.
+	 */
+	const component_descriptor* get(component_id id) const;
+	/**
+	 * Find a component from it name.
+	 */
+	const component_descriptor* get(const std::string& name) const;
+	/**
+	 * Find a component from its pointer.
+	 */
+	const component_descriptor* get(const component* comp) const;
+
+	/**
+	 * Register a new component.
+	 */
+	const component_descriptor& set(const component_descriptor& desc);
+	const component_descriptor& set(component_descriptor&& desc);
+	const component_descriptor& set(const std::string& name, component_ptr_t comp);
+	const component_descriptor& set(const std::string& name, component_ptr_t comp, const properties_t& prop);
+	const component_descriptor& set(const std::string& name, component_ptr_t comp, properties_t&& prop);
+	const component_descriptor& set(const std::string& name, component_ptr_t comp, properties_init_list_t prop);
+
+	/**
+	 * Register many components at once.
+	 * Tables and indexes are grown once for the whole batch, and concurrent
+	 * registries copy and publish their table once: readers see either none
+	 * or all of the batch.
+	 * \param descs Descriptors to register, their ids are ignored.
+	 * \return Ids of the registered components, in the order of descs.
+	 */
+	std::vector<component_id> set_batch(std::vector<component_descriptor>&& descs);
+
+	/**
+	 * Retrieve a handle on a component of this registry (not of its parents).
+	 * \return The handle, empty if the component is not found.
+	 */
+	component_handle handle(component_id id) const;
+
+	/**
+	 * Unregister an already registered component.
+	 * Look for the component in all registries.
+	 */
+	static void erase(component_id id);
+
+	/**
+	 * Unregister an already registered component, in constant time.
+	 * Does nothing if the component or its registry do not exist anymore.
+	 */
+	static void erase(const component_handle& handle);
+
+	/**
+	 * Find a component from its unique id.
+	 */
+	component_ptr_t find(component_id id) const;
+	/**
+	 * Find a component from its name (the first found).
+	 */
+	component_ptr_t find(const std::string& name) const;
+
+	/**
+	 * Find a component from a type.
+	 * Results are cached per thread until the generation of the registry changes.
+	 */
+	template<typename T>
+	std::shared_ptr<T> find()const
+	{
+		DI_LOOKUP(find_type);
+		std::uint64_t gen = generation();
+		const cache_entry& cached = cache(&typeid(T));
+		if(cached.generation == gen)
+		{
+			if(cached.ptr == nullptr)
+			{
+				DI_COUNT(cache_hits, 1);
+				return std::shared_ptr<T>();
+			}
+			std::shared_ptr<void> comp = cached.comp.lock();
+			if(comp)
+			{
+				DI_COUNT(cache_hits, 1);
+				return std::shared_ptr<T>(comp, static_cast<T*>(cached.ptr));
+			}
+		}
+		DI_COUNT(cache_misses, 1);
+
+		bool cacheable = true;
+		std::shared_ptr<T> res = find_first<T>(cacheable);
+		if(!cacheable)
+		{
+			return res;
+		}
+		// The lookup may have used the cache (lazy components), look for the entry again.
+		cache_entry& entry = cache(&typeid(T));
+		entry.generation = gen;
+		entry.comp = res;
+		entry.ptr = res.get();
+		return res;
+	}
+
+	/**
+	 * Find a component from a type, without using the lookup cache.
+	 */
+	template<typename T>
+	std::shared_ptr<T> find_uncached()const
+	{
+		DI_LOOKUP(find_type);
+		bool cacheable;
+		return find_first<T>(cacheable);
+	}
+
+	/**
+	 * Find a list of components from a type.
+	 */
+	template<typename T>
+	std::vector<std::shared_ptr<T>> find_all()const
+	{
+		DI_LOOKUP(find_all_type);
+		std::vector<std::shared_ptr<T>> res;
+		epoch::guard guard;
+		for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+		{
+			reg->lookup(guard).walk<T>([&](const component_descriptor&, const component_ptr_t& comp, T* ptr){
+				res.emplace_back(comp, ptr);
+				return true;
+			});
+		}
+		return res;
+	}
+
+	/**
+	 * Find a component from a type and a predicate.
+	 */
+	template<typename T, typename UnaryPredicate>
+	std::shared_ptr<T> find_if(UnaryPredicate p)const
+	{
+		DI_LOOKUP(find_if);
+		std::shared_ptr<T> res;
+		epoch::guard guard;
+		for(const registry* reg=this; reg!=nullptr && !res; reg = reg->lookup_parent())
+		{
+			reg->lookup(guard).walk<T>(p, [&](const component_descriptor&, const component_ptr_t& comp, T* ptr){
+				res = std::shared_ptr<T>(comp, ptr);
+				return false;
+			});
+		}
+		return res;
+	}
+
+	/**
+	 * Find a list of components from a type and a predicate.
+	 */
+	template<typename T, typename UnaryPredicate>
+	std::vector<std::shared_ptr<T>> find_all_if(UnaryPredicate p)const
+	{
+		DI_LOOKUP(find_all_if);
+		std::vector<std::shared_ptr<T>> res;
+		epoch::guard guard;
+		for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+		{
+			reg->lookup(guard).walk<T>(p, [&](const component_descriptor&, const component_ptr_t& comp, T* ptr){
+				res.emplace_back(comp, ptr);
+				return true;
+			});
+		}
+		return res;
+	}
+
+	/**
+	 * Find the first registered component matching a property query.
+	 */
+	component_ptr_t find(const property_query& query)const;
+
+	/**
+	 * Find all components matching a property query.
+	 * Components of a registry are returned in registration order, except
+	 * for an empty query which returns them as foreach() visits them.
+	 */
+	std::vector<component_ptr_t> find_all(const property_query& query)const;
+
+	/**
+	 * Find the first registered component of a type matching a property query.
+	 */
+	template<typename T>
+	std::shared_ptr<T> find(const property_query& query)const
+	{
+		DI_LOOKUP(find_query);
+		std::shared_ptr<T> res;
+		epoch::guard guard;
+		for(const registry* reg=this; reg!=nullptr && !res; reg = reg->lookup_parent())
+		{
+			reg->lookup(guard).walk_query(query, [&](const component_descriptor& desc){
+				component_ptr_t comp;
+				T* ptr = cast<T>(desc, comp);
+				if(ptr != nullptr)
+				{
+					res = std::shared_ptr<T>(comp, ptr);
+					return false;
+				}
+				return true;
+			});
+		}
+		return res;
+	}
+
+	/**
+	 * Find all components of a type matching a property query.
+	 */
+	template<typename T>
+	std::vector<std::shared_ptr<T>> find_all(const property_query& query)const
+	{
+		DI_LOOKUP(find_all_query);
+		std::vector<std::shared_ptr<T>> res;
+		epoch::guard guard;
+		for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+		{
+			reg->lookup(guard).walk_query(query, [&](const component_descriptor& desc){
+				component_ptr_t comp;
+				T* ptr = cast<T>(desc, comp);
+				if(ptr != nullptr)
+				{
+					res.emplace_back(comp, ptr);
+				}
+				return true;
+			});
+		}
+		return res;
+	}
+
+	/**
+	 * Iterate on components matching a property query, recursivly.
+	 */
+	template<typename Action>
+	void foreach(const property_query& query, Action a)const
+	{
+		DI_LOOKUP(foreach);
+		epoch::guard guard;
+		for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+		{
+			reg->lookup(guard).walk_query(query, [&](const component_descriptor& desc){
+				a(desc);
+				return true;
+			});
+		}
+	}
+
+	/**
+	 * Visit all components of a type, in the same order as find_all<T>().
+	 * The visitor is called with a T& for each component, without building
+	 * any list nor touching reference counts. References must not be kept
+	 * after the visit: on concurrent registries components are only kept
+	 * alive until the visit ends.
+	 */
+	template<typename T, typename Visitor>
+	void visit(Visitor v)const
+	{
+		DI_LOOKUP(visit);
+		epoch::guard guard;
+		for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+		{
+			reg->lookup(guard).walk<T>([&](const component_descriptor&, const component_ptr_t&, T* ptr){
+				v(*ptr);
+				return true;
+			});
+		}
+	}
+
+	/**
+	 * Visit all components of a type accepted by a predicate on their descriptor,
+	 * in the same order as find_all_if<T>().
+	 */
+	template<typename T, typename UnaryPredicate, typename Visitor>
+	void visit_if(UnaryPredicate p, Visitor v)const
+	{
+		DI_LOOKUP(visit);
+		epoch::guard guard;
+		for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+		{
+			reg->lookup(guard).walk<T>(p, [&](const component_descriptor&, const component_ptr_t&, T* ptr){
+				v(*ptr);
+				return true;
+			});
+		}
+	}
+
+	/**
+	 * Iterate on components and recursivly.
+	 * Components of a registry are visited in slot order, which is their
+	 * registration order unless some components were erased.
+	 */
+	template<typename Action>
+	void foreach(Action a)const
+	{
+		DI_LOOKUP(foreach);
+		epoch::guard guard;
+		for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+		{
+			reg->lookup(guard).walk_all(a);
+		}
+	}
+
+	template<typename UnaryPredicate, typename Action>
+	void foreach_if(UnaryPredicate p, Action a)const
+	{
+		DI_LOOKUP(foreach);
+		epoch::guard guard;
+		for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+		{
+			reg->lookup(guard).walk_all([&](const component_descriptor& desc){
+				if(p(desc))
+				{
+					a(desc);
+				}
+			});
+		}
+	}
+
+	template<typename T, typename Action>
+	void foreach(Action a)const
+	{
+		DI_LOOKUP(foreach);
+		epoch::guard guard;
+		for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+		{
+			reg->lookup(guard).walk<T>([&](const component_descriptor& desc, const component_ptr_t&, T*){
+				a(desc);
+				return true;
+			});
+		}
+	}
+
+	template<typename T, typename UnaryPredicate, typename Action>
+	void foreach_if(UnaryPredicate p, Action a)const
+	{
+		DI_LOOKUP(foreach);
+		epoch::guard guard;
+		for(const registry* reg=this; reg!=nullptr; reg = reg->lookup_parent())
+		{
+			reg->lookup(guard).walk<T>(p, [&](const component_descriptor& desc, const component_ptr_t&, T*){
+				a(desc);
+				return true;
+			});
+		}
+	}
+
+private:
+	/**
+	 * Component slot.
+	 * Slots are reused once their component is erased, so positions of
+	 * other components never change.
+	 */
+	struct slot
+	{
+		/** Component descriptor, null if the slot is free. */
+		std::shared_ptr<const component_descriptor> desc;
+		/** Registration order of the component in the table. */
+		std::uint64_t seq;
+	};
+	typedef std::vector<slot> comp_holder;
+
+	/** Hash and equality of names, referenced in their descriptors. */
+	struct name_hash
+	{
+		std::size_t operator()(const std::string& name)const{return std::hash<std::string>()(name);}
+	};
+	struct name_equal
+	{
+		bool operator()(const std::string& a, const std::string& b)const{return a == b;}
+	};
+
+	/**
+	 * Index types, mapping keys to slots.
+	 * Names are not copied, keys refer to the names of the indexed descriptors.
+	 */
+	typedef std::unordered_multimap<std::reference_wrapper<const std::string>, std::size_t, name_hash, name_equal> name_index;
+	typedef std::unordered_map<component_id, std::size_t> id_index;
+	typedef std::unordered_multimap<const component*, std::size_t> ptr_index;
+	typedef std::unordered_multimap<std::uint64_t, std::size_t> factory_index;
+
+	/**
+	 * Slot of a component providing an interface, with its registration order
+	 * and its conversion function (null for components matched by dynamic_cast).
+	 * The slot is npos once the component is erased.
+	 */
+	struct interface_entry
+	{
+		std::size_t slot;
+		std::uint64_t seq;
+		void* (*cast)(component*);
+
+		bool erased()const{return slot == npos;}
+	};
+
+	/**
+	 * List of interface entries, sorted by registration order.
+	 * Erased entries are only marked, and skipped by readers, until they are
+	 * the majority: erasures do not move the following entries each time.
+	 */
+	struct interface_list
+	{
+		std::vector<interface_entry> entries;
+		/** Number of erased entries still in the list. */
+		std::size_t erased = 0;
+
+		/** Number of entries not erased. */
+		std::size_t size()const{return entries.size() - erased;}
+		bool empty()const{return size() == 0;}
+
+		void push_back(const interface_entry& entry){entries.push_back(entry);}
+
+		/**
+		 * Erase the entry of a registration order, if any.
+		 */
+		void erase(std::uint64_t seq);
+	};
+	typedef std::unordered_map<std::type_index, interface_list> interface_index;
+	typedef std::unordered_map<std::string, interface_list> type_name_index;
+
+	/**
+	 * Index of a property key: components having the property, and
+	 * components having it per value. Keys and values are interned strings.
+	 */
+	struct property_index
+	{
+		interface_list all;
+		std::unordered_map<const std::string*, interface_list> by_value;
+	};
+	typedef std::unordered_map<const std::string*, property_index> property_index_map;
+
+	/**
+	 * Component table.
+	 * Holds the components of a registry (not of its parents) and their indexes.
+	 * Tables of concurrent registries are never modified once published.
+	 */
+	struct table
+	{
+		comp_holder     components;
+		/** Free slots, reused first. */
+		std::vector<std::size_t> free;
+		/** Number of used slots. */
+		std::size_t     count = 0;
+		/** Number of lazy components, indexed by factory instead of pointer. */
+		std::size_t     lazy = 0;
+		/** Registration order of the next component. */
+		std::uint64_t   next_seq = 0;
+
+		name_index      by_name;
+		id_index        by_id;
+		ptr_index       by_ptr;
+		/** Lazy components, by factory serial. */
+		factory_index   by_factory;
+		interface_index by_interface;
+		/** Components without declared interfaces. */
+		interface_list  untyped;
+		/** Lazy components without declared interfaces, by name of the types they provide. */
+		type_name_index by_type_name;
+		property_index_map by_property;
+
+		/**
+		 * Add a component and index it.
+		 * \return Slot of the component.
+		 */
+		std::size_t add(component_descriptor&& desc);
+		std::size_t add(std::shared_ptr<const component_descriptor> desc);
+
+		/**
+		 * Prepare the table and its indexes for 'n' more components.
+		 */
+		void reserve(std::size_t n);
+
+		/**
+		 * Remove the component of a slot and unindex it.
+		 */
+		void remove(std::size_t pos);
+
+		/**
+		 * Slot of the component with the given id, or npos.
+		 */
+		std::size_t find(component_id id)const;
+
+		/**
+		 * Slot of the first registered component with the given name, or npos.
+		 */
+		std::size_t find(const std::string& name)const;
+
+		/**
+		 * Slot of the first registered component with the given pointer, or npos.
+		 */
+		std::size_t find(const component* comp)const;
+
+		/**
+		 * Descriptor of a slot, or null if the slot is npos.
+		 */
+		const component_descriptor* at(std::size_t pos)const
+		{
+			return pos != npos ? components[pos].desc.get() : nullptr;
+		}
+
+		/**
+		 * Visit components providing T, in registration order.
+		 * Components declaring their interfaces are taken from the interface index
+		 * without any cast, the others are tried with dynamic_cast, as are lazy
+		 * components providing T by name (see component_factory::types()).
+		 * Lazy components are created when visited, only if accepted by the filter.
+		 * \param f Filter called with the descriptor, returning false to skip the component.
+		 * \param v Visitor called with the descriptor, the component and the T pointer,
+		 * returning false to stop. Transient instances are only kept alive during the call.
+		 * \return false if the visit was stopped by the visitor.
+		 */
+		template<typename T, typename Filter, typename Visitor>
+		bool walk(Filter f, Visitor v)const
+		{
+			interface_index::const_iterator found = by_interface.find(typeid(T));
+			const interface_list* typed = found != by_interface.end() ? &found->second : nullptr;
+			const interface_list* named = nullptr;
+			if(!by_type_name.empty())
+			{
+				type_name_index::const_iterator it = by_type_name.find(typeid(T).name());
+				named = it != by_type_name.end() ? &it->second : nullptr;
+			}
+			const std::uint64_t none = static_cast<std::uint64_t>(-1);
+			std::size_t t = 0, tcount = typed != nullptr ? typed->entries.size() : 0;
+			std::size_t u = 0, ucount = untyped.entries.size();
+			std::size_t n = 0, ncount = named != nullptr ? named->entries.size() : 0;
+			while(t < tcount || u < ucount || n < ncount)
+			{
+				std::uint64_t tseq = t < tcount ? typed->entries[t].seq : none;
+				std::uint64_t useq = u < ucount ? untyped.entries[u].seq : none;
+				std::uint64_t nseq = n < ncount ? named->entries[n].seq : none;
+				if(nseq < tseq && nseq < useq)
+				{
+					const interface_entry& entry = named->entries[n++];
+					if(entry.erased())
+					{
+						continue;
+					}
+					const component_descriptor& desc = *components[entry.slot].desc;
+					DI_COUNT(visited, 1);
+					if(!f(desc))
+					{
+						continue;
+					}
+					component_ptr_t holder;
+					const component_ptr_t& comp = desc.instance(holder);
+					DI_COUNT(casts, 1);
+					T* ptr = dynamic_cast<T*>(comp.get());
+					if(ptr!=nullptr && !v(desc, comp, ptr))
+					{
+						return false;
+					}
+				}
+				else if(tseq < useq)
+				{
+					const interface_entry& entry = typed->entries[t++];
+					if(entry.erased())
+					{
+						continue;
+					}
+					const component_descriptor& desc = *components[entry.slot].desc;
+					DI_COUNT(visited, 1);
+					if(!f(desc))
+					{
+						continue;
+					}
+					component_ptr_t holder;
+					const component_ptr_t& comp = desc.instance(holder);
+					if(comp && !v(desc, comp, static_cast<T*>(entry.cast(comp.get()))))
+					{
+						return false;
+					}
+				}
+				else
+				{
+					const interface_entry& entry = untyped.entries[u++];
+					if(entry.erased())
+					{
+						continue;
+					}
+					const component_descriptor& desc = *components[entry.slot].desc;
+					DI_COUNT(visited, 1);
+					DI_COUNT(casts, 1);
+					T* ptr = dynamic_cast<T*>(desc.comp.get());
+					if(ptr!=nullptr && f(desc) && !v(desc, desc.comp, ptr))
+					{
+						return false;
+					}
+				}
+			}
+			return true;
+		}
+
+		template<typename T, typename Visitor>
+		bool walk(Visitor v)const
+		{
+			return walk<T>([](const component_descriptor&){return true;}, v);
+		}
+
+		/**
+		 * Smallest indexed list of components holding all components matching
+		 * a query, null if the query has no condition.
+		 * \param none Set to true if no component can match.
+		 */
+		const interface_list* candidates(const property_query& query, bool& none)const;
+
+		/**
+		 * Visit components matching a query.
+		 * \param v Visitor called with the descriptor, returning false to stop.
+		 */
+		template<typename Visitor>
+		void walk_query(const property_query& query, Visitor v)const
+		{
+			bool none = false;
+			const interface_list* list = candidates(query, none);
+			if(none)
+			{
+				return;
+			}
+			if(list == nullptr)
+			{
+				for(comp_holder::const_iterator it = components.begin(); it!=components.end(); ++it)
+				{
+					DI_COUNT(visited, 1);
+					if(it->desc && !v(*it->desc))
+					{
+						return;
+					}
+				}
+				return;
+			}
+			for(const interface_entry& entry : list->entries)
+			{
+				if(entry.erased())
+				{
+					continue;
+				}
+				const component_descriptor& desc = *components[entry.slot].desc;
+				DI_COUNT(visited, 1);
+				if(query.match(desc) && !v(desc))
+				{
+					return;
+				}
+			}
+		}
+
+		/**
+		 * Visit all components, in slot order.
+		 */
+		template<typename Visitor>
+		void walk_all(Visitor&& v)const
+		{
+			for(comp_holder::const_iterator it = components.begin(); it!=components.end(); ++it)
+			{
+				if(it->desc)
+				{
+					DI_COUNT(visited, 1);
+					v(*it->desc);
+				}
+			}
+		}
+	};
+
+	static const std::size_t npos = static_cast<std::size_t>(-1);
+
+	/**
+	 * Find a component from a type.
+	 * \param cacheable Set to false if the component is transient.
+	 */
+	template<typename T>
+	std::shared_ptr<T> find_first(bool& cacheable)const
+	{
+		std::shared_ptr<T> res;
+		epoch::guard guard;
+		for(const registry* reg=this; reg!=nullptr && !res; reg = reg->lookup_parent())
+		{
+			reg->lookup(guard).walk<T>([&](const component_descriptor& desc, const component_ptr_t& comp, T* ptr){
+				res = std::shared_ptr<T>(comp, ptr);
+				cacheable = !desc.is_transient();
+				return false;
+			});
+		}
+		return res;
+	}
+
+	/**
+	 * Convert a component to T, through its declared interfaces or by dynamic_cast.
+	 * \param comp Receives the component if it is a T.
+	 * \return The converted pointer, null if the component is not a T.
+	 */
+	template<typename T>
+	static T* cast(const component_descriptor& desc, component_ptr_t& comp)
+	{
+		if(desc.provides.empty())
+		{
+			T* ptr = dynamic_cast<T*>(desc.comp.get());
+			if(ptr != nullptr)
+			{
+				comp = desc.comp;
+			}
+			return ptr;
+		}
+		for(const component_interface& intf : desc.provides)
+		{
+			if(intf.type == typeid(T))
+			{
+				component_ptr_t holder;
+				comp = desc.instance(holder);
+				return comp ? static_cast<T*>(intf.cast(comp.get())) : nullptr;
+			}
+		}
+		return nullptr;
+	}
+
+	/**
+	 * Cached result of a typed lookup.
+	 * The component is weakly referenced so the cache never keeps alive
+	 * an erased component.
+	 */
+	struct cache_entry
+	{
+		/** Generation of the registry when cached, 0 if not cached. */
+		std::uint64_t generation = 0;
+		std::weak_ptr<void> comp;
+		/** Found pointer, converted to the looked up type, null if none found. */
+		void* ptr = nullptr;
+	};
+
+	/**
+	 * Retrieve the lookup cache entry of this registry and a type, for the current thread.
+	 * Types are identified by the address of their type_info: a type with many
+	 * type_info (one per shared object) only gets many entries.
+	 */
+	cache_entry& cache(const std::type_info* type)const;
+
+	/**
+	 * Scoped write access to the component table.
+	 * Concurrent registries are locked and modified on a copy of their
+	 * table, published when the writer is destroyed.
+	 */
+	class writer;
+
+	/**
+	 * Flattened view of a registry and its parents.
+	 */
+	struct flat_view
+	{
+		/** Generation of the registry when the view was built. */
+		std::uint64_t stamp;
+		table         tbl;
+	};
+
+	/**
+	 * Access the flattened view for reading, rebuilding it if outdated.
+	 * The guard is always entered, as any reader may replace the view.
+	 */
+	const table& view(epoch::guard& guard)const
+	{
+		guard.enter();
+		flat_view* v = _view.load(std::memory_order_acquire);
+		if(v != nullptr && v->stamp == generation())
+		{
+			return v->tbl;
+		}
+		return rebuild_view(guard);
+	}
+
+	const table& rebuild_view(epoch::guard& guard)const;
+
+	/**
+	 * Increase the generation of the registry, outdating lookup caches and
+	 * flattened views of the registry and its descendants.
+	 * Must be called after each modification of the registry.
+	 */
+	void invalidate();
+
+	/**
+	 * Table to look components up in: the flattened view for flattened
+	 * registries, the own table for others.
+	 */
+	const table& lookup(epoch::guard& guard)const
+	{
+		DI_COUNT(levels, 1);
+		return _flat ? view(guard) : read(guard);
+	}
+
+	/**
+	 * Next registry to look components up in, none after a flattened registry.
+	 */
+	const registry* lookup_parent()const
+	{
+		return _flat ? nullptr : _parent;
+	}
+
+	/**
+	 * Access the current component table for reading.
+	 * The guard is entered if the registry is concurrent and must outlive
+	 * the use of the table.
+	 */
+	const table& read(epoch::guard& guard)const
+	{
+		if(_policy == concurrent)
+		{
+			guard.enter();
+		}
+		return *_table.load();
+	}
+
+	/**
+	 * Release retired tables no more read.
+	 * Must be called with the write mutex locked.
+	 */
+	void reclaim();
+
+	/**
+	 * Unregister the component of a slot if it has the given id,
+	 * else look for it by id.
+	 */
+	void erase(std::size_t pos, component_id id);
+
+	friend class component_loader;
+	friend class component_factory;
+
+	/**
+	 * Name of a component registered with a factory, in any registry.
+	 * \return The name, empty if the factory is not registered.
+	 */
+	static std::string factory_name(std::uint64_t serial);
+
+	/**
+	 * Register a new component and return its handle, without looking it up again.
+	 */
+	component_handle set_handle(component_descriptor&& desc);
+
+	/**
+	 * Register components whose ids are already allocated, at once.
+	 */
+	void publish(std::vector<std::shared_ptr<const component_descriptor>>&& descs);
+
+	registry*   _parent;
+	sync_policy _policy;
+	/** Unique serial of the registry, identifying it in lookup caches. */
+	std::uint64_t _serial;
+	/** Generation of the registry alone, incremented by each modification, starting at 1. */
+	std::atomic<std::uint64_t> _generation{1};
+	std::atomic<table*> _table;
+	/** Anchor shared with handles of components of this registry. */
+	std::shared_ptr<registry_anchor> _anchor;
+	/** Serialize writers of concurrent registries. */
+	std::mutex  _write_mutex;
+	/** Tables replaced but possibly still read, with their retire epoch. */
+	std::vector<std::pair<std::uint64_t, table*>> _retired;
+
+	/** Flattened registry. */
+	bool _flat = false;
+	/** Flattened view, null until the first lookup. */
+	mutable std::atomic<flat_view*> _view{nullptr};
+	/** Serialize view rebuilds. */
+	mutable std::mutex _view_mutex;
+	/** Views replaced but possibly still read, with their retire epoch. */
+	mutable std::vector<std::pair<std::uint64_t, flat_view*>> _retired_views;
+
+	/**
+	 * Allocate a new component id, unique across all registries.
+	 * Each thread reserves blocks of ids from the global counter so concurrent
+	 * registrations do not contend on it.
+	 */
+	static component_id next_id();
+
+	/** Serial of the next created registry. */
+	static std::atomic<std::uint64_t> _serials;
+	/** First id not yet reserved by any thread. */
+	static std::atomic<component_id> _idcount;
+	/** All living registries, guarded by a mutex as registries may be created and destroyed by any thread. */
+	static std::vector<registry*> _registries;
+	static registry _singleton;
+};
+
+
+/**
+ * Monotonic memory arena.
+ * Allocations are served from an inline buffer, then from heap chunks,
+ * and are only released all at once when the arena is destroyed.
+ */
+class arena
+{
+public:
+	arena() = default;
+	arena(const arena&) = delete;
+	arena& operator = (const arena&) = delete;
+	~arena();
+
+	/**
+	 * Allocate memory, released with the arena.
+	 */
+	void* allocate(std::size_t size, std::size_t align = alignof(std::max_align_t))
+	{
+		std::size_t pos = (_pos + align - 1) & ~(align - 1);
+		if(pos + size > _capacity)
+		{
+			return allocate_chunk(size, align);
+		}
+		_pos = pos + size;
+		return _current + pos;
+	}
+
+private:
+	void* allocate_chunk(std::size_t size, std::size_t align);
+
+	static const std::size_t inline_size = 1024;
+	static const std::size_t chunk_size = 4096;
+
+	/** Previously filled heap chunk, heap chunks are chained by their first bytes. */
+	struct chunk
+	{
+		chunk* previous;
+	};
+
+	alignas(std::max_align_t) char _inline[inline_size];
+	char*       _current = _inline;
+	std::size_t _pos = 0;
+	std::size_t _capacity = inline_size;
+	chunk*      _chunks = nullptr;
+};
+
+
+/**
+ * Lightweight registry of components scoped to a short task, like a request,
+ * overriding components of a parent registry.
+ * Its entries and their names are allocated from an arena, and it is not
+ * tracked with other registries: creating, filling and destroying one
+ * costs a few allocations at most. In return its components have no id nor
+ * properties, cannot be erased nor looked up through other registries, and
+ * lookups scan them linearly.
+ * Like an unsynchronized registry, it must not be modified while read.
+ */
+class scoped_registry
+{
+public:
+	explicit scoped_registry(const registry& parent):
+	_parent(parent)
+	{}
+
+	scoped_registry(const scoped_registry&) = delete;
+	scoped_registry& operator = (const scoped_registry&) = delete;
+
+	~scoped_registry();
+
+	const registry& parent()const{return _parent;}
+
+	/**
+	 * Retrieve number of registered components, including those of the parent.
+	 */
+	std::size_t size()const{return _size + _parent.size();}
+
+	/**
+	 * Register a component, with its declared interfaces if any.
+	 */
+	void set(const std::string& name, component_ptr_t comp, const interfaces_t& provides = interfaces_t());
+
+	/**
+	 * Find a component from its name (the first found).
+	 */
+	component_ptr_t find(const std::string& name)const;
+
+	/**
+	 * Find a component from a type.
+	 */
+	template<typename T>
+	std::shared_ptr<T> find()const
+	{
+		for(const entry* e = _first; e != nullptr; e = e->next)
+		{
+			T* ptr = e->cast<T>();
+			if(ptr != nullptr)
+			{
+				return std::shared_ptr<T>(e->comp, ptr);
+			}
+		}
+		return _parent.find<T>();
+	}
+
+	/**
+	 * Find a list of components from a type.
+	 */
+	template<typename T>
+	std::vector<std::shared_ptr<T>> find_all()const
+	{
+		std::vector<std::shared_ptr<T>> res;
+		for(const entry* e = _first; e != nullptr; e = e->next)
+		{
+			T* ptr = e->cast<T>();
+			if(ptr != nullptr)
+			{
+				res.emplace_back(e->comp, ptr);
+			}
+		}
+		std::vector<std::shared_ptr<T>> inherited = _parent.find_all<T>();
+		res.insert(res.end(), inherited.begin(), inherited.end());
+		return res;
+	}
+
+private:
+	/**
+	 * Registered component, allocated in the arena with its name and interfaces.
+	 */
+	struct entry
+	{
+		const char*                name;
+		std::size_t                name_size;
+		component_ptr_t            comp;
+		const component_interface* provides;
+		std::size_t                provides_size;
+		entry*                     next;
+
+		template<typename T>
+		T* cast()const
+		{
+			if(provides_size == 0)
+			{
+				return dynamic_cast<T*>(comp.get());
+			}
+			for(std::size_t n = 0; n < provides_size; ++n)
+			{
+				if(provides[n].type == typeid(T))
+				{
+					return static_cast<T*>(provides[n].cast(comp.get()));
+				}
+			}
+			return nullptr;
+		}
+	};
+
+	const registry& _parent;
+	arena        _arena;
+	entry*       _first = nullptr;
+	entry*       _last = nullptr;
+	std::size_t  _size = 0;
+};
+
+
+/**
+ * Base class for loading components from external modules.
+ */
+class component_loader
+{
+protected:
+	template <typename C, typename... Interfaces> friend class component_instance; // Only instances can self register through component_loader::set methods.
+	template <typename C, typename... Interfaces> friend class lazy_component_instance;
+	template <typename C, typename... Interfaces> friend class pooled_component_instance;
+	template <typename C, typename Dependencies, typename... Interfaces> friend class injected_component_instance;
+
+	/** Cannot be used directly, use derivated instead.*/
+	component_loader() = default;
+
+	/**
+	 * Add a new component.
+	 * Should only be called by component_instance
+	 */
+	static component_handle set(const component_descriptor& desc);
+	static component_handle set(component_descriptor&& desc);
+	static component_handle set(const std::string& name, component_ptr_t comp);
+	static component_handle set(const std::string& name, component_ptr_t comp, const properties_t& prop);
+	static component_handle set(const std::string& name, component_ptr_t comp, properties_t&& prop);
+	static component_handle set(const std::string& name, component_ptr_t comp, properties_init_list_t prop);
+
+	/**
+	 * Registry stack locker, for the current thread.
+	 * Components registered in a concurrent registry while it is locked are
+	 * published at once when it is unlocked: they cannot be looked up before,
+	 * even by the current thread.
+	 * Should only be used by component_loader and derivated.
+	 */
+	class locker
+	{
+	public:
+		locker(registry& reg);
+		~locker();
+	};
+
+	/**
+	 * Push a registry on top of the registry stack of the current thread.
+	 * Should only be used by component_loader and derivated or by registry stack locker.
+	 */
+	static void push_registry(registry& reg);
+
+	/**
+	 * Pop a registry from top of the registry stack of the current thread.
+	 * Should only be used by component_loader and derivated or by registry stack locker.
+	 */
+	static void pop_registry();
+
+private:
+	friend class registry;
+
+	/**
+	 * Registry of the registry stack, with the components registered in it
+	 * and not yet published if it is concurrent.
+	 */
+	struct frame
+	{
+		registry* reg;
+		std::vector<std::shared_ptr<const component_descriptor>> pending;
+	};
+
+	/**
+	 * Forget a component registered by the current thread and not yet published.
+	 * \return true if the component was pending.
+	 */
+	static bool discard(component_id id);
+
+	/**
+	 * Registry stack of the current thread, top last.
+	 * Components registered by modules loaded by a thread go to the top
+	 * registry of this thread's stack, so threads loading modules do not
+	 * interfere.
+	 */
+	static thread_local std::vector<frame> _registries;
+};
+
+
+/**
+ * Helper to automatically instantiate and register a component.
+ * Interfaces optionally lists the interfaces the component provides.
+ * When some are declared, the component is indexed by type and typed
+ * lookups only match it on di::component, C and the declared Interfaces,
+ * without any dynamic_cast. Otherwise it is matched by dynamic_cast.
+ */
+template <typename C, typename... Interfaces>
+class component_instance
+{
+public:
+	typedef C component_type;
+	typedef std::shared_ptr<C> component_ptr;
+
+	/**
+	 * Interfaces declared for the component, empty if none.
+	 */
+	static interfaces_t provides()
+	{
+		return sizeof...(Interfaces) == 0 ? interfaces_t() : interfaces_of<component_type, Interfaces...>();
+	}
+
+	component_instance():component_instance(typeid(component_type).name(), std::make_shared<component_type>())
+	{
+	}
+
+	component_instance(std::string name):component_instance(std::move(name), std::make_shared<component_type>())
+	{
+	}
+
+	component_instance(std::string name, C* comp):component_instance(std::move(name), std::shared_ptr<component_type>(comp))
+	{
+	}
+
+	component_instance(C* comp):component_instance(typeid(component_type).name(), std::shared_ptr<component_type>(comp))
+	{
+	}
+
+	component_instance(component_ptr comp):component_instance(typeid(component_type).name(), std::move(comp))
+	{
+	}
+
+	component_instance(std::string name, component_ptr comp):
+		_handle(component_loader::set(component_descriptor(-1, std::move(name), std::move(comp), properties_t(), provides())))
+	{
+	}
+
+	component_instance(std::string name, component_ptr comp, const properties_t& prop):
+		_handle(component_loader::set(component_descriptor(-1, std::move(name), std::move(comp), prop, provides())))
+	{
+	}
+
+	component_instance(std::string name, component_ptr comp, properties_t&& prop):
+		_handle(component_loader::set(component_descriptor(-1, std::move(name), std::move(comp), std::move(prop), provides())))
+	{
+	}
+
+	component_instance(std::string name, component_ptr comp, properties_init_list_t& prop):
+		_handle(component_loader::set(component_descriptor(-1, std::move(name), std::move(comp), properties_t(prop), provides())))
+	{
+	}
+
+
+
+	template<class... Args >
+	component_instance(std::string name, Args&&... args):component_instance(std::move(name), std::make_shared<component_type>(args...))
+	{
+	}
+
+	template<class... Args >
+	component_instance(std::string name, const properties_t& prop, Args&&... args):component_instance(std::move(name), std::make_shared<component_type>(args...), prop)
+	{
+	}
+
+	template<class... Args >
+	component_instance(std::string name, properties_t&& prop, Args&&... args):component_instance(std::move(name), std::make_shared<component_type>(args...), std::move(prop))
+	{
+	}
+
+	template<class... Args >
+	component_instance(std::string name, properties_init_list_t prop, Args&&... args):component_instance(std::move(name), std::make_shared<component_type>(args...), prop)
+	{
+	}
+
+	~component_instance()
+	{
+		registry::erase(_handle);
+	}
+
+	/**
+	 * Retrieve the registered component.
+	 */
+	component_ptr get()const
+	{
+		return std::static_pointer_cast<component_type>(_handle.descriptor()->comp);
+	}
+
+	const std::string& name()const
+	{
+		return _handle.descriptor()->name;
+	}
+
+	component_id id()const
+	{
+		return _handle.id();
+	}
+
+private:
+	/** Handle of the registered component, which keeps its descriptor. */
+	component_handle _handle;
+};
+
+
+/**
+ * Helper to register a component created on demand.
+ * The component is created by its factory, by default its default constructor,
+ * on the first lookup hitting it or the first call to get().
+ * As a lazy component cannot be matched by dynamic_cast, typed lookups only
+ * match it on di::component, C and the declared Interfaces.
+ */
+template <typename C, typename... Interfaces>
+class lazy_component_instance
+{
+public:
+	typedef C component_type;
+	typedef std::shared_ptr<C> component_ptr;
+	typedef std::function<component_ptr()> factory_t;
+
+	lazy_component_instance():lazy_component_instance(typeid(component_type).name())
+	{
+	}
+
+	lazy_component_instance(std::string name):lazy_component_instance(std::move(name), create)
+	{
+	}
+
+	lazy_component_instance(std::string name, properties_t prop):lazy_component_instance(std::move(name), create, std::move(prop))
+	{
+	}
+
+	lazy_component_instance(std::string name, properties_init_list_t prop):lazy_component_instance(std::move(name), create, properties_t(prop))
+	{
+	}
+
+	lazy_component_instance(std::string name, component_lifetime lifetime):lazy_component_instance(std::move(name), create, properties_t(), lifetime)
 	{
-		for(const registry* reg=this; reg!=nullptr; reg = reg->parent())
-		{
-			for(comp_holder::const_iterator it = reg->_components.begin(); it!=reg->_components.end(); ++it)
-			{
-				std::shared_ptr<T> ptr = std::dynamic_pointer_cast<T>(it->comp);
-				if(ptr)
-				{
-					return ptr;
-				}
-			}
-		}
-		return std::shared_ptr<T>();
 	}
 
-	/**
-	 * Find a list of components from a type.
-	 */
-	template<typename T>
-	std::vector<std::shared_ptr<T>> find_all()const
+	lazy_component_instance(std::string name, factory_t factory, properties_t prop = properties_t(), component_lifetime lifetime = singleton):
+		_factory(std::make_shared<component_factory>(std::move(factory), std::string(), lifetime)),
+		_handle(component_loader::set(component_descriptor(-1, std::move(name), _factory, std::move(prop), interfaces_of<component_type, Interfaces...>())))
 	{
-		std::vector<std::shared_ptr<T>> res;
-		for(const registry* reg=this; reg!=nullptr; reg = reg->parent())
-		{
-			for(comp_holder::const_iterator it = reg->_components.begin(); it!=reg->_components.end(); ++it)
-			{
-				std::shared_ptr<T> ptr = std::dynamic_pointer_cast<T>(it->comp);
-				if(ptr)
-				{
-					res.emplace_back(ptr);
-				}
-			}
-		}
-		return res;
 	}
 
-	/**
-	 * Find a component from a type and a predicate.
-	 */
-	template<typename T, typename UnaryPredicate>
-	std::shared_ptr<T> find_if(UnaryPredicate p)const
+	~lazy_component_instance()
 	{
-		for(const registry* reg=this; reg!=nullptr; reg = reg->parent())
-		{
-			for(comp_holder::const_iterator it = reg->_components.begin(); it!=reg->_components.end(); ++it)
-			{
-				std::shared_ptr<T> ptr = std::dynamic_pointer_cast<T>(it->comp);
-				if(ptr && p(*it))
-				{
-					return ptr;
-				}
-			}
-		}
-		return std::shared_ptr<T>();
+		registry::erase(_handle);
 	}
 
 	/**
-	 * Find a list of components from a type and a predicate.
+	 * Retrieve the component, creating it if needed according to its lifetime.
 	 */
-	template<typename T, typename UnaryPredicate>
-	std::vector<std::shared_ptr<T>> find_all_if(UnaryPredicate p)const
+	component_ptr get()const
 	{
-		std::vector<std::shared_ptr<T>> res;
-		for(const registry* reg=this; reg!=nullptr; reg = reg->parent())
-		{
-			for(comp_holder::const_iterator it = reg->_components.begin(); it!=reg->_components.end(); ++it)
-			{
-				std::shared_ptr<T> ptr = std::dynamic_pointer_cast<T>(it->comp);
-				if(ptr && p(*it))
-				{
-					res.emplace_back(ptr);
-				}
-			}
-		}
-		return res;
+		component_ptr_t holder;
+		return std::static_pointer_cast<component_type>(_factory->get(holder));
 	}
 
 	/**
-	 * Iterate on components and recursivly.
+	 * Test if an instance of the component was created.
 	 */
-	template<typename Action>
-	void foreach(Action a)const
+	bool created()const
 	{
-		for(const registry* reg=this; reg!=nullptr; reg = reg->parent())
-		{
-			for(comp_holder::const_iterator it = reg->_components.begin(); it!=reg->_components.end(); ++it)
-			{
-				a(*it);
-			}
-		}
+		return _factory->created();
 	}
 
-	template<typename UnaryPredicate, typename Action>
-	void foreach_if(UnaryPredicate p, Action a)const
+	const std::string& name()const
 	{
-		for(const registry* reg=this; reg!=nullptr; reg = reg->parent())
-		{
-			for(comp_holder::const_iterator it = reg->_components.begin(); it!=reg->_components.end(); ++it)
-			{
-				if(p(*it))
-				{
-					a(*it);
-				}
-			}
-		}
+		return _handle.descriptor()->name;
 	}
 
-	template<typename T, typename Action>
-	void foreach(Action a)const
+	component_id id()const
 	{
-		for(const registry* reg=this; reg!=nullptr; reg = reg->parent())
-		{
-			for(comp_holder::const_iterator it = reg->_components.begin(); it!=reg->_components.end(); ++it)
-			{
-				std::shared_ptr<T> ptr = std::dynamic_pointer_cast<T>(it->comp);
-				if(ptr)
-				{
-					a(*it);
-				}
-			}
-		}
+		return _handle.id();
 	}
 
-	template<typename T, typename UnaryPredicate, typename Action>
-	void foreach_if(UnaryPredicate p, Action a)const
+private:
+	static component_ptr create()
 	{
-		for(const registry* reg=this; reg!=nullptr; reg = reg->parent())
-		{
-			for(comp_holder::const_iterator it = reg->_components.begin(); it!=reg->_components.end(); ++it)
-			{
-				std::shared_ptr<T> ptr = std::dynamic_pointer_cast<T>(it->comp);
-				if(ptr && p(*it))
-				{
-					a(*it);
-				}
-			}
-		}
+		return std::make_shared<component_type>();
 	}
 
-private:
-	registry*   _parent;
-	comp_holder _components;
-	static component_id _idcount;
-	static std::vector<registry*> _registries;
-	static registry _singleton;
+	component_factory_ptr_t _factory;
+	/** Handle of the registered component, which keeps its descriptor. */
+	component_handle _handle;
 };
 
 
 /**
- * Base class for loading components from external modules.
+ * Helper to register a transient component whose instances are recycled
+ * by a component_pool of the given capacity, see component_pool.
  */
-class component_loader
+template <typename C, typename... Interfaces>
+class pooled_component_instance
 {
-protected:
-	template <typename C> friend class component_instance; // Only instances can self register through component_loader::set methods.
+public:
+	typedef C component_type;
+	typedef std::shared_ptr<C> component_ptr;
 
-	/** Cannot be used directly, use derivated instead.*/
-	component_loader() = default;
+	pooled_component_instance(std::size_t capacity):pooled_component_instance(typeid(component_type).name(), capacity)
+	{
+	}
 
-	/**
-	 * Add a new component.
-	 * Should only be called by component_instance
-	 */
-	static component_id set(const component_descriptor& desc);
-	static component_id set(component_descriptor&& desc);
-	static component_id set(const std::string& name, component_ptr_t comp);
-	static component_id set(const std::string& name, component_ptr_t comp, const properties_t& prop);
-	static component_id set(const std::string& name, component_ptr_t comp, properties_t&& prop);
-	static component_id set(const std::string& name, component_ptr_t comp, properties_init_list_t prop);
+	pooled_component_instance(std::string name, std::size_t capacity, properties_t prop = properties_t(), std::size_t thread_capacity = 8):
+		_pool(std::make_shared<component_pool>(create, capacity, thread_capacity))
+	{
+		std::shared_ptr<component_pool> pool = _pool;
+		_factory = std::make_shared<component_factory>([pool](){
+				return pool->acquire();
+			}, std::string(), transient);
+		_handle = component_loader::set(component_descriptor(-1, std::move(name), _factory, std::move(prop), interfaces_of<component_type, Interfaces...>()));
+	}
 
-	/**
-	 * Global registry stack locker.
-	 * Should only be used by component_loader and derivated.
-	 */
-	class locker
+	~pooled_component_instance()
 	{
-	public:
-		locker(registry& reg);
-		~locker();
-	};
+		registry::erase(_handle);
+	}
 
 	/**
-	 * Push a registry on top of registry stack.
-	 * Should only be used by component_loader and derivated or by global registry stack locker.
+	 * Acquire an instance from the pool.
 	 */
-	static void push_registry(registry& reg);
+	component_ptr get()const
+	{
+		component_ptr_t holder;
+		return std::static_pointer_cast<component_type>(_factory->get(holder));
+	}
 
-	/**
-	 * Pop a registry from top of registry stack.
-	 * Should only be used by component_loader and derivated or by global registry stack locker.
-	 */
-	static void pop_registry();
+	const component_pool& pool()const
+	{
+		return *_pool;
+	}
+
+	const std::string& name()const
+	{
+		return _handle.descriptor()->name;
+	}
+
+	component_id id()const
+	{
+		return _handle.id();
+	}
 
 private:
-	/** Global registry stack locker. */
-	static std::stack<registry*> _registries;
+	static component* create()
+	{
+		return new component_type;
+	}
+
+	std::shared_ptr<component_pool> _pool;
+	component_factory_ptr_t _factory;
+	/** Handle of the registered component, which keeps its descriptor. */
+	component_handle _handle;
 };
 
 
 /**
- * Helper to automatically instantiate and register a component.
+ * List of the dependencies of a component, for injected_component_instance.
  */
-template <typename C>
-class component_instance
+template <typename... Dependencies>
+struct dependencies
+{
+};
+
+/**
+ * Compile time sequence of indexes, to expand tuples.
+ */
+template <std::size_t... I>
+struct index_sequence
+{
+};
+
+template <std::size_t N, std::size_t... I>
+struct make_index_sequence : make_index_sequence<N - 1, N - 1, I...>
+{
+};
+
+template <std::size_t... I>
+struct make_index_sequence<0, I...> : index_sequence<I...>
+{
+};
+
+template <typename C, typename Dependencies, typename... Interfaces>
+class injected_component_instance;
+
+/**
+ * Helper to register a component created with its dependencies injected
+ * in its constructor.
+ * The component is created lazily, on the first lookup hitting it, by
+ * calling its constructor with a std::shared_ptr to each of Dependencies,
+ * in order, each found with find<T>() in the registry holding the component.
+ * Dependencies are resolved once, the component keeps them.
+ * A missing dependency or a dependency cycle raises a resolution_error
+ * from the lookup; the creation is tried again by the next lookup.
+ * As for lazy_component_instance, typed lookups only match the component
+ * on di::component, C and the declared Interfaces.
+ *
+ *   di::injected_component_instance<Service, di::dependencies<Database, Logger>, ServiceInterface> instance("service");
+ */
+template <typename C, typename... Dependencies, typename... Interfaces>
+class injected_component_instance<C, dependencies<Dependencies...>, Interfaces...>
 {
 public:
 	typedef C component_type;
 	typedef std::shared_ptr<C> component_ptr;
 
-	component_instance():component_instance(typeid(component_type).name(), std::make_shared<component_type>())
+	injected_component_instance():injected_component_instance(typeid(component_type).name())
 	{
 	}
 
-	component_instance(const std::string& name):component_instance(name, std::make_shared<component_type>())
+	injected_component_instance(std::string name, component_lifetime lifetime):injected_component_instance(std::move(name), properties_t(), lifetime)
 	{
 	}
 
-	component_instance(const std::string& name, C* comp):component_instance(name, std::shared_ptr<component_type>(comp))
+	injected_component_instance(std::string name, properties_t prop = properties_t(), component_lifetime lifetime = singleton):
+		_handle(std::make_shared<component_handle>())
 	{
+		// The handle keeps the descriptor, which keeps the factory: only refer to it weakly.
+		std::weak_ptr<component_handle> weak = _handle;
+		_factory = std::make_shared<component_factory>([weak](){
+				std::shared_ptr<component_handle> handle = weak.lock();
+				registry* reg = handle ? handle->owner() : nullptr;
+				if(reg == nullptr)
+				{
+					throw resolution_error("component " + (handle && *handle ? handle->descriptor()->name : type_name(typeid(component_type))) + " is not registered");
+				}
+				const std::string& name = handle->descriptor()->name;
+				// Braced initialization resolves dependencies in order.
+				dependency_tuple deps{resolve<Dependencies>(*reg, name)...};
+				return create(deps, make_index_sequence<sizeof...(Dependencies)>());
+			}, std::string(), lifetime);
+		*_handle = component_loader::set(component_descriptor(-1, std::move(name), _factory, std::move(prop), interfaces_of<component_type, Interfaces...>()));
 	}
 
-	component_instance(C* comp):component_instance(typeid(component_type).name(), std::shared_ptr<component_type>(comp))
+	injected_component_instance(std::string name, properties_init_list_t prop):injected_component_instance(std::move(name), properties_t(prop))
 	{
 	}
 
-	component_instance(component_ptr comp):component_instance(typeid(component_type).name(), comp)
+	~injected_component_instance()
 	{
+		registry::erase(*_handle);
 	}
 
-	component_instance(const std::string& name, component_ptr comp):
-		_name(name),_instance(comp)
+	/**
+	 * Retrieve the component, creating it if not already done.
+	 * \throw resolution_error if its dependencies cannot be resolved.
+	 */
+	component_ptr get()const
 	{
-		_id = component_loader::set(_name, comp);
+		component_ptr_t holder;
+		return std::static_pointer_cast<component_type>(_factory->get(holder));
 	}
 
-	component_instance(const std::string& name, component_ptr comp, const properties_t& prop):
-		_name(name),_instance(comp)
+	bool created()const
 	{
-		_id = component_loader::set(_name, comp, prop);
+		return _factory->created();
 	}
 
-	component_instance(const std::string& name, component_ptr comp, properties_t&& prop):
-		_name(name),_instance(comp)
+	const std::string& name()const
 	{
-		_id = component_loader::set(_name, comp, prop);
+		return _handle->descriptor()->name;
 	}
 
-	component_instance(const std::string& name, component_ptr comp, properties_init_list_t& prop):
-		_name(name),_instance(comp)
+	component_id id()const
 	{
-		_id = component_loader::set(_name, comp, prop);
+		return _handle->id();
 	}
 
+private:
+	typedef std::tuple<std::shared_ptr<Dependencies>...> dependency_tuple;
 
-
-	template<class... Args >
-	component_instance(const std::string& name, Args&&... args):component_instance(name, std::make_shared<component_type>(args...))
+	template<std::size_t... I>
+	static component_ptr create(const dependency_tuple& deps, index_sequence<I...>)
 	{
+		return std::make_shared<component_type>(std::get<I>(deps)...);
 	}
 
-	template<class... Args >
-	component_instance(const std::string& name, const properties_t& prop, Args&&... args):component_instance(name, std::make_shared<component_type>(args...), prop)
+	template<typename D>
+	static std::shared_ptr<D> resolve(const registry& reg, const std::string& name)
 	{
+		std::shared_ptr<D> dep = reg.find<D>();
+		if(!dep)
+		{
+			throw resolution_error("unresolved dependency " + type_name(typeid(D)) + " of component " + name);
+		}
+		return dep;
 	}
 
-	template<class... Args >
-	component_instance(const std::string& name, properties_t&& prop, Args&&... args):component_instance(name, std::make_shared<component_type>(args...), prop)
-	{
-	}
+	/** Handle of the component, which keeps its descriptor, shared weakly with the factory to find its registry. */
+	std::shared_ptr<component_handle> _handle;
+	component_factory_ptr_t _factory;
+};
 
-	template<class... Args >
-	component_instance(const std::string& name, properties_init_list_t prop, Args&&... args):component_instance(name, std::make_shared<component_type>(args...), prop)
+
+
+/**
+ * Binary component manifest (.direp version 2).
+ * Records, for a set of modules, the names, provided types and properties
+ * of their components, so components can be located without opening the
+ * modules. The file is mapped in memory and read in place: strings are
+ * returned as pointers into the mapping, valid while the manifest is open.
+ * Types are recorded by std::type_info::name(): declared interfaces of the
+ * components (except di::component), or the concrete type of components
+ * without declared interfaces.
+ * The format uses the byte order of the machine which wrote it.
+ */
+class component_manifest
+{
+	struct raw_header;
+	struct raw_module;
+	struct raw_component;
+	struct raw_property;
+	struct raw_type_entry;
+public:
+	static const std::uint32_t version = 2;
+	static const std::size_t npos = static_cast<std::size_t>(-1);
+
+	/**
+	 * Read only view of a component recorded in a manifest.
+	 */
+	class record
 	{
-	}
+	public:
+		const char* name()const;
+		/** Path of the module providing the component. */
+		const char* module()const;
+		/** Index of the module providing the component. */
+		std::size_t module_index()const;
+
+		std::size_t type_count()const;
+		const char* type(std::size_t n)const;
+
+		std::size_t property_count()const;
+		const char* key(std::size_t n)const;
+		const char* value(std::size_t n)const;
+		/** Value of a property, null if the component has no such property. */
+		const char* property(const char* key)const;
+
+	private:
+		friend class component_manifest;
+		record(const component_manifest& manifest, const raw_component& raw):_manifest(manifest), _raw(raw){}
+
+		const component_manifest& _manifest;
+		const raw_component& _raw;
+	};
 
-	~component_instance()
+	/**
+	 * Build and write manifests.
+	 */
+	class writer
 	{
-		if(_id!=-1)
+	public:
+		/** Component to record, as plain strings. */
+		struct entry
 		{
-			registry::erase(_id);
-		}
-	}
+			std::string name;
+			std::vector<std::string> types;
+			std::vector<std::pair<std::string, std::string>> prop;
+		};
+
+		/**
+		 * Describe the components of a registry and its parents, as they would be recorded.
+		 */
+		static std::vector<entry> describe(const registry& reg);
+
+		/**
+		 * Record the components of a registry and its parents, as provided by a module.
+		 */
+		void add(const std::string& module, const registry& reg);
+
+		/**
+		 * Record components provided by a module.
+		 */
+		void add(const std::string& module, std::vector<entry> entries);
+
+		/** Serialized manifest. */
+		std::string data()const;
+
+		/** Write the manifest to a file, return false on error. */
+		bool write(const std::string& filename)const;
+
+	private:
+		std::vector<std::pair<std::string, std::vector<entry>>> _modules;
+	};
+
+	component_manifest() = default;
+	~component_manifest();
+
+	component_manifest(const component_manifest&) = delete;
+	component_manifest& operator = (const component_manifest&) = delete;
+
+	/**
+	 * Map a manifest file, closing the previous one.
+	 * \return false if the file cannot be mapped or is not a valid manifest.
+	 */
+	bool open(const std::string& filename);
+	void close();
+	bool is_open()const{return _data != nullptr;}
 
-	component_ptr& get()
+	std::size_t module_count()const;
+	const char* module(std::size_t n)const;
+
+	std::size_t component_count()const;
+	record get(std::size_t n)const;
+
+	/**
+	 * Index of the component of the given name, npos if not recorded.
+	 */
+	std::size_t find(const std::string& name)const;
+
+	/**
+	 * Indexes of the components providing a type, in recording order.
+	 */
+	std::vector<std::size_t> find_all(const std::type_info& type)const;
+
+	template<typename T>
+	std::vector<std::size_t> find_all()const
 	{
-		return _instance;
+		return find_all(typeid(T));
 	}
 
-	const component_ptr& get()const
+	/**
+	 * Path of the module providing the component of the given name, null if not recorded.
+	 */
+	const char* provider(const std::string& name)const;
+
+	/**
+	 * Path of the module providing the first component of a type, null if not recorded.
+	 */
+	const char* provider(const std::type_info& type)const;
+
+	template<typename T>
+	const char* provider()const
 	{
-		return _instance;
+		return provider(typeid(T));
 	}
 
-	const std::string& name()const
+private:
+	const char* string(std::uint32_t offset)const;
+	const raw_header& header()const;
+	const raw_module* modules()const;
+	const raw_component* components()const;
+	const std::uint32_t* types()const;
+	const raw_property* properties()const;
+	const std::uint32_t* names()const;
+	const raw_type_entry* type_entries()const;
+
+	const char* _data = nullptr;
+	std::size_t _size = 0;
+	const char* _strings = nullptr;
+};
+
+
+/**
+ * Timings of the loading of modules, filled by simple_component_loader when
+ * profiling, to find the modules slowing down startup.
+ * The loading of a module is split in three phases:
+ *  - open: from the call to the dynamic linker to the first registration of
+ *    a component, mapping, relocation, symbol binding and static
+ *    initialization preceding component instances,
+ *  - constructors: remaining static initialization, including the creation
+ *    of component instances,
+ *  - registration: time spent registering components, out of constructors.
+ */
+class load_profile
+{
+public:
+	/**
+	 * Timings of a module, in nanoseconds.
+	 */
+	struct module
 	{
-		return _name;
-	}
+		std::string path;
+		/** True if the module has been loaded. */
+		bool loaded = false;
+		/**
+		 * Thread which loaded the module, as a sequential index from 1 of the
+		 * threads loading profiled modules in the process, or process which
+		 * loaded it for profiles gathered from worker processes.
+		 */
+		unsigned thread = 0;
+		/** Start of the loading, on the steady clock. */
+		std::uint64_t start = 0;
+		std::uint64_t open = 0;
+		std::uint64_t constructors = 0;
+		std::uint64_t registration = 0;
+		/** Number of registered components. */
+		std::size_t components = 0;
+
+		std::uint64_t total()const{return open + constructors + registration;}
+	};
+
+	/**
+	 * Timings of loaded modules, in loading order.
+	 */
+	const std::vector<module>& modules()const{return _modules;}
+
+	void add(const module& mod);
+	void clear();
+
+	/**
+	 * Print a table of module timings, slowest modules first.
+	 */
+	void report(std::ostream& out)const;
+
+	/**
+	 * Write timings as a Chrome trace (JSON trace event format),
+	 * viewable in chrome://tracing or Perfetto.
+	 */
+	void write_trace(std::ostream& out)const;
+	bool write_trace(const std::string& filename)const;
 
 private:
-	std::string _name;
-	component_ptr _instance;
-	component_id _id = -1;
+	std::vector<module> _modules;
+	mutable std::mutex _mutex;
 };
 
 
@@ -528,9 +2734,75 @@ public:
 	 */
 	void load_all(const std::string& dirname, filter_t& filter);
 
+	/**
+	 * Manifest used to locate components without opening modules, null if none.
+	 * The manifest must outlive its use by the loader.
+	 */
+	const component_manifest* manifest()const{return _manifest;}
+	simple_component_loader& manifest(const component_manifest* manifest){_manifest = manifest; return *this;}
+
+	/**
+	 * Profile receiving the timings of the modules loaded by the loader,
+	 * null if not profiling, the default.
+	 * The profile must outlive its use by the loader.
+	 */
+	load_profile* profile()const{return _profile;}
+	simple_component_loader& profile(load_profile* profile){_profile = profile; return *this;}
+
+	/**
+	 * Path of the module providing a component according to the manifest,
+	 * empty if unknown. No module is opened.
+	 */
+	std::string provider(const std::string& name)const;
+	std::string provider(const std::type_info& type)const;
+
+	template<typename T>
+	std::string provider()const
+	{
+		return provider(typeid(T));
+	}
+
+	/**
+	 * Load the module providing a component according to the manifest.
+	 * \return true if the module is known and correctly loaded.
+	 */
+	bool load_provider(const std::string& name);
+
+	template<typename T>
+	bool load_provider()
+	{
+		std::string path = provider<T>();
+		return !path.empty() && load(path);
+	}
+
+	/**
+	 * Register placeholders for the components of a manifest, without opening
+	 * any module. Placeholders are lazy components: the module providing a
+	 * component is loaded the first time one of its placeholders is resolved,
+	 * and the placeholder then resolves to the component of the module.
+	 * Modules are loaded in private registries, their components are only
+	 * reachable through the placeholders. A module which cannot be loaded,
+	 * or does not provide the component, raises a resolution_error.
+	 * Modules are opened before the creation lock is taken, so static
+	 * constructors of modules may resolve lazy components.
+	 * As static constructors of a module only run once, its components
+	 * cannot be deferred if it is already loaded: the manifest is then
+	 * rejected, no placeholder is registered.
+	 * \throw resolution_error if a module of the manifest is already loaded.
+	 * \return Number of registered placeholders.
+	 */
+	std::size_t load_lazy(const component_manifest& manifest);
+
 private:
+	/** Module loaded by the placeholders of its components, see load_lazy(). */
+	struct deferred_module;
+
 	/** Registry where to load components. */
 	registry& _reg;
+	/** Manifest locating components, if any. */
+	const component_manifest* _manifest = nullptr;
+	/** Profile of loaded modules, if any. */
+	load_profile* _profile = nullptr;
 };
 
 
@@ -23,8 +23,18 @@
 
 #include "di.hpp"
 
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <set>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <boost/program_options.hpp>
 namespace po = boost::program_options;
@@ -33,15 +43,420 @@ namespace fs = boost::filesystem;
 
 #define DIDUMP_NAME		"didump"
 
+typedef std::vector<di::component_manifest::writer::entry> entries_t;
+
+/**
+ * Test if a file may be a module, from its header only.
+ * On ELF platforms, only ELF shared objects are kept, other files are
+ * left to lt_dlopenext() to validate.
+ */
+static bool is_shared_object(const std::string& filename)
+{
+#ifdef __ELF__
+	unsigned char header[18];
+	std::ifstream file(filename, std::ios::binary);
+	if(!file.read(reinterpret_cast<char*>(header), sizeof(header)))
+	{
+		return false;
+	}
+	if(std::memcmp(header, "\x7f" "ELF", 4) != 0)
+	{
+		return false;
+	}
+	// e_type, in the byte order given by EI_DATA (1 for little endian).
+	unsigned type = header[5] == 1 ? header[16] | (header[17] << 8) : (header[16] << 8) | header[17];
+	return type == 3; // ET_DYN
+#else
+	return true;
+#endif
+}
+
+/**
+ * Test if a file is a libtool library (.la), which lt_dlopenext() opens
+ * through the shared object it names.
+ * \param shared Receives the path of this shared object, empty if not found.
+ */
+static bool is_libtool_library(const fs::path& path, fs::path& shared)
+{
+	if(path.extension() != ".la")
+	{
+		return false;
+	}
+	std::ifstream file(path.string());
+	std::string line;
+	if(!std::getline(file, line) || line.find("libtool library file") == std::string::npos)
+	{
+		return false;
+	}
+	shared.clear();
+	while(std::getline(file, line))
+	{
+		if(line.compare(0, 8, "dlname='") == 0 && line.size() > 9)
+		{
+			std::string dlname = line.substr(8, line.size() - 9);
+			// Installed next to the library, or in .libs in a build tree.
+			for(const fs::path& candidate : {path.parent_path() / dlname, path.parent_path() / ".libs" / dlname})
+			{
+				boost::system::error_code error;
+				fs::path canonical = fs::canonical(candidate, error);
+				if(!error)
+				{
+					shared = canonical;
+					break;
+				}
+			}
+			break;
+		}
+	}
+	return true;
+}
+
+/**
+ * Load a module in a fresh registry and describe its components.
+ * \param profile Profile receiving the load timings of the module, if any.
+ * \return false if the module cannot be loaded or has no component.
+ */
+static bool introspect(const std::string& filename, entries_t& entries, di::load_profile* profile)
+{
+	di::registry reg;
+	di::simple_component_loader loader(reg);
+	loader.profile(profile);
+	if(loader.load(filename) && reg.size()>0)
+	{
+		entries = di::component_manifest::writer::describe(reg);
+		return true;
+	}
+	return false;
+}
+
+//
+// Worker processes, for parallel introspection.
+// Each worker introspects a list of files and writes a record per file to
+// a pipe: the index of the file, its entries, then its load timings, with
+// integers as 32 or 64 bits values and strings prefixed by their length.
+//
+
+static void put(std::string& buffer, std::uint32_t value)
+{
+	buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void put(std::string& buffer, std::uint64_t value)
+{
+	buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void put(std::string& buffer, const std::string& str)
+{
+	put(buffer, std::uint32_t(str.size()));
+	buffer.append(str);
+}
+
+static bool get(const std::string& buffer, std::size_t& pos, std::uint32_t& value)
+{
+	if(buffer.size() - pos < sizeof(value))
+	{
+		return false;
+	}
+	std::memcpy(&value, buffer.data() + pos, sizeof(value));
+	pos += sizeof(value);
+	return true;
+}
+
+static bool get(const std::string& buffer, std::size_t& pos, std::uint64_t& value)
+{
+	if(buffer.size() - pos < sizeof(value))
+	{
+		return false;
+	}
+	std::memcpy(&value, buffer.data() + pos, sizeof(value));
+	pos += sizeof(value);
+	return true;
+}
+
+static bool get(const std::string& buffer, std::size_t& pos, std::string& str)
+{
+	std::uint32_t size;
+	if(!get(buffer, pos, size) || buffer.size() - pos < size)
+	{
+		return false;
+	}
+	str.assign(buffer, pos, size);
+	pos += size;
+	return true;
+}
+
+/**
+ * Parse a record, return false if incomplete.
+ */
+static bool parse_record(const std::string& buffer, std::size_t& pos, std::uint32_t& index, bool& loaded, entries_t& entries,
+		di::load_profile::module& timings)
+{
+	std::uint32_t flag, count;
+	if(!get(buffer, pos, index) || !get(buffer, pos, flag) || !get(buffer, pos, count))
+	{
+		return false;
+	}
+	loaded = flag != 0;
+	entries.resize(count);
+	for(di::component_manifest::writer::entry& entry : entries)
+	{
+		std::uint32_t types, props;
+		if(!get(buffer, pos, entry.name) || !get(buffer, pos, types))
+		{
+			return false;
+		}
+		entry.types.resize(types);
+		for(std::string& type : entry.types)
+		{
+			if(!get(buffer, pos, type))
+			{
+				return false;
+			}
+		}
+		if(!get(buffer, pos, props))
+		{
+			return false;
+		}
+		entry.prop.resize(props);
+		for(auto& prop : entry.prop)
+		{
+			if(!get(buffer, pos, prop.first) || !get(buffer, pos, prop.second))
+			{
+				return false;
+			}
+		}
+	}
+	std::uint32_t opened, components;
+	if(!get(buffer, pos, opened) || !get(buffer, pos, timings.start) || !get(buffer, pos, timings.open) || !get(buffer, pos, timings.constructors)
+			|| !get(buffer, pos, timings.registration) || !get(buffer, pos, components))
+	{
+		return false;
+	}
+	timings.loaded = opened != 0;
+	timings.components = components;
+	return true;
+}
+
+static void write_all(int fd, const std::string& buffer)
+{
+	for(std::size_t done = 0; done < buffer.size(); )
+	{
+		ssize_t res = ::write(fd, buffer.data() + done, buffer.size() - done);
+		if(res < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			_exit(2);
+		}
+		done += res;
+	}
+}
+
+/**
+ * Body of a worker process.
+ */
+static void run_worker(const std::vector<std::string>& paths, const std::vector<std::size_t>& indexes, int fd, bool profiling)
+{
+	// Modules may print while loaded, keep the output of didump clean.
+	int null = ::open("/dev/null", O_WRONLY);
+	if(null >= 0)
+	{
+		::dup2(null, STDOUT_FILENO);
+		::close(null);
+	}
+	for(std::size_t index : indexes)
+	{
+		entries_t entries;
+		di::load_profile profile;
+		bool loaded = introspect(paths[index], entries, profiling ? &profile : nullptr);
+		std::string record;
+		put(record, std::uint32_t(index));
+		put(record, std::uint32_t(loaded ? 1 : 0));
+		put(record, std::uint32_t(entries.size()));
+		for(const auto& entry : entries)
+		{
+			put(record, entry.name);
+			put(record, std::uint32_t(entry.types.size()));
+			for(const std::string& type : entry.types)
+			{
+				put(record, type);
+			}
+			put(record, std::uint32_t(entry.prop.size()));
+			for(const auto& prop : entry.prop)
+			{
+				put(record, prop.first);
+				put(record, prop.second);
+			}
+		}
+		di::load_profile::module timings;
+		if(!profile.modules().empty())
+		{
+			timings = profile.modules().front();
+		}
+		put(record, std::uint32_t(timings.loaded ? 1 : 0));
+		put(record, timings.start);
+		put(record, timings.open);
+		put(record, timings.constructors);
+		put(record, timings.registration);
+		put(record, std::uint32_t(timings.components));
+		write_all(fd, record);
+	}
+	::close(fd);
+	_exit(0);
+}
+
+struct worker
+{
+	pid_t pid;
+	int fd;
+	std::vector<std::size_t> indexes;
+	/** Indexes of 'indexes' reported so far. */
+	std::size_t done;
+	std::string buffer;
+	std::size_t pos;
+};
+
+static bool start_worker(const std::vector<std::string>& paths, std::vector<std::size_t> indexes, std::vector<worker>& workers, bool profiling)
+{
+	int fds[2];
+	if(::pipe(fds) != 0)
+	{
+		return false;
+	}
+	std::cout.flush();
+	pid_t pid = ::fork();
+	if(pid < 0)
+	{
+		::close(fds[0]);
+		::close(fds[1]);
+		return false;
+	}
+	if(pid == 0)
+	{
+		::close(fds[0]);
+		for(const worker& w : workers)
+		{
+			::close(w.fd);
+		}
+		run_worker(paths, indexes, fds[1], profiling);
+	}
+	::close(fds[1]);
+	workers.push_back(worker{pid, fds[0], std::move(indexes), 0, std::string(), 0});
+	return true;
+}
+
+/**
+ * Introspect files in 'jobs' worker processes.
+ * A file crashing its worker is reported as not loaded, the remaining files
+ * of the worker are given to a new one.
+ * \param profiling True to measure load timings, reported with the pid of the worker as thread.
+ * \param report Called with the index, load status, entries and load timings of each file, in any order.
+ */
+static bool introspect_parallel(const std::vector<std::string>& paths, unsigned jobs, bool profiling,
+		std::function<void(std::size_t, bool, entries_t&, di::load_profile::module&)> report)
+{
+	std::vector<worker> workers;
+	for(unsigned w = 0; w < jobs && w < paths.size(); ++w)
+	{
+		std::vector<std::size_t> indexes;
+		for(std::size_t n = w; n < paths.size(); n += jobs)
+		{
+			indexes.push_back(n);
+		}
+		if(!start_worker(paths, std::move(indexes), workers, profiling))
+		{
+			return false;
+		}
+	}
+
+	while(!workers.empty())
+	{
+		std::vector<pollfd> fds;
+		for(const worker& w : workers)
+		{
+			fds.push_back(pollfd{w.fd, POLLIN, 0});
+		}
+		if(::poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+		{
+			return false;
+		}
+		for(std::size_t n = fds.size(); n-- > 0; )
+		{
+			if(fds[n].revents == 0)
+			{
+				continue;
+			}
+			worker& w = workers[n];
+			char chunk[4096];
+			ssize_t res = ::read(w.fd, chunk, sizeof(chunk));
+			if(res < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if(res > 0)
+			{
+				w.buffer.append(chunk, res);
+				std::uint32_t index;
+				bool loaded;
+				entries_t entries;
+				di::load_profile::module timings;
+				std::size_t pos = w.pos;
+				while(parse_record(w.buffer, pos, index, loaded, entries, timings))
+				{
+					timings.path = paths[index];
+					timings.thread = w.pid;
+					report(index, loaded, entries, timings);
+					++w.done;
+					w.pos = pos;
+				}
+				w.buffer.erase(0, w.pos);
+				w.pos = 0;
+				continue;
+			}
+
+			// End of the worker.
+			::close(w.fd);
+			int status = 0;
+			::waitpid(w.pid, &status, 0);
+			worker ended = std::move(w);
+			workers.erase(workers.begin() + n);
+			if(ended.done < ended.indexes.size())
+			{
+				std::size_t crashed = ended.indexes[ended.done];
+				std::cerr << "Error while introspecting " << paths[crashed] << " : worker ended abnormally" << std::endl;
+				entries_t none;
+				di::load_profile::module timings;
+				timings.path = paths[crashed];
+				timings.thread = ended.pid;
+				report(crashed, false, none, timings);
+				std::vector<std::size_t> remaining(ended.indexes.begin() + ended.done + 1, ended.indexes.end());
+				if(!remaining.empty() && !start_worker(paths, std::move(remaining), workers, profiling))
+				{
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
 int main(int argc, const char** argv)
 {
 	std::vector<std::string> filenames;
 	std::string directory;
+	std::string manifest_path;
+	std::vector<std::string> providers;
+	std::string trace_path;
+	unsigned jobs = 1;
 
 	po::options_description inputs("Input files or directory");
 	inputs.add_options()
 		("input,i", po::value< std::vector<std::string> >(&filenames), "input file or directory")
 		("recursive,R",                                                "introspect subdirectories recursively")
+		("jobs,j", po::value<unsigned>(&jobs)->default_value(1),         "introspect modules in N worker processes")
 	;
 	po::positional_options_description p;
 	p.add("input", -1);
@@ -49,17 +464,30 @@ int main(int argc, const char** argv)
 	po::options_description reports("Report generation");
 	reports.add_options()
 		("def,d", "Generate di definition files (.didef)")
-		("rep,r", "Generate di repository definition file (.direp)")
+		("rep,r", "Generate di repository manifest file (binary .direp version 2)")
+		("manifest,m", po::value<std::string>(&manifest_path)->default_value("./.direp"), "path of the repository manifest file")
+	;
+
+	po::options_description profiling("Load profiling");
+	profiling.add_options()
+		("profile,P", "print the load timings of modules to standard error, slowest first")
+		("trace,t", po::value<std::string>(&trace_path), "write the load timings of modules as a Chrome trace file")
+	;
+
+	po::options_description queries("Manifest queries");
+	queries.add_options()
+		("provider,p", po::value< std::vector<std::string> >(&providers), "print the module providing a component, from the manifest, without opening modules")
 	;
 
 	po::options_description others("Other options");
 	others.add_options()
+		("stats,s",   "print scan statistics and time to standard error")
 		("help,h",    "display this help and exit")
 		("version,v", "output version information and exit")
 	;
 
 	po::options_description cmdline_options;
-	cmdline_options.add(inputs).add(reports).add(others);
+	cmdline_options.add(inputs).add(reports).add(profiling).add(queries).add(others);
 
 	po::variables_map vm;
 	po::store(po::command_line_parser(argc, argv).options(cmdline_options).positional(p).run(), vm);
@@ -84,6 +512,32 @@ int main(int argc, const char** argv)
 		return 1;
 	}
 
+	// Query the manifest only
+	if(!providers.empty())
+	{
+		di::component_manifest manifest;
+		if(!manifest.open(manifest_path))
+		{
+			std::cerr << "Cannot read manifest " << manifest_path << std::endl;
+			return 1;
+		}
+		int res = 0;
+		for(const std::string& name : providers)
+		{
+			const char* module = manifest.provider(name);
+			if(module != nullptr)
+			{
+				std::cout << name << ": " << module << std::endl;
+			}
+			else
+			{
+				std::cout << name << ": not found" << std::endl;
+				res = 1;
+			}
+		}
+		return res;
+	}
+
 	// Flag generate definition files (.didef)
 	bool generate_didef = false;
 	if(vm.count("def")>0)
@@ -97,11 +551,12 @@ int main(int argc, const char** argv)
 	{
 		generate_direp = true;
 	}
-	std::ofstream repository_file;
-	if(generate_direp)
-	{
-		repository_file.open("./.direp", std::ios_base::trunc);
-	}
+	di::component_manifest::writer repository;
+
+	// Profile module loading
+	bool print_profile = vm.count("profile")>0;
+	di::load_profile profile;
+	di::load_profile* load_profile = print_profile || !trace_path.empty() ? &profile : nullptr;
 
 	// If no specified file, assume process current directory.
 	if(filenames.size()==0)
@@ -109,6 +564,8 @@ int main(int argc, const char** argv)
 		filenames.push_back(".");
 	}
 
+	auto start = std::chrono::steady_clock::now();
+
 	// List of paths to introspect
 	std::vector<fs::path> paths;
 	bool recursive = vm.count("recursive")>0;
@@ -138,51 +595,136 @@ int main(int argc, const char** argv)
 		}
 	}
 
+	// Keep libtool libraries and shared objects only, once each even if
+	// reached through links. Shared objects opened through a libtool
+	// library are not kept again.
+	std::vector<std::string> candidates;
+	std::set<fs::path> canonicals;
+	std::vector<bool> libraries(paths.size(), false);
+	for(std::size_t n = 0; n < paths.size(); ++n)
+	{
+		fs::path shared;
+		boost::system::error_code error;
+		fs::path canonical = fs::canonical(paths[n], error);
+		if(!error && fs::is_regular_file(canonical) && is_libtool_library(paths[n], shared))
+		{
+			libraries[n] = true;
+			if(!shared.empty())
+			{
+				canonicals.insert(shared);
+			}
+		}
+	}
+	for(std::size_t n = 0; n < paths.size(); ++n)
+	{
+		boost::system::error_code error;
+		fs::path canonical = fs::canonical(paths[n], error);
+		if(!error && fs::is_regular_file(canonical) && (libraries[n] || is_shared_object(paths[n].string()))
+				&& canonicals.insert(canonical).second)
+		{
+			candidates.push_back(paths[n].string());
+		}
+	}
+
+	// Report files in order
+	std::size_t loaded_count = 0;
+	auto report = [&](const std::string& filename, const entries_t& entries){
+		++loaded_count;
+		std::cout << filename << ':' << std::endl;
+		for(const auto& entry : entries)
+		{
+			std::cout << entry.name << std::endl;
+			for(const auto& prop : entry.prop)
+			{
+				std::cout << '\t' << prop.first << "=" << prop.second << std::endl;
+			}
+			std::cout << std::endl;
+		}
+
+		if(generate_didef)
+		{
+			std::ofstream file(filename+".didef", std::ios_base::trunc);
+			file << "(" << filename << ")" << std::endl;
+			for(const auto& entry : entries)
+			{
+				file << '[' << entry.name << ']'<< std::endl;
+				for(const auto& prop : entry.prop)
+				{
+					file << prop.first << "=" << prop.second << std::endl;
+				}
+				file << std::endl;
+			}
+		}
+		if(generate_direp)
+		{
+			repository.add(filename, entries);
+		}
+	};
+
 	// Introspect all files
-	for(const fs::path& path : paths)
+	if(jobs <= 1)
 	{
-		std::string filename = path.string();
-		di::registry reg;
-		di::simple_component_loader loader(reg);
-		if(loader.load(filename) && reg.size()>0)
+		for(const std::string& filename : candidates)
 		{
-			std::cout << filename << ':' << std::endl;
-			reg.foreach([](const di::component_descriptor& desc){
-					std::cout << desc.name << std::endl;
-					for(const auto& prop : desc.prop)
+			entries_t entries;
+			if(introspect(filename, entries, load_profile))
+			{
+				report(filename, entries);
+			}
+		}
+	}
+	else
+	{
+		// Results come in any order, report them in the order of the files.
+		std::vector<int> status(candidates.size(), -1);
+		std::vector<entries_t> results(candidates.size());
+		std::size_t next = 0;
+		bool done = introspect_parallel(candidates, jobs, load_profile != nullptr, [&](std::size_t index, bool loaded, entries_t& entries,
+				di::load_profile::module& timings){
+				if(load_profile != nullptr)
+				{
+					load_profile->add(timings);
+				}
+				status[index] = loaded ? 1 : 0;
+				results[index].swap(entries);
+				for(; next < candidates.size() && status[next] >= 0; ++next)
+				{
+					if(status[next] == 1)
 					{
-						std::cout << '\t' << prop.first << "=" << prop.second << std::endl;
+						report(candidates[next], results[next]);
 					}
-					std::cout << std::endl;
-				});
-
-			if(generate_didef)
-			{
-				std::ofstream file(filename+".didef", std::ios_base::trunc);
-				file << "(" << filename << ")" << std::endl;
-				reg.foreach([&file](const di::component_descriptor& desc){
-						file << '[' << desc.name << ']'<< std::endl;
-						for(const auto& prop : desc.prop)
-						{
-							file << prop.first << "=" << prop.second << std::endl;
-						}
-						file << std::endl;
-					});
-			}
-			if(generate_direp)
-			{
-				repository_file << "(" << filename << ")" << std::endl;
-				reg.foreach([&repository_file](const di::component_descriptor& desc){
-						repository_file << '[' << desc.name << ']'<< std::endl;
-						for(const auto& prop : desc.prop)
-						{
-							repository_file << prop.first << "=" << prop.second << std::endl;
-						}
-						repository_file << std::endl;
-					});
-			}
+					entries_t().swap(results[next]);
+				}
+			});
+		if(!done)
+		{
+			std::cerr << "Cannot start worker processes" << std::endl;
+			return 1;
 		}
 	}
 
+	if(generate_direp && !repository.write(manifest_path))
+	{
+		std::cerr << "Cannot write manifest " << manifest_path << std::endl;
+		return 1;
+	}
+
+	if(print_profile)
+	{
+		profile.report(std::cerr);
+	}
+	if(!trace_path.empty() && !profile.write_trace(trace_path))
+	{
+		std::cerr << "Cannot write trace " << trace_path << std::endl;
+		return 1;
+	}
+
+	if(vm.count("stats"))
+	{
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		std::cerr << paths.size() << " files, " << candidates.size() << " shared objects, " << loaded_count
+			<< " modules with components, scanned in " << ms << " ms with " << jobs << " job(s)" << std::endl;
+	}
+
 	return 0;
 }
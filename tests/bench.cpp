@@ -0,0 +1,1395 @@
+/* -*- Mode: C++; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * bench.cpp
+ *
+ * Copyright (C) 2016 Emilien Kia <emilien.kia@gmail.com>
+ *
+ * libdi is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libdi is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.";
+ */
+
+#include "../config.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "di.hpp"
+#include "service01.hpp"
+
+//
+// Benchmark results
+//
+
+/**
+ * Result of a measure, kept for machine readable output.
+ */
+struct result
+{
+	std::string group;
+	std::string name;
+	/** Size of the measure, counted in 'unit'. */
+	std::size_t size;
+	std::string unit;
+	double value;
+	std::string metric;
+};
+
+static std::vector<result> results;
+
+/** Group of the running benchmark. */
+static std::string current_group;
+
+static void record(const std::string& name, std::size_t size, const std::string& unit, double value, const std::string& metric)
+{
+	results.push_back(result{current_group, name, size, unit, value, metric});
+}
+
+static std::string json_string(const std::string& str)
+{
+	std::string res = "\"";
+	for(char c : str)
+	{
+		if(c == '"' || c == '\\')
+		{
+			res += '\\';
+		}
+		res += c;
+	}
+	return res + "\"";
+}
+
+static std::string csv_string(const std::string& str)
+{
+	std::string res = "\"";
+	for(char c : str)
+	{
+		if(c == '"')
+		{
+			res += '"';
+		}
+		res += c;
+	}
+	return res + "\"";
+}
+
+static void write_json(std::ostream& out)
+{
+	out << "{" << std::endl
+		<< "  \"version\": " << json_string(VERSION) << "," << std::endl
+		<< "  \"timestamp\": " << std::time(nullptr) << "," << std::endl
+		<< "  \"hardware_concurrency\": " << std::thread::hardware_concurrency() << "," << std::endl
+		<< "  \"results\": [" << std::endl;
+	for(std::size_t n = 0; n < results.size(); ++n)
+	{
+		const result& res = results[n];
+		out << "    {\"group\": " << json_string(res.group)
+			<< ", \"name\": " << json_string(res.name)
+			<< ", \"size\": " << res.size
+			<< ", \"unit\": " << json_string(res.unit)
+			<< ", \"value\": " << std::setprecision(6) << std::defaultfloat << res.value
+			<< ", \"metric\": " << json_string(res.metric) << "}"
+			<< (n + 1 < results.size() ? "," : "") << std::endl;
+	}
+	out << "  ]" << std::endl << "}" << std::endl;
+}
+
+static void write_csv(std::ostream& out)
+{
+	out << "group,name,size,unit,value,metric" << std::endl;
+	for(const result& res : results)
+	{
+		out << csv_string(res.group) << "," << csv_string(res.name) << "," << res.size << "," << csv_string(res.unit) << ","
+			<< std::setprecision(6) << std::defaultfloat << res.value << "," << csv_string(res.metric) << std::endl;
+	}
+}
+
+//
+// Benchmark helpers
+//
+
+/**
+ * Run an operation a number of times and return the mean duration in nanoseconds.
+ */
+template<typename Operation>
+static double measure(std::size_t count, Operation op)
+{
+	auto start = std::chrono::steady_clock::now();
+	for(std::size_t n = 0; n < count; ++n)
+	{
+		op(n);
+	}
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(end - start).count() / count;
+}
+
+static void report(const std::string& name, std::size_t components, double ns, const char* unit = "components")
+{
+	record(name, components, unit, ns, "ns/op");
+	std::cout
+		<< std::left << std::setw(32) << name
+		<< std::right << std::setw(8) << components << " " << std::setw(10) << std::left << unit << " : " << std::right
+		<< std::fixed << std::setprecision(1) << std::setw(10) << ns << " ns/op"
+		<< std::endl;
+}
+
+static void report_memory(const std::string& name, std::size_t components, std::size_t kb)
+{
+	record(name, components, "components", kb, "kB RSS");
+	std::cout
+		<< std::left << std::setw(32) << name
+		<< std::right << std::setw(8) << components << " components : "
+		<< std::setw(10) << kb << " kB RSS"
+		<< std::endl;
+}
+
+/** Number of bytes allocated by operator new since the start of the program. */
+static std::atomic<std::size_t> allocated{0};
+
+/** Number of calls to operator new since the start of the program. */
+static std::atomic<std::size_t> allocations{0};
+
+void* operator new(std::size_t size)
+{
+	allocated += size;
+	++allocations;
+	if(void* ptr = std::malloc(size))
+	{
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+// Deletes are kept out of line: once inlined, GCC sees free() called on
+// memory returned by operator new and warns about mismatched deallocations.
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+#ifdef __cpp_aligned_new
+void* operator new(std::size_t size, std::align_val_t align)
+{
+	allocated += size;
+	++allocations;
+	// aligned_alloc() wants a size multiple of the alignment.
+	std::size_t alignment = static_cast<std::size_t>(align);
+	if(void* ptr = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment))
+	{
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{
+	std::free(ptr);
+}
+#endif
+
+static void report_bytes(const std::string& name, std::size_t components, double bytes)
+{
+	record(name, components, "components", bytes, "bytes/op");
+	std::cout
+		<< std::left << std::setw(32) << name
+		<< std::right << std::setw(8) << components << " components : "
+		<< std::fixed << std::setprecision(1) << std::setw(10) << bytes << " bytes/op"
+		<< std::endl;
+}
+
+static void report_allocations(const std::string& name, std::size_t count, double allocs, double bytes)
+{
+	record(name, count, "operations", allocs, "allocs/op");
+	record(name, count, "operations", bytes, "bytes/op");
+	std::cout
+		<< std::left << std::setw(32) << name
+		<< std::right << std::setw(8) << count << " operations : "
+		<< std::fixed << std::setprecision(2) << std::setw(10) << allocs << " allocs/op"
+		<< std::setprecision(1) << std::setw(10) << bytes << " bytes/op"
+		<< std::endl;
+}
+
+/**
+ * Resident set size of the process, in kilobytes.
+ */
+static std::size_t resident_kb()
+{
+	std::size_t size = 0, resident = 0;
+	std::ifstream statm("/proc/self/statm");
+	statm >> size >> resident;
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void report_throughput(const std::string& name, std::size_t threads, double ops_per_sec)
+{
+	record(name, threads, "threads", ops_per_sec / 1e6, "Mops/s");
+	std::cout
+		<< std::left << std::setw(32) << name
+		<< std::right << std::setw(8) << threads << " threads    : "
+		<< std::fixed << std::setprecision(2) << std::setw(10) << ops_per_sec / 1e6 << " Mops/s"
+		<< std::endl;
+}
+
+/**
+ * Run an operation 'count' times on each of 'threads' threads and return
+ * the aggregated number of operations per second.
+ */
+template<typename Operation>
+static double measure_threads(std::size_t threads, std::size_t count, Operation op)
+{
+	std::atomic<std::size_t> ready{0};
+	std::atomic<bool> go{false};
+	std::vector<std::thread> workers;
+	for(std::size_t t = 0; t < threads; ++t)
+	{
+		workers.emplace_back([&, t](){
+				++ready;
+				while(!go.load())
+				{
+					std::this_thread::yield();
+				}
+				for(std::size_t n = 0; n < count; ++n)
+				{
+					op(t, n);
+				}
+			});
+	}
+	while(ready.load() < threads)
+	{
+		std::this_thread::yield();
+	}
+	auto start = std::chrono::steady_clock::now();
+	go = true;
+	for(std::thread& worker : workers)
+	{
+		worker.join();
+	}
+	auto end = std::chrono::steady_clock::now();
+	return threads * count / std::chrono::duration<double>(end - start).count();
+}
+
+/** Prevent the compiler from optimizing away looked up values. */
+static std::atomic<std::size_t> sink{0};
+
+class BenchComponent : public di::component
+{
+};
+
+class BenchService : public di::component
+{
+public:
+	virtual ~BenchService() = default;
+	virtual std::size_t value()const = 0;
+};
+
+class BenchServiceImpl : public BenchService
+{
+public:
+	virtual std::size_t value()const {return 1;}
+};
+
+class OtherService : public di::component
+{
+public:
+	virtual ~OtherService() = default;
+};
+
+class OtherServiceImpl : public OtherService
+{
+};
+
+class BenchHelloServiceImpl : public HelloService
+{
+public:
+	virtual void sayHello(const std::string&)const {}
+	virtual size_t count() {return 1;}
+};
+
+/**
+ * Service holding a large buffer, as a connection pool or a cache would.
+ */
+class HeavyService : public di::component
+{
+public:
+	virtual ~HeavyService() = default;
+	virtual std::size_t value()const = 0;
+};
+
+class HeavyServiceImpl : public HeavyService
+{
+public:
+	HeavyServiceImpl():_buffer(64 * 1024, 1){}
+	virtual std::size_t value()const {return _buffer.size();}
+private:
+	std::vector<char> _buffer;
+};
+
+//
+// Registry lookups
+//
+
+static void bench_lookups(std::size_t count)
+{
+	di::registry reg;
+	std::vector<std::string> names;
+	std::vector<di::component_id> ids;
+	std::vector<const di::component*> ptrs;
+
+	double set_ns = measure(count, [&](std::size_t n){
+			names.push_back("component-" + std::to_string(n));
+			const di::component_descriptor& desc = reg.set(names.back(), std::make_shared<BenchComponent>());
+			ids.push_back(desc.id);
+			ptrs.push_back(desc.comp.get());
+		});
+	report("set(name, comp)", count, set_ns);
+
+	report("find(name)", count, measure(count, [&](std::size_t n){
+			sink += reg.find(names[n]) ? 1 : 0;
+		}));
+
+	report("find(id)", count, measure(count, [&](std::size_t n){
+			sink += reg.find(ids[n]) ? 1 : 0;
+		}));
+
+	report("get(name)", count, measure(count, [&](std::size_t n){
+			sink += reg.get(names[n]) ? 1 : 0;
+		}));
+
+	report("get(id)", count, measure(count, [&](std::size_t n){
+			sink += reg.get(ids[n]) ? 1 : 0;
+		}));
+
+	report("get(comp)", count, measure(count, [&](std::size_t n){
+			sink += reg.get(ptrs[n]) ? 1 : 0;
+		}));
+
+	report("find(missing name)", count, measure(count, [&](std::size_t){
+			sink += reg.find("missing") ? 1 : 0;
+		}));
+
+	report("foreach_if()", count, measure(100, [&](std::size_t){
+			reg.foreach_if([](const di::component_descriptor& desc){
+					return desc.name.back() == '7';
+				}, [&](const di::component_descriptor&){
+					++sink;
+				});
+		}));
+}
+
+//
+// Registry construction
+//
+
+/**
+ * Construction and destruction of registries, empty or holding 'count' components.
+ */
+static void bench_registries(std::size_t count)
+{
+	std::shared_ptr<BenchComponent> comp = std::make_shared<BenchComponent>();
+	std::vector<std::string> names;
+	for(std::size_t n = 0; n < count; ++n)
+	{
+		names.push_back("component-" + std::to_string(n));
+	}
+	report("registry() empty", 1, measure(10000, [&](std::size_t){
+			di::registry reg;
+			sink += reg.size() + 1;
+		}));
+	report("registry() filled", count, measure(10, [&](std::size_t){
+			di::registry reg;
+			for(const std::string& name : names)
+			{
+				reg.set(name, comp);
+			}
+			sink += reg.size();
+		}));
+	report("registry() concurrent filled", count, measure(10, [&](std::size_t){
+			di::registry reg(nullptr, di::registry::concurrent);
+			for(const std::string& name : names)
+			{
+				reg.set(name, comp);
+			}
+			sink += reg.size();
+		}));
+}
+
+//
+// Typed lookups
+//
+
+/**
+ * Fill a registry with 'count' OtherService and one BenchService registered last,
+ * either with declared interfaces or without (matched by dynamic_cast).
+ */
+static void fill_typed(di::registry& reg, std::size_t count, bool declared)
+{
+	for(std::size_t n = 0; n < count; ++n)
+	{
+		di::interfaces_t provides = declared ? di::interfaces_of<OtherServiceImpl, OtherService>() : di::interfaces_t();
+		reg.set(di::component_descriptor(-1, "other-" + std::to_string(n), std::make_shared<OtherServiceImpl>(), di::properties_t(), std::move(provides)));
+	}
+	di::interfaces_t provides = declared ? di::interfaces_of<BenchServiceImpl, BenchService>() : di::interfaces_t();
+	reg.set(di::component_descriptor(-1, "bench", std::make_shared<BenchServiceImpl>(), di::properties_t(), std::move(provides)));
+}
+
+static void bench_typed(std::size_t count)
+{
+	for(bool declared : {false, true})
+	{
+		di::registry reg;
+		fill_typed(reg, count, declared);
+		std::string suffix = declared ? " declared" : " untyped";
+
+		report("find<T>()" + suffix, count, measure(10000, [&](std::size_t){
+				sink += reg.find<BenchService>()->value();
+			}));
+
+		report("find_all<T>()" + suffix, count, measure(100, [&](std::size_t){
+				sink += reg.find_all<OtherService>().size();
+			}));
+
+		report("foreach_if<T>()" + suffix, count, measure(100, [&](std::size_t){
+				reg.foreach_if<OtherService>([](const di::component_descriptor& desc){
+						return desc.name.back() == '7';
+					}, [&](const di::component_descriptor&){
+						++sink;
+					});
+			}));
+	}
+}
+
+//
+// Component properties
+//
+
+/**
+ * Memory allocated to register 'count' components with some properties,
+ * and to copy their descriptors. Components share their property keys and
+ * values, as they usually do.
+ */
+static void bench_properties(std::size_t count)
+{
+	for(std::size_t props : {0, 2, 4, 8})
+	{
+		di::properties_t prop;
+		for(std::size_t n = 0; n < props; ++n)
+		{
+			prop["property-key-" + std::to_string(n)] = "property-value-" + std::to_string(n);
+		}
+		std::vector<std::string> names;
+		for(std::size_t n = 0; n < count; ++n)
+		{
+			names.push_back("component-" + std::to_string(n));
+		}
+		std::shared_ptr<BenchComponent> comp = std::make_shared<BenchComponent>();
+
+		di::registry reg;
+		std::size_t before = allocated;
+		for(std::size_t n = 0; n < count; ++n)
+		{
+			reg.set(names[n], comp, prop);
+		}
+		report_bytes("set() " + std::to_string(props) + " properties", count, double(allocated - before) / count);
+
+		std::vector<di::component_descriptor> copies;
+		copies.reserve(count);
+		before = allocated;
+		reg.foreach([&](const di::component_descriptor& desc){
+			copies.push_back(desc);
+		});
+		report_bytes("copy " + std::to_string(props) + " properties", count, double(allocated - before) / count);
+	}
+	std::cout << "sizeof(component_descriptor) : " << sizeof(di::component_descriptor) << " bytes" << std::endl;
+}
+
+//
+// Property queries
+//
+
+/**
+ * Select components by properties, among 'count' components with 5 properties
+ * each, with a predicate and with an indexed property query.
+ */
+static void bench_query(std::size_t count)
+{
+	static const char* roles[] = {"codec", "filter", "muxer", "demuxer", "source"};
+	di::registry reg;
+	std::shared_ptr<BenchComponent> comp = std::make_shared<BenchComponent>();
+	double set_ns = measure(count, [&](std::size_t n){
+			reg.set("component-" + std::to_string(n), comp, {
+					{"role", roles[n % 5]},
+					{"format", "format-" + std::to_string(n % 50)},
+					{"version", "1." + std::to_string(n % 10)},
+					{"vendor", "vendor-" + std::to_string(n % 20)},
+					{"priority", std::to_string(n % 7)}
+				});
+		});
+	report("set() 5 properties", count, set_ns);
+
+	report("find_all_if() role,format", count, measure(100, [&](std::size_t){
+			sink += reg.find_all_if<di::component>([](const di::component_descriptor& desc){
+				auto role = desc.prop.find("role");
+				auto format = desc.prop.find("format");
+				return role != desc.prop.end() && role->second == "codec"
+					&& format != desc.prop.end() && format->second == "format-10";
+			}).size();
+		}));
+	di::property_query query = di::property_query().equals("role", "codec").equals("format", "format-10");
+	report("find_all(query) role,format", count, measure(100, [&](std::size_t){
+			sink += reg.find_all(query).size();
+		}));
+	di::property_query prefix = di::property_query().equals("role", "codec").prefix("version", "1.1");
+	report("find_all(query) role,prefix", count, measure(100, [&](std::size_t){
+			sink += reg.find_all(prefix).size();
+		}));
+}
+
+//
+// Cached typed lookups
+//
+
+/**
+ * Hot repeated find<HelloService>() through a child registry, whose parent
+ * holds 'count' other components and the service, with or without declared
+ * interfaces, with and without the lookup cache, and when the parent is
+ * modified between lookups.
+ */
+static void bench_cached(std::size_t count)
+{
+	for(bool declared : {false, true})
+	{
+		di::registry parent;
+		di::registry child(&parent);
+		for(std::size_t n = 0; n < count; ++n)
+		{
+			di::interfaces_t provides = declared ? di::interfaces_of<OtherServiceImpl, OtherService>() : di::interfaces_t();
+			parent.set(di::component_descriptor(-1, "other-" + std::to_string(n), std::make_shared<OtherServiceImpl>(), di::properties_t(), std::move(provides)));
+		}
+		di::interfaces_t provides = declared ? di::interfaces_of<BenchHelloServiceImpl, HelloService>() : di::interfaces_t();
+		parent.set(di::component_descriptor(-1, "hello", std::make_shared<BenchHelloServiceImpl>(), di::properties_t(), std::move(provides)));
+		std::string suffix = declared ? " declared" : " untyped";
+
+		report("find_uncached<Hello>()" + suffix, count, measure(declared ? 100000 : 1000, [&](std::size_t){
+				sink += child.find_uncached<HelloService>()->count();
+			}));
+		report("find<Hello>()" + suffix, count, measure(100000, [&](std::size_t){
+				sink += child.find<HelloService>()->count();
+			}));
+
+		std::shared_ptr<BenchComponent> comp = std::make_shared<BenchComponent>();
+		report("set()+find<Hello>()" + suffix, count, measure(declared ? 10000 : 1000, [&](std::size_t){
+				parent.set("volatile", comp);
+				sink += child.find<HelloService>()->count();
+			}));
+	}
+}
+
+//
+// Registry hierarchies
+//
+
+/**
+ * Lookups from the bottom of a hierarchy of 'depth' registries of 100
+ * components each, looked up components being at the top, with or
+ * without flattening the bottom registry.
+ */
+static void bench_depth(std::size_t depth)
+{
+	for(bool flat : {false, true})
+	{
+		std::vector<std::unique_ptr<di::registry>> regs;
+		for(std::size_t d = 0; d < depth; ++d)
+		{
+			regs.emplace_back(new di::registry(d > 0 ? regs.back().get() : nullptr));
+			for(std::size_t n = 0; n < 100; ++n)
+			{
+				regs.back()->set(di::component_descriptor(-1, "other-" + std::to_string(d) + "-" + std::to_string(n), std::make_shared<OtherServiceImpl>(),
+						di::properties_t(), di::interfaces_of<OtherServiceImpl, OtherService>()));
+			}
+		}
+		regs.front()->set(di::component_descriptor(-1, "hello", std::make_shared<BenchHelloServiceImpl>(), di::properties_t(), di::interfaces_of<BenchHelloServiceImpl, HelloService>()));
+		di::registry& bottom = *regs.back();
+		bottom.flatten(flat);
+		std::string suffix = flat ? " flat" : "";
+
+		report("find(name) depth=" + std::to_string(depth) + suffix, depth * 100, measure(100000, [&](std::size_t){
+				sink += bottom.find("hello") ? 1 : 0;
+			}));
+		report("find<T>() depth=" + std::to_string(depth) + suffix, depth * 100, measure(100000, [&](std::size_t){
+				sink += bottom.find<HelloService>()->count();
+			}));
+		report("find_uncached<T>() depth=" + std::to_string(depth) + suffix, depth * 100, measure(100000, [&](std::size_t){
+				sink += bottom.find_uncached<HelloService>()->count();
+			}));
+	}
+}
+
+/**
+ * Registration and erasure in a root registry with 'children' live child
+ * registries, and creation and destruction of one more child.
+ */
+static void bench_children(std::size_t children)
+{
+	di::registry root;
+	std::vector<std::unique_ptr<di::registry>> regs;
+	for(std::size_t n = 0; n < children; ++n)
+	{
+		regs.emplace_back(new di::registry(&root));
+	}
+	std::shared_ptr<OtherServiceImpl> other = std::make_shared<OtherServiceImpl>();
+
+	report("root set()+erase(handle) children=" + std::to_string(children), children, measure(1000, [&](std::size_t){
+			di::registry::erase(root.handle(root.set("child-bench", other).id));
+		}));
+	report("child registry children=" + std::to_string(children), children, measure(1000, [&](std::size_t){
+			di::registry child(&root);
+			sink += child.generation();
+		}));
+}
+
+//
+// Per request registries
+//
+
+/**
+ * Create a registry per request, populate it with 4 overrides, look up
+ * 4 components through it and destroy it, with child registries and with
+ * scoped registries, over a parent of 1000 components.
+ */
+static void bench_requests(std::size_t requests)
+{
+	di::registry parent;
+	fill_typed(parent, 1000, true);
+	std::shared_ptr<BenchServiceImpl> override = std::make_shared<BenchServiceImpl>();
+	std::shared_ptr<OtherServiceImpl> other = std::make_shared<OtherServiceImpl>();
+	di::interfaces_t provides = di::interfaces_of<BenchServiceImpl, BenchService>();
+
+	double child_ns = measure(requests, [&](std::size_t){
+			di::registry child(&parent);
+			child.set(di::component_descriptor(-1, "bench", override, di::properties_t(), provides));
+			child.set("request", other);
+			child.set("session", other);
+			child.set("user", other);
+			sink += child.find<BenchService>()->value();
+			sink += child.find("request") ? 1 : 0;
+			sink += child.find("other-10") ? 1 : 0;
+			sink += child.find("missing") ? 1 : 0;
+		});
+	report("child registry request", requests, child_ns, "requests");
+
+	double scoped_ns = measure(requests, [&](std::size_t){
+			di::scoped_registry scope(parent);
+			scope.set("bench", override, provides);
+			scope.set("request", other);
+			scope.set("session", other);
+			scope.set("user", other);
+			sink += scope.find<BenchService>()->value();
+			sink += scope.find("request") ? 1 : 0;
+			sink += scope.find("other-10") ? 1 : 0;
+			sink += scope.find("missing") ? 1 : 0;
+		});
+	report("scoped registry request", requests, scoped_ns, "requests");
+
+	std::cout << "requests per second : child " << std::fixed << std::setprecision(0) << 1e9 / child_ns
+		<< ", scoped " << 1e9 / scoped_ns << std::endl;
+}
+
+//
+// Visiting all components of a type
+//
+
+/**
+ * Fan out to 'count' services with find_all<T>() and visit<T>().
+ */
+static void bench_visit(std::size_t count)
+{
+	di::registry reg;
+	for(std::size_t n = 0; n < count; ++n)
+	{
+		reg.set(di::component_descriptor(-1, "bench-" + std::to_string(n), std::make_shared<BenchServiceImpl>(), di::properties_t(), di::interfaces_of<BenchServiceImpl, BenchService>()));
+	}
+
+	report("find_all<T>() fan out", count, measure(10000, [&](std::size_t){
+			std::size_t sum = 0;
+			for(const auto& service : reg.find_all<BenchService>())
+			{
+				sum += service->value();
+			}
+			sink += sum;
+		}));
+	report("visit<T>() fan out", count, measure(10000, [&](std::size_t){
+			std::size_t sum = 0;
+			reg.visit<BenchService>([&](const BenchService& service){
+				sum += service.value();
+			});
+			sink += sum;
+		}));
+}
+
+//
+// Component unloading
+//
+
+/**
+ * Erase 'count' components of a registry, among 'registries' registries
+ * of 'count' components each, by id or by handle.
+ */
+static void bench_erase(std::size_t count, std::size_t registries)
+{
+	for(bool by_handle : {false, true})
+	{
+		std::vector<std::unique_ptr<di::registry>> regs;
+		std::vector<di::component_handle> handles;
+		for(std::size_t r = 0; r < registries; ++r)
+		{
+			regs.emplace_back(new di::registry);
+			for(std::size_t n = 0; n < count; ++n)
+			{
+				const di::component_descriptor& desc = regs.back()->set("component-" + std::to_string(n), std::make_shared<BenchComponent>());
+				if(r == 0)
+				{
+					handles.push_back(regs.back()->handle(desc.id));
+				}
+			}
+		}
+
+		std::string name = by_handle ? "erase(handle)" : "erase(id)";
+		report(name, count, measure(count, [&](std::size_t n){
+				if(by_handle)
+				{
+					di::registry::erase(handles[n]);
+				}
+				else
+				{
+					di::registry::erase(handles[n].id());
+				}
+			}));
+		sink += regs.front()->size() == 0 ? 1 : 0;
+	}
+}
+
+//
+// Lazy components
+//
+
+/**
+ * Registration time and memory of 'count' heavy components, registered
+ * lazily then eagerly, creation time of lazy components on first use, and
+ * lookups of created lazy components.
+ */
+static void bench_lazy(std::size_t count)
+{
+	typedef di::lazy_component_instance<HeavyServiceImpl, HeavyService> lazy_instance;
+	typedef di::component_instance<HeavyServiceImpl, HeavyService> eager_instance;
+
+	std::vector<std::unique_ptr<lazy_instance>> lazy;
+	std::size_t before = resident_kb();
+	report("lazy registration", count, measure(count, [&](std::size_t n){
+			lazy.emplace_back(new lazy_instance("lazy-" + std::to_string(n)));
+		}));
+	report_memory("lazy registration", count, resident_kb() - before);
+
+	std::vector<std::unique_ptr<eager_instance>> eager;
+	before = resident_kb();
+	report("eager registration", count, measure(count, [&](std::size_t n){
+			eager.emplace_back(new eager_instance("eager-" + std::to_string(n)));
+		}));
+	report_memory("eager registration", count, resident_kb() - before);
+
+	report("lazy first get()", count, measure(count, [&](std::size_t n){
+			sink += lazy[n]->get()->value();
+		}));
+	report("lazy next find(name)", count, measure(count, [&](std::size_t n){
+			sink += di::registry::get().find(lazy[n]->name()) ? 1 : 0;
+		}));
+	report("eager find(name)", count, measure(count, [&](std::size_t n){
+			sink += di::registry::get().find(eager[n]->name()) ? 1 : 0;
+		}));
+	report("lazy get(pointer)", count, measure(count, [&](std::size_t n){
+			sink += di::registry::get().get(lazy[n]->get().get()) ? 1 : 0;
+		}));
+}
+
+//
+// Plugin loading
+//
+
+/** Plugin copied to simulate many plugins, relative to the tests build directory. */
+static const char* plugin_path = ".libs/module01.so";
+
+/**
+ * Create a temporary directory with 'count' copies of the plugin.
+ * \return The directory path, empty on error.
+ */
+static std::string make_plugin_dir(std::size_t count)
+{
+	char dirname[] = "/tmp/dibench-XXXXXX";
+	if(mkdtemp(dirname) == nullptr)
+	{
+		return std::string();
+	}
+	for(std::size_t n = 0; n < count; ++n)
+	{
+		std::ifstream src(plugin_path, std::ios::binary);
+		std::ofstream dst(std::string(dirname) + "/plugin" + std::to_string(n) + ".so", std::ios::binary);
+		dst << src.rdbuf();
+	}
+	return dirname;
+}
+
+/**
+ * Time of load() and load_all() on a directory of 'count' plugins.
+ * Each measure uses fresh copies as loaded modules are never unloaded.
+ */
+static void bench_load(std::size_t count)
+{
+	if(!std::ifstream(plugin_path))
+	{
+		std::cout << "load_all(): " << plugin_path << " not found, skipped" << std::endl;
+		return;
+	}
+
+	{
+		std::string dirname = make_plugin_dir(count);
+		di::registry reg;
+		di::simple_component_loader loader(reg);
+		report("load()", count, measure(count, [&](std::size_t n){
+				sink += loader.load(dirname + "/plugin" + std::to_string(n) + ".so") ? 1 : 0;
+			}), "plugins");
+		std::system(("rm -rf " + dirname).c_str());
+	}
+
+	{
+		std::string dirname = make_plugin_dir(count);
+		di::registry reg;
+		di::simple_component_loader loader(reg);
+		double ns = measure(1, [&](std::size_t){
+				loader.load_all(dirname);
+			});
+		report("load_all()", count, ns / count, "plugins");
+		sink += reg.size();
+		std::system(("rm -rf " + dirname).c_str());
+	}
+}
+
+/** didump, relative to the tests build directory. */
+static const char* didump_path = "../src/didump";
+
+/**
+ * Startup of a process using 'used' components of a directory of 'count'
+ * plugins: loading all plugins, compared to registering placeholders from
+ * a manifest written by didump and loading used plugins on demand.
+ */
+static void bench_lazy_load(std::size_t count, std::size_t used)
+{
+	if(!std::ifstream(plugin_path) || !std::ifstream(didump_path))
+	{
+		std::cout << "load_lazy(): " << plugin_path << " or " << didump_path << " not found, skipped" << std::endl;
+		return;
+	}
+
+	// On demand first, to not count plugins loaded eagerly in its RSS.
+	{
+		std::string dirname = make_plugin_dir(count);
+		std::string manifest_path = dirname + "/.direp";
+		if(std::system((std::string(didump_path) + " -r -m " + manifest_path + " " + dirname + " > /dev/null").c_str()) != 0)
+		{
+			std::cout << "load_lazy(): didump failed, skipped" << std::endl;
+			return;
+		}
+		std::size_t before = resident_kb();
+		di::registry reg;
+		di::component_manifest manifest;
+		report("load_lazy() startup", count, measure(1, [&](std::size_t){
+				manifest.open(manifest_path);
+				di::simple_component_loader(reg).load_lazy(manifest);
+			}) / count, "plugins");
+		std::vector<di::component_id> ids;
+		reg.foreach([&](const di::component_descriptor& desc){
+				if(desc.name == "mod01-hello")
+				{
+					ids.push_back(desc.id);
+				}
+			});
+		report("load_lazy() use", used, measure(used, [&](std::size_t n){
+				sink += reg.find(ids[n * ids.size() / used]) ? 1 : 0;
+			}), "plugins");
+		report_memory("load_lazy() startup and use", count, resident_kb() - before);
+		std::system(("rm -rf " + dirname).c_str());
+	}
+
+	{
+		std::string dirname = make_plugin_dir(count);
+		std::size_t before = resident_kb();
+		di::registry reg;
+		report("load_all() startup", count, measure(1, [&](std::size_t){
+				di::simple_component_loader(reg).load_all(dirname);
+			}) / count, "plugins");
+		report_memory("load_all() startup and use", count, resident_kb() - before);
+		sink += reg.size();
+		std::system(("rm -rf " + dirname).c_str());
+	}
+}
+
+/**
+ * Wall-clock time of didump scanning a directory of 'count' plugins and
+ * 'others' non-library files, depending on jobs.
+ */
+static void bench_didump(std::size_t count, std::size_t others)
+{
+	if(!std::ifstream(plugin_path) || !std::ifstream(didump_path))
+	{
+		std::cout << "didump: " << plugin_path << " or " << didump_path << " not found, skipped" << std::endl;
+		return;
+	}
+
+	std::string dirname = make_plugin_dir(count);
+	for(std::size_t n = 0; n < others; ++n)
+	{
+		std::ofstream(dirname + "/data" + std::to_string(n) + ".txt") << "not a library";
+	}
+	for(unsigned jobs : {1, 2, 4, 8})
+	{
+		std::string command = std::string(didump_path) + " -r -m " + dirname + ".direp -j " + std::to_string(jobs) + " " + dirname + " > /dev/null";
+		report("didump -j " + std::to_string(jobs), count + others, measure(1, [&](std::size_t){
+				sink += std::system(command.c_str()) == 0 ? 1 : 0;
+			}) / (count + others), "files");
+	}
+	std::system(("rm -rf " + dirname + " " + dirname + ".direp").c_str());
+}
+
+//
+// Concurrent reads
+//
+
+/**
+ * Read throughput of a concurrent registry, compared to an unsynchronized
+ * registry protected by a global mutex.
+ */
+static void bench_concurrent_reads(std::size_t count)
+{
+	di::registry concurrent(nullptr, di::registry::concurrent);
+	di::registry locked;
+	std::mutex mutex;
+	fill_typed(concurrent, count, true);
+	fill_typed(locked, count, true);
+
+	for(std::size_t threads : {1, 2, 4, 8, 16, 32, 64})
+	{
+		std::size_t ops = 200000 / threads;
+		report_throughput("mutex find(name)", threads, measure_threads(threads, ops, [&](std::size_t t, std::size_t n){
+				std::lock_guard<std::mutex> lock(mutex);
+				sink += locked.find("other-" + std::to_string((t + n) % count)) ? 1 : 0;
+			}));
+		report_throughput("concurrent find(name)", threads, measure_threads(threads, ops, [&](std::size_t t, std::size_t n){
+				sink += concurrent.find("other-" + std::to_string((t + n) % count)) ? 1 : 0;
+			}));
+		report_throughput("mutex find<T>()", threads, measure_threads(threads, ops, [&](std::size_t, std::size_t){
+				std::lock_guard<std::mutex> lock(mutex);
+				sink += locked.find<BenchService>()->value();
+			}));
+		report_throughput("concurrent find<T>()", threads, measure_threads(threads, ops, [&](std::size_t, std::size_t){
+				sink += concurrent.find<BenchService>()->value();
+			}));
+		report_throughput("concurrent find_all<T>()", threads, measure_threads(threads, ops / 100, [&](std::size_t, std::size_t){
+				sink += concurrent.find_all<OtherService>().size();
+			}));
+	}
+}
+
+//
+// Component lifetimes
+//
+
+class ParserService : public di::component
+{
+public:
+	virtual ~ParserService() = default;
+	/** Parse a number, using an internal buffer. */
+	virtual std::size_t parse(const std::string& text) = 0;
+};
+
+class ParserServiceImpl : public ParserService
+{
+public:
+	virtual std::size_t parse(const std::string& text)
+	{
+		_buffer.assign(text.begin(), text.end());
+		return std::strtoul(_buffer.c_str(), nullptr, 10);
+	}
+private:
+	std::string _buffer;
+};
+
+/**
+ * Throughput of a stateful service shared by threads: a singleton protected
+ * by a mutex, compared to a per thread component.
+ */
+static void bench_lifetimes()
+{
+	std::mutex mutex;
+	di::registry singleton(nullptr, di::registry::concurrent);
+	singleton.set(di::component_descriptor(-1, "parser", std::make_shared<ParserServiceImpl>(),
+			di::properties_t(), di::interfaces_of<ParserServiceImpl, ParserService>()));
+	di::registry per_thread(nullptr, di::registry::concurrent);
+	per_thread.set(di::component_descriptor(-1, "parser", std::make_shared<di::component_factory>([](){
+			return std::make_shared<ParserServiceImpl>();
+		}, "parser", di::per_thread), di::properties_t(), di::interfaces_of<ParserServiceImpl, ParserService>()));
+
+	for(std::size_t threads : {1, 2, 4, 8})
+	{
+		std::size_t ops = 400000 / threads;
+		report_throughput("mutex singleton parse()", threads, measure_threads(threads, ops, [&](std::size_t, std::size_t n){
+				std::shared_ptr<ParserService> parser = singleton.find<ParserService>();
+				std::lock_guard<std::mutex> lock(mutex);
+				sink += parser->parse("12345") + n;
+			}));
+		report_throughput("per thread parse()", threads, measure_threads(threads, ops, [&](std::size_t, std::size_t n){
+				sink += per_thread.find<ParserService>()->parse("12345") + n;
+			}));
+	}
+}
+
+//
+// Pooled components
+//
+
+class MessageHandler : public di::component
+{
+public:
+	MessageHandler():_buffer(1024){}
+	std::size_t handle(std::size_t message)
+	{
+		_buffer[message % _buffer.size()] = char(message);
+		return _buffer.size();
+	}
+private:
+	std::vector<char> _buffer;
+};
+
+/**
+ * Allocations and latency of resolving then releasing a per message
+ * handler, created for each message or recycled by a pool.
+ */
+static void bench_pool(std::size_t count)
+{
+	di::lazy_component_instance<MessageHandler> transient("transient-handler", di::transient);
+	di::pooled_component_instance<MessageHandler> pooled("pooled-handler", 16);
+	di::registry& reg = di::registry::get();
+
+	auto handle = [&](const std::string& name, std::size_t n){
+			std::shared_ptr<MessageHandler> handler = std::static_pointer_cast<MessageHandler>(reg.find(name));
+			sink += handler->handle(n);
+		};
+	handle(pooled.name(), 0);
+
+	for(const std::string& name : {transient.name(), pooled.name()})
+	{
+		std::size_t before = allocated, before_count = allocations;
+		for(std::size_t n = 0; n < count; ++n)
+		{
+			handle(name, n);
+		}
+		report_allocations(name, count, double(allocations - before_count) / count, double(allocated - before) / count);
+		report(name + " resolve", count, measure(count, [&](std::size_t n){
+				handle(name, n);
+			}), "messages");
+	}
+	for(std::size_t threads : {1, 2, 4, 8})
+	{
+		std::size_t ops = 400000 / threads;
+		report_throughput("transient handler", threads, measure_threads(threads, ops, [&](std::size_t, std::size_t n){
+				handle(transient.name(), n);
+			}));
+		report_throughput("pooled handler", threads, measure_threads(threads, ops, [&](std::size_t, std::size_t n){
+				handle(pooled.name(), n);
+			}));
+	}
+}
+
+//
+// Concurrent registrations
+//
+
+/**
+ * Registration throughput of threads each filling its own registry.
+ * Only component id allocation is shared between threads.
+ */
+/**
+ * Register 'count' descriptors one by one with set(), or at once with set_batch().
+ */
+static void bench_batch(std::size_t count, di::registry::sync_policy policy, const char* policy_name)
+{
+	std::shared_ptr<BenchComponent> comp = std::make_shared<BenchComponent>();
+	std::vector<std::string> names;
+	for(std::size_t n = 0; n < count; ++n)
+	{
+		names.push_back("component-" + std::to_string(n));
+	}
+	auto descriptors = [&](){
+		std::vector<di::component_descriptor> descs;
+		descs.reserve(count);
+		for(std::size_t n = 0; n < count; ++n)
+		{
+			descs.emplace_back(-1, names[n], comp, di::properties_t{{"rank", names[n]}},
+					di::interfaces_of<BenchComponent, BenchComponent>());
+		}
+		return descs;
+	};
+	std::size_t iterations = count >= 100000 ? 3 : 10;
+	std::vector<std::vector<di::component_descriptor>> batches;
+	for(std::size_t n = 0; n < iterations; ++n)
+	{
+		batches.push_back(descriptors());
+	}
+	report(std::string("set() looped ") + policy_name, count, measure(iterations, [&](std::size_t n){
+			di::registry reg(nullptr, policy);
+			for(di::component_descriptor& desc : batches[n])
+			{
+				reg.set(std::move(desc));
+			}
+			sink += reg.size();
+		}) / count);
+	batches.clear();
+	for(std::size_t n = 0; n < iterations; ++n)
+	{
+		batches.push_back(descriptors());
+	}
+	report(std::string("set_batch() ") + policy_name, count, measure(iterations, [&](std::size_t n){
+			di::registry reg(nullptr, policy);
+			reg.set_batch(std::move(batches[n]));
+			sink += reg.size();
+		}) / count);
+}
+
+static void bench_concurrent_registration()
+{
+	for(std::size_t threads : {1, 2, 4, 8, 16, 32, 64})
+	{
+		std::size_t ops = 100000 / threads;
+		std::vector<std::unique_ptr<di::registry>> registries;
+		for(std::size_t t = 0; t < threads; ++t)
+		{
+			registries.emplace_back(new di::registry);
+		}
+		std::shared_ptr<BenchComponent> comp = std::make_shared<BenchComponent>();
+		report_throughput("set(name, comp)", threads, measure_threads(threads, ops, [&](std::size_t t, std::size_t){
+				registries[t]->set("component", comp);
+			}));
+	}
+}
+
+//
+// Main
+//
+
+/**
+ * Benchmark groups, run in this order.
+ */
+static const std::vector<std::pair<std::string, std::function<void()>>> groups = {
+	{"lookups", [](){
+		for(std::size_t count : {100, 1000, 10000})
+		{
+			bench_lookups(count);
+			bench_typed(count);
+			bench_cached(count);
+			std::cout << std::endl;
+		}
+	}},
+	{"registries", [](){
+		for(std::size_t count : {100, 1000, 10000})
+		{
+			bench_registries(count);
+		}
+		bench_requests(100000);
+	}},
+	{"batch", [](){
+		bench_batch(100000, di::registry::unsynchronized, "unsynchronized");
+		for(std::size_t count : {1000, 10000})
+		{
+			bench_batch(count, di::registry::concurrent, "concurrent");
+		}
+	}},
+	{"depth", [](){
+		for(std::size_t depth : {1, 4, 16})
+		{
+			bench_depth(depth);
+		}
+		for(std::size_t children : {0, 1000, 10000})
+		{
+			bench_children(children);
+		}
+	}},
+	{"visit", [](){
+		for(std::size_t count : {10, 100, 1000})
+		{
+			bench_visit(count);
+		}
+	}},
+	{"properties", [](){
+		bench_properties(1000);
+		bench_query(10000);
+	}},
+	{"erase", [](){
+		for(std::size_t count : {100, 1000, 10000, 100000})
+		{
+			bench_erase(count, 8);
+		}
+	}},
+	{"lazy", [](){
+		bench_lazy(1000);
+	}},
+	{"load", [](){
+		for(std::size_t count : {10, 50, 200})
+		{
+			bench_load(count);
+		}
+		bench_lazy_load(200, 10);
+		bench_didump(200, 2000);
+	}},
+	{"concurrent", [](){
+		bench_concurrent_reads(1000);
+		bench_concurrent_registration();
+	}},
+	{"lifetimes", [](){
+		bench_lifetimes();
+		bench_pool(100000);
+	}},
+};
+
+static void usage()
+{
+	std::cout
+		<< "Usage: dibench [options] [group]..." << std::endl
+		<< "Run libdi benchmarks, all groups if none is given." << std::endl
+		<< "  -f, --format text|json|csv  format of the results file" << std::endl
+		<< "  -o, --output FILE           results file, default bench.json or bench.csv" << std::endl
+		<< "  -l, --list                  list benchmark groups" << std::endl
+		<< "  -s, --statistics            dump lookup statistics, when instrumented" << std::endl
+		<< "  -h, --help                  display this help" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	std::string format = "text";
+	std::string output;
+	bool statistics = false;
+	std::vector<std::string> selected;
+	for(int n = 1; n < argc; ++n)
+	{
+		std::string arg = argv[n];
+		if((arg == "-f" || arg == "--format") && n + 1 < argc)
+		{
+			format = argv[++n];
+		}
+		else if((arg == "-o" || arg == "--output") && n + 1 < argc)
+		{
+			output = argv[++n];
+		}
+		else if(arg == "-l" || arg == "--list")
+		{
+			for(const auto& group : groups)
+			{
+				std::cout << group.first << std::endl;
+			}
+			return 0;
+		}
+		else if(arg == "-s" || arg == "--statistics")
+		{
+			statistics = true;
+		}
+		else if(arg == "-h" || arg == "--help")
+		{
+			usage();
+			return 0;
+		}
+		else if(!arg.empty() && arg[0] != '-')
+		{
+			selected.push_back(arg);
+		}
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+	if(format != "text" && format != "json" && format != "csv")
+	{
+		usage();
+		return 1;
+	}
+	if(output.empty() && format != "text")
+	{
+		output = "bench." + format;
+	}
+
+	for(const auto& group : groups)
+	{
+		if(selected.empty() || std::find(selected.begin(), selected.end(), group.first) != selected.end())
+		{
+			current_group = group.first;
+			std::cout << "# " << group.first << std::endl;
+			group.second();
+			std::cout << std::endl;
+		}
+	}
+	if(statistics)
+	{
+		di::lookup_statistics::dump(std::cout);
+	}
+
+	if(format != "text")
+	{
+		std::ofstream file(output, std::ios_base::trunc);
+		if(format == "json")
+		{
+			write_json(file);
+		}
+		else
+		{
+			write_csv(file);
+		}
+		if(!file)
+		{
+			std::cerr << "Cannot write " << output << std::endl;
+			return 1;
+		}
+		std::cout << "Results written to " << output << std::endl;
+	}
+	return sink == 0 ? 1 : 0;
+}
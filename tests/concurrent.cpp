@@ -0,0 +1,346 @@
+/* -*- Mode: C++; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * concurrent.cpp
+ *
+ * Copyright (C) 2016 Emilien Kia <emilien.kia@gmail.com>
+ *
+ * libdi is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libdi is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.";
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "di.hpp"
+
+static const std::size_t magic = 0xC0FFEE;
+
+class StressService : public di::component
+{
+public:
+	virtual ~StressService() = default;
+	virtual std::size_t value()const = 0;
+};
+
+class StressServiceImpl : public StressService
+{
+public:
+	StressServiceImpl():_value(magic){}
+	virtual ~StressServiceImpl(){_value = 0;}
+	virtual std::size_t value()const {return _value;}
+private:
+	std::size_t _value;
+};
+
+static const std::size_t stable_count = 100;
+static const std::size_t reader_count = 4;
+static const std::size_t writer_count = 4;
+static const std::size_t iterations = 2000;
+
+static std::atomic<std::size_t> failures{0};
+
+static void check(bool test, const char* what)
+{
+	if(!test)
+	{
+		if(failures++ == 0)
+		{
+			std::cerr << "Failure: " << what << std::endl;
+		}
+	}
+}
+
+//
+// Stress test of concurrent registries:
+// readers look up stable components while writers register and erase
+// volatile ones, every found component must be alive and valid.
+//
+
+static void reader(const di::registry& reg, std::size_t rank)
+{
+	for(std::size_t n = 0; n < iterations; ++n)
+	{
+		std::string name = "stable-" + std::to_string((n + rank) % stable_count);
+		di::component_ptr_t comp = reg.find(name);
+		check(comp != nullptr, "find(name) of a stable component");
+		check(comp && std::dynamic_pointer_cast<StressService>(comp)->value() == magic, "stable component is valid");
+
+		std::shared_ptr<StressService> first = reg.find<StressService>();
+		check(first && first->value() == magic, "find<T>() returns a valid component");
+
+		std::vector<std::shared_ptr<StressService>> all = reg.find_all<StressService>();
+		check(all.size() >= stable_count, "find_all<T>() returns stable components");
+		for(const auto& service : all)
+		{
+			check(service->value() == magic, "find_all<T>() returns valid components");
+		}
+
+		std::size_t visited = 0;
+		reg.visit<StressService>([&](const StressService& service){
+			check(service.value() == magic, "visit<T>() visits valid components");
+			++visited;
+		});
+		check(visited >= stable_count, "visit<T>() visits stable components");
+
+		std::size_t count = 0;
+		reg.foreach([&](const di::component_descriptor& desc){
+			check(desc.comp != nullptr, "foreach visits valid descriptors");
+			++count;
+		});
+		check(count >= stable_count, "foreach visits stable components");
+	}
+}
+
+static void writer(di::registry& reg, std::size_t rank)
+{
+	for(std::size_t n = 0; n < iterations; ++n)
+	{
+		std::string name = "volatile-" + std::to_string(rank) + "-" + std::to_string(n);
+		const di::component_descriptor& desc = reg.set(di::component_descriptor(-1, name, std::make_shared<StressServiceImpl>(),
+				di::properties_t(), di::interfaces_of<StressServiceImpl, StressService>()));
+		di::component_id id = desc.id;
+		check(reg.find(name) != nullptr, "find(name) of a just registered component");
+		di::registry::erase(id);
+		check(reg.get(id) == nullptr, "get(id) of an erased component");
+	}
+}
+
+static void test_readers_writers()
+{
+	di::registry reg(nullptr, di::registry::concurrent);
+	for(std::size_t n = 0; n < stable_count; ++n)
+	{
+		reg.set(di::component_descriptor(-1, "stable-" + std::to_string(n), std::make_shared<StressServiceImpl>(),
+				di::properties_t(), di::interfaces_of<StressServiceImpl, StressService>()));
+	}
+
+	std::vector<std::thread> threads;
+	for(std::size_t n = 0; n < reader_count; ++n)
+	{
+		threads.emplace_back(reader, std::cref(reg), n);
+	}
+	for(std::size_t n = 0; n < writer_count; ++n)
+	{
+		threads.emplace_back(writer, std::ref(reg), n);
+	}
+	for(std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	check(reg.size() == stable_count, "only stable components remain");
+}
+
+//
+// Component ids must be unique across registries under concurrent registrations.
+//
+
+static void test_unique_ids()
+{
+	const std::size_t thread_count = 8;
+	const std::size_t count = 1000;
+
+	std::vector<std::unique_ptr<di::registry>> registries;
+	std::vector<std::vector<di::component_id>> ids(thread_count);
+	for(std::size_t n = 0; n < thread_count; ++n)
+	{
+		registries.emplace_back(new di::registry(nullptr, n % 2 == 0 ? di::registry::concurrent : di::registry::unsynchronized));
+	}
+
+	std::vector<std::thread> threads;
+	for(std::size_t t = 0; t < thread_count; ++t)
+	{
+		threads.emplace_back([&, t](){
+				for(std::size_t n = 0; n < count; ++n)
+				{
+					ids[t].push_back(registries[t]->set("comp-" + std::to_string(n), std::make_shared<StressServiceImpl>()).id);
+				}
+			});
+	}
+	for(std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	std::vector<di::component_id> all;
+	for(const auto& list : ids)
+	{
+		all.insert(all.end(), list.begin(), list.end());
+	}
+	std::sort(all.begin(), all.end());
+	check(std::adjacent_find(all.begin(), all.end()) == all.end(), "component ids are unique");
+}
+
+//
+// Lazy components must be created once, by the first lookup, even when
+// looked up by many threads at the same time.
+//
+
+static void test_lazy_once()
+{
+	const std::size_t thread_count = 8;
+
+	std::atomic<std::size_t> created{0};
+	di::registry reg(nullptr, di::registry::concurrent);
+	di::component_factory_ptr_t factory = std::make_shared<di::component_factory>([&](){
+			++created;
+			return std::make_shared<StressServiceImpl>();
+		});
+	reg.set(di::component_descriptor(-1, "lazy", factory, di::properties_t(), di::interfaces_of<StressServiceImpl, StressService>()));
+	check(created == 0, "lazy component is not created by its registration");
+
+	std::vector<std::shared_ptr<StressService>> found(thread_count);
+	std::vector<std::thread> threads;
+	for(std::size_t t = 0; t < thread_count; ++t)
+	{
+		threads.emplace_back([&, t](){
+				if(t % 2 == 0)
+				{
+					found[t] = reg.find<StressService>();
+				}
+				else
+				{
+					found[t] = std::dynamic_pointer_cast<StressService>(reg.find("lazy"));
+				}
+			});
+	}
+	for(std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	check(created == 1, "lazy component is created once");
+	for(const auto& service : found)
+	{
+		check(service && service->value() == magic && service == found.front(), "lazy lookups return the created component");
+	}
+	check(reg.get(found.front().get()) != nullptr, "created lazy component is found by pointer");
+}
+
+//
+// Cached typed lookups must follow modifications of the registry and its parents.
+//
+
+static void test_lookup_cache()
+{
+	di::registry parent(nullptr, di::registry::concurrent);
+	di::registry other;
+	di::registry child(&parent);
+
+	check(!child.find<StressService>(), "find<T>() of a missing component");
+	di::component_id id = parent.set(di::component_descriptor(-1, "cached", std::make_shared<StressServiceImpl>(),
+			di::properties_t(), di::interfaces_of<StressServiceImpl, StressService>())).id;
+	check(child.find<StressService>() != nullptr, "find<T>() after registration in parent");
+	check(child.find<StressService>() == child.find_uncached<StressService>(), "cached find<T>() returns the component");
+
+	std::thread([&](){
+			di::registry::erase(id);
+		}).join();
+	check(!child.find<StressService>(), "find<T>() after erase from parent by another thread");
+
+	std::shared_ptr<StressServiceImpl> comp = std::make_shared<StressServiceImpl>();
+	other.set("other", comp);
+	child.parent(&other);
+	check(child.find<StressService>() == comp, "find<T>() after parent change");
+
+	// Changes of ancestors reach the bottom of the hierarchy, also after reparenting.
+	di::registry top;
+	di::registry grandchild(&child);
+	check(grandchild.find<StressService>() == comp, "find<T>() through two levels");
+	other.parent(&top);
+	std::shared_ptr<StressServiceImpl> shadowing = std::make_shared<StressServiceImpl>();
+	di::component_id shadowing_id = child.set("shadowing", shadowing).id;
+	check(grandchild.find<StressService>() == shadowing, "find<T>() after registration in a parent");
+	di::registry::erase(shadowing_id);
+	check(grandchild.find<StressService>() == comp, "find<T>() after erasure in a parent");
+	std::shared_ptr<StressServiceImpl> top_comp = std::make_shared<StressServiceImpl>();
+	di::component_id top_id = top.set("top", top_comp).id;
+	di::registry::erase(other.get(comp.get())->id);
+	check(grandchild.find<StressService>() == top_comp, "find<T>() after registration in a new ancestor");
+	di::registry::erase(top_id);
+	check(!grandchild.find<StressService>(), "find<T>() after erasure in a new ancestor");
+}
+
+//
+// Lookup statistics merge the counters of all threads, including exited ones,
+// and stay empty when instrumentation is compiled out.
+//
+
+static void test_lookup_statistics()
+{
+	const std::size_t thread_count = 4;
+	const std::size_t count = 100;
+
+	di::registry parent(nullptr, di::registry::concurrent);
+	di::registry reg(&parent);
+	parent.set(di::component_descriptor(-1, "stat", std::make_shared<StressServiceImpl>(),
+			di::properties_t(), di::interfaces_of<StressServiceImpl, StressService>()));
+
+	di::lookup_statistics::reset();
+	std::vector<std::thread> threads;
+	for(std::size_t t = 0; t < thread_count; ++t)
+	{
+		threads.emplace_back([&](){
+				for(std::size_t n = 0; n < count; ++n)
+				{
+					check(reg.find("stat") != nullptr, "find(name) of a component of the parent");
+					check(reg.find<StressService>() != nullptr, "find<T>() of a component of the parent");
+				}
+			});
+	}
+	for(std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	di::lookup_statistics::snapshot stats = di::lookup_statistics::collect();
+	std::uint64_t total = thread_count * count;
+	if(di::lookup_statistics::enabled())
+	{
+		check(stats.lookups[di::lookup_statistics::find_name] == total, "find(name) lookups are counted");
+		check(stats.lookups[di::lookup_statistics::find_type] == total, "find<T>() lookups are counted");
+		check(stats.counters[di::lookup_statistics::cache_hits] + stats.counters[di::lookup_statistics::cache_misses] == total,
+				"find<T>() cache hits and misses are counted");
+		check(stats.counters[di::lookup_statistics::levels] >= 2 * total, "registry levels are counted");
+		std::uint64_t histogram = 0;
+		for(std::uint64_t bucket : stats.latency[di::lookup_statistics::find_name])
+		{
+			histogram += bucket;
+		}
+		check(histogram == total, "find(name) latencies are recorded");
+	}
+	else
+	{
+		check(stats.lookups[di::lookup_statistics::find_name] == 0 && stats.counters[di::lookup_statistics::levels] == 0,
+				"no statistics without instrumentation");
+	}
+
+	di::lookup_statistics::reset();
+	check(di::lookup_statistics::collect().lookups[di::lookup_statistics::find_name] == 0, "statistics are reset");
+}
+
+int main()
+{
+	test_readers_writers();
+	test_unique_ids();
+	test_lazy_once();
+	test_lookup_cache();
+	test_lookup_statistics();
+
+	std::cout << "concurrent registry: " << failures << " failure(s)" << std::endl;
+	return failures == 0 ? 0 : 1;
+}
@@ -48,7 +48,7 @@ size_t HelloServiceImpl::count()
 	return 42;
 }
 
-di::component_instance<HelloServiceImpl> hello("lib01-hello", {{"titi", "toto"}, {"tata", "tutu"}});
+di::component_instance<HelloServiceImpl, HelloService> hello("lib01-hello", {{"titi", "toto"}, {"tata", "tutu"}});
 
 
 
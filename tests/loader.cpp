@@ -0,0 +1,378 @@
+/* -*- Mode: C++; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * loader.cpp
+ *
+ * Copyright (C) 2016 Emilien Kia <emilien.kia@gmail.com>
+ *
+ * libdi is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libdi is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.";
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "di.hpp"
+#include "service01.hpp"
+
+static const std::size_t thread_count = 8;
+
+static std::atomic<std::size_t> failures{0};
+
+static void check(bool test, const char* what)
+{
+	if(!test)
+	{
+		if(failures++ == 0)
+		{
+			std::cerr << "Failure: " << what << std::endl;
+		}
+	}
+}
+
+static bool copy_file(const std::string& from, const std::string& to)
+{
+	std::ifstream src(from, std::ios::binary);
+	std::ofstream dst(to, std::ios::binary);
+	dst << src.rdbuf();
+	return src && dst;
+}
+
+//
+// Threads each load their own copies of module01 and module02 into their
+// own registry at the same time, components must go to the registry of
+// the loading thread only.
+//
+
+static void test_concurrent_loads(const std::string& dirname)
+{
+	std::size_t global_size = di::registry::get().size();
+
+	std::vector<std::unique_ptr<di::registry>> registries;
+	for(std::size_t t = 0; t < thread_count; ++t)
+	{
+		registries.emplace_back(new di::registry);
+	}
+
+	std::atomic<std::size_t> ready{0};
+	std::vector<std::thread> threads;
+	for(std::size_t t = 0; t < thread_count; ++t)
+	{
+		threads.emplace_back([&, t](){
+				di::simple_component_loader loader(*registries[t]);
+				++ready;
+				while(ready.load() < thread_count)
+				{
+					std::this_thread::yield();
+				}
+				check(loader.load(dirname + "/module01-" + std::to_string(t) + ".so"), "load module01 copy");
+				check(loader.load(dirname + "/module02-" + std::to_string(t) + ".so"), "load module02 copy");
+			});
+	}
+	for(std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	for(const auto& reg : registries)
+	{
+		check(reg->size() == 4, "each registry holds the components of its modules");
+		check(reg->get("mod01-hello") != nullptr, "module01 component is in the registry of its loader");
+		check(reg->find_all<HelloService>().size() == 2, "module01 and module02 services are in the registry of their loader");
+	}
+	check(di::registry::get().size() == global_size, "global registry is left untouched");
+}
+
+//
+// Modules loaded in a concurrent registry publish their components at once,
+// each write copying its table.
+//
+
+static void test_concurrent_registry_load(const std::string& dirname)
+{
+	std::string module01 = dirname + "/module01-batch.so";
+	check(copy_file(".libs/module01.so", module01), "copy module01");
+
+	di::registry reg(nullptr, di::registry::concurrent);
+	std::uint64_t generation = reg.generation();
+	check(di::simple_component_loader(reg).load(module01), "load module in a concurrent registry");
+	check(reg.size() == 2 && reg.get("mod01-hello") != nullptr, "components of the module are published");
+	check(reg.generation() == generation + 1, "components of the module are published at once");
+}
+
+//
+// A manifest records the components of modules, and locates them without
+// opening the modules.
+//
+
+/**
+ * Write a manifest of fresh copies of module01 and module02, named with a suffix.
+ * Modules are recorded from other copies, so the recorded paths are not opened yet:
+ * modules already opened would not register their components again.
+ */
+static std::string write_manifest(const std::string& dirname, const std::string& suffix)
+{
+	di::component_manifest::writer writer;
+	for(const char* module : {"module01", "module02"})
+	{
+		std::string path = dirname + "/" + module + "-" + suffix + ".so";
+		std::string copy = path + ".record.so";
+		check(copy_file(std::string(".libs/") + module + ".so", path) && copy_file(path, copy), "copy module");
+		di::registry reg;
+		di::simple_component_loader loader(reg);
+		check(loader.load(copy), "load module to record");
+		writer.add(path, reg);
+	}
+	std::string filename = dirname + "/" + suffix + ".direp";
+	check(writer.write(filename), "write manifest");
+	return filename;
+}
+
+/**
+ * Test if a file is mapped in the process.
+ */
+static bool is_mapped(const std::string& path)
+{
+	std::ifstream maps("/proc/self/maps");
+	std::string line;
+	while(std::getline(maps, line))
+	{
+		if(line.size() >= path.size() && line.compare(line.size() - path.size(), path.size(), path) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+static void test_manifest(const std::string& dirname)
+{
+	std::string module01 = dirname + "/module01-manifest.so";
+	std::string filename = write_manifest(dirname, "manifest");
+
+	di::component_manifest manifest;
+	check(manifest.open(filename), "open manifest");
+	check(manifest.module_count() == 2 && manifest.component_count() == 4, "manifest records modules and components");
+	std::size_t hello = manifest.find("mod01-hello");
+	check(hello != di::component_manifest::npos, "find component by name");
+	if(hello != di::component_manifest::npos)
+	{
+		di::component_manifest::record rec = manifest.get(hello);
+		check(module01 == rec.module(), "component module is recorded");
+		check(rec.property("titi") != nullptr && std::string(rec.property("titi")) == "toto", "component properties are recorded");
+		check(rec.property("missing") == nullptr, "missing property");
+	}
+	check(manifest.find("missing") == di::component_manifest::npos, "find missing component");
+	std::vector<std::size_t> services = manifest.find_all<HelloService>();
+	check(services.size() == 1 && services[0] == hello, "find components by declared type");
+
+	di::registry reg;
+	di::simple_component_loader loader(reg);
+	loader.manifest(&manifest);
+	check(loader.provider("mod01-hello") == module01 && loader.provider<HelloService>() == module01, "loader locates component from manifest");
+	check(loader.provider("missing").empty(), "loader does not locate missing component");
+	check(reg.size() == 0, "locating components does not load modules");
+	check(loader.load_provider("mod01-hello") && reg.get("mod01-hello") != nullptr, "load the module providing a component");
+
+	std::ofstream(dirname + "/.bad") << "not a manifest";
+	check(!manifest.open(dirname + "/.bad") && !manifest.is_open(), "invalid manifest is rejected");
+	check(manifest.find("mod01-hello") == di::component_manifest::npos && manifest.find_all<HelloService>().empty()
+			&& manifest.provider("mod01-hello") == nullptr, "unopened manifest has no component");
+	check(loader.provider("mod01-hello").empty() && loader.provider<HelloService>().empty(), "loader does not locate components from an unopened manifest");
+}
+
+//
+// Placeholders registered from a manifest load their module when first resolved.
+//
+
+static void test_load_lazy(const std::string& dirname)
+{
+	std::string module01 = dirname + "/module01-lazy.so";
+	std::string module02 = dirname + "/module02-lazy.so";
+	di::component_manifest manifest;
+	check(manifest.open(write_manifest(dirname, "lazy")), "open manifest");
+
+	di::registry reg;
+	di::simple_component_loader loader(reg);
+	check(loader.load_lazy(manifest) == 4 && reg.size() == 4, "placeholders are registered");
+	check(!is_mapped(module01) && !is_mapped(module02), "modules are not loaded by placeholders");
+
+	std::shared_ptr<HelloService> hello = reg.find<HelloService>();
+	check(hello != nullptr, "typed lookup resolves a placeholder");
+	check(is_mapped(module01) && !is_mapped(module02), "only the module of the resolved component is loaded");
+	check(reg.find("mod01-hello") == hello, "placeholder resolves to the component of its module");
+	check(reg.get("mod01-hello")->prop.at("titi") == "toto", "placeholder has the recorded properties");
+
+	di::registry again;
+	bool rejected = false;
+	try
+	{
+		di::simple_component_loader(again).load_lazy(manifest);
+	}
+	catch(const di::resolution_error&)
+	{
+		rejected = true;
+	}
+	check(rejected && again.size() == 0, "manifest of an already loaded module is rejected");
+
+	std::remove(module02.c_str());
+	bool failed = false;
+	try
+	{
+		// Components are recorded in module order, the third one is from module02.
+		reg.find(manifest.get(2).name());
+	}
+	catch(const di::resolution_error&)
+	{
+		failed = true;
+	}
+	check(failed, "missing module is reported");
+}
+
+//
+// A module whose static constructor resolves a lazy component can be loaded
+// while another thread resolves a placeholder: modules are not opened under
+// the creation lock.
+//
+
+static void test_load_lazy_reentrant(const std::string& dirname)
+{
+	std::string module03 = dirname + "/module03-reentrant.so";
+	check(copy_file(".libs/module03.so", module03), "copy module03");
+	di::component_manifest manifest;
+	check(manifest.open(write_manifest(dirname, "reentrant")), "open manifest");
+
+	di::registry placeholders;
+	di::simple_component_loader(placeholders).load_lazy(manifest);
+	di::component_factory_ptr_t factory = std::make_shared<di::component_factory>([](){return std::make_shared<di::component>();});
+	di::component_id probe = di::registry::get().set(di::component_descriptor(-1, "loader-probe", factory,
+			di::properties_t(), di::interfaces_t())).id;
+
+	std::atomic<bool> loaded{false}, resolved{false};
+	std::thread loading([&](){
+			di::registry reg;
+			check(di::simple_component_loader(reg).load(module03), "load module resolving a lazy component");
+			loaded = true;
+		});
+	std::thread resolving([&](){
+			// Resolve while the module constructor sleeps, with the ltdl lock held.
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			check(placeholders.find("mod01-hello") != nullptr, "placeholder is resolved while a module is loaded");
+			resolved = true;
+		});
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while(!(loaded && resolved) && std::chrono::steady_clock::now() < deadline)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	if(!(loaded && resolved))
+	{
+		std::cerr << "Failure: deadlock between module loads and placeholder resolution" << std::endl;
+		std::_Exit(1);
+	}
+	loading.join();
+	resolving.join();
+	check(factory->created(), "lazy component is created by the module constructor");
+	di::registry::erase(probe);
+}
+
+//
+// Profiled loads record the timings and components of each module.
+//
+
+static void test_load_profile(const std::string& dirname)
+{
+	std::vector<std::string> modules;
+	for(const char* module : {"module01", "module02"})
+	{
+		modules.push_back(dirname + "/" + module + "-profile.so");
+		check(copy_file(std::string(".libs/") + module + ".so", modules.back()), "copy module");
+	}
+	modules.push_back(dirname + "/missing.so");
+
+	di::registry reg;
+	di::load_profile profile;
+	di::simple_component_loader loader(reg);
+	loader.profile(&profile);
+	loader.load(modules);
+
+	check(profile.modules().size() == 3, "each module is profiled");
+	std::size_t components = 0;
+	for(const di::load_profile::module& mod : profile.modules())
+	{
+		bool missing = mod.path == modules.back();
+		check(mod.loaded != missing, "load status is recorded");
+		check(missing || (mod.components > 0 && mod.open > 0 && mod.constructors > 0), "load timings are recorded");
+		components += mod.components;
+	}
+	check(components == reg.size(), "registered components are counted");
+
+	std::string other = dirname + "/module01-profile-thread.so";
+	check(copy_file(".libs/module01.so", other), "copy module");
+	std::thread([&](){
+			di::registry other_reg;
+			di::simple_component_loader other_loader(other_reg);
+			other_loader.profile(&profile);
+			check(other_loader.load(other), "load module from another thread");
+		}).join();
+	const std::vector<di::load_profile::module>& mods = profile.modules();
+	check(mods.size() == 4 && mods[0].thread != 0 && mods[0].thread == mods[1].thread && mods[3].thread != mods[0].thread,
+			"loading threads are recorded");
+
+	std::ostringstream trace;
+	profile.write_trace(trace);
+	check(trace.str().find("\"traceEvents\"") != std::string::npos && trace.str().find(modules.front()) != std::string::npos,
+			"profile is written as a Chrome trace");
+	std::ostringstream report;
+	profile.report(report);
+	check(report.str().find(modules.front()) != std::string::npos, "profile is reported");
+}
+
+int main()
+{
+	char dirname[] = "/tmp/diloader-XXXXXX";
+	if(mkdtemp(dirname) == nullptr)
+	{
+		std::cerr << "Cannot create temporary directory" << std::endl;
+		return 1;
+	}
+	for(std::size_t t = 0; t < thread_count; ++t)
+	{
+		check(copy_file(".libs/module01.so", std::string(dirname) + "/module01-" + std::to_string(t) + ".so"), "copy module01");
+		check(copy_file(".libs/module02.so", std::string(dirname) + "/module02-" + std::to_string(t) + ".so"), "copy module02");
+	}
+
+	if(failures == 0)
+	{
+		test_concurrent_loads(dirname);
+		test_concurrent_registry_load(dirname);
+		test_manifest(dirname);
+		test_load_lazy(dirname);
+		test_load_lazy_reentrant(dirname);
+		test_load_profile(dirname);
+	}
+	std::system((std::string("rm -rf ") + dirname).c_str());
+
+	std::cout << "concurrent loads: " << failures << " failure(s)" << std::endl;
+	return failures == 0 ? 0 : 1;
+}
@@ -46,7 +46,7 @@ size_t Module01HelloServiceImpl::count()
 	return _count++;
 }
 
-di::component_instance<Module01HelloServiceImpl> IntegratedHello("mod01-hello", {{"titi", "toto"}, {"tata", "tutu"}});
+di::component_instance<Module01HelloServiceImpl, HelloService> IntegratedHello("mod01-hello", {{"titi", "toto"}, {"tata", "tutu"}});
 
 
 //
@@ -62,4 +62,4 @@ public:
 	}
 };
 
-di::component_instance<Module01TotoServiceImpl> TotoServiceImplInstance;
+di::component_instance<Module01TotoServiceImpl, TotoService> TotoServiceImplInstance;
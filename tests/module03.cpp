@@ -0,0 +1,39 @@
+/* -*- Mode: C++; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * module03.cpp
+ * 
+ * Copyright (C) 2016 Emilien Kia <emilien.kia@gmail.com>
+ *
+ * libdi is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * libdi is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.";
+ */
+#include <chrono>
+#include <thread>
+
+#include "di.hpp"
+
+//
+// Module whose static constructor resolves a lazy component of the global
+// registry, slowly enough to let other threads resolve placeholders meanwhile.
+//
+
+struct Module03Probe
+{
+	Module03Probe()
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		di::registry::get().find("loader-probe");
+	}
+};
+
+static Module03Probe probe;
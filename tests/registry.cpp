@@ -0,0 +1,880 @@
+/* -*- Mode: C++; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * registry.cpp
+ *
+ * Copyright (C) 2016 Emilien Kia <emilien.kia@gmail.com>
+ *
+ * libdi is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libdi is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.";
+ */
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "di.hpp"
+
+class Codec : public di::component
+{
+public:
+	virtual ~Codec() = default;
+};
+
+class CodecImpl : public Codec
+{
+};
+
+class Filter : public di::component
+{
+public:
+	virtual ~Filter() = default;
+};
+
+class Logger : public di::component
+{
+public:
+	virtual ~Logger() = default;
+};
+
+class Database : public di::component
+{
+public:
+	Database(std::shared_ptr<Logger> logger):logger(logger){}
+	std::shared_ptr<Logger> logger;
+};
+
+class Service : public di::component
+{
+public:
+	Service(std::shared_ptr<Database> database, std::shared_ptr<Logger> logger):database(database), logger(logger){}
+	std::shared_ptr<Database> database;
+	std::shared_ptr<Logger> logger;
+};
+
+class Chicken;
+
+class Egg : public di::component
+{
+public:
+	Egg(std::shared_ptr<Chicken>){}
+};
+
+class Chicken : public di::component
+{
+public:
+	Chicken(std::shared_ptr<Egg>){}
+};
+
+class Parser : public di::component
+{
+public:
+	virtual ~Parser() = default;
+};
+
+class ParserImpl : public Parser
+{
+};
+
+class OggCodec : public CodecImpl
+{
+};
+
+class TrackedParser : public Parser
+{
+public:
+	TrackedParser(){++alive;}
+	virtual ~TrackedParser(){--alive;}
+	static std::atomic<int> alive;
+};
+
+std::atomic<int> TrackedParser::alive{0};
+
+static std::size_t failures = 0;
+
+/** Size of the allocations counted by operator new, 0 for none. */
+static std::atomic<std::size_t> watched_size{0};
+
+/** Number of allocations of the watched size. */
+static std::atomic<std::size_t> watched_allocations{0};
+
+void* operator new(std::size_t size)
+{
+	if(size == watched_size.load(std::memory_order_relaxed))
+	{
+		++watched_allocations;
+	}
+	if(void* ptr = std::malloc(size))
+	{
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+// Deletes are kept out of line: once inlined, GCC sees free() called on
+// memory returned by operator new and warns about mismatched deallocations.
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+#ifdef __cpp_aligned_new
+void* operator new(std::size_t size, std::align_val_t align)
+{
+	// aligned_alloc() wants a size multiple of the alignment.
+	std::size_t alignment = static_cast<std::size_t>(align);
+	if(void* ptr = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment))
+	{
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{
+	std::free(ptr);
+}
+#endif
+
+static void check(bool test, const char* what)
+{
+	if(!test)
+	{
+		++failures;
+		std::cerr << "Failure: " << what << std::endl;
+	}
+}
+
+//
+// Components with declared interfaces are only found by typed lookups on
+// them, components without any are found by dynamic_cast.
+//
+
+static void test_interfaces()
+{
+	di::registry reg;
+	std::shared_ptr<OggCodec> declared = std::make_shared<OggCodec>();
+	reg.set(di::component_descriptor(-1, "declared", declared, di::properties_t(), di::interfaces_of<OggCodec, Codec>()));
+
+	check(reg.find<Codec>() == declared, "declared interface is found");
+	check(reg.find<OggCodec>() == declared && reg.find<di::component>() == declared, "component type and di::component are found");
+	check(!reg.find<CodecImpl>() && reg.find_all<CodecImpl>().empty(), "undeclared base is not found when interfaces are declared");
+
+	std::shared_ptr<OggCodec> untyped = std::make_shared<OggCodec>();
+	reg.set("untyped", untyped);
+	check(reg.find<CodecImpl>() == untyped, "untyped component is found by dynamic_cast");
+	std::vector<std::shared_ptr<Codec>> codecs = reg.find_all<Codec>();
+	check(codecs.size() == 2 && codecs[0] == declared && codecs[1] == untyped, "declared and untyped components are found in registration order");
+	check(!reg.find<Parser>(), "untyped component is not found on other types");
+}
+
+//
+// Handles erase their own component only: their slot is a hint checked
+// against the component id.
+//
+
+static void test_erase_handle()
+{
+	std::unique_ptr<di::registry> reg(new di::registry);
+	di::component_handle first = reg->handle(reg->set("first", std::make_shared<Filter>()).id);
+	check(first && first.owner() == reg.get(), "handle of a registered component");
+	di::registry::erase(first);
+	check(reg->get("first") == nullptr && reg->size() == 0, "erase() of a handle");
+	check(first.descriptor() != nullptr && first.descriptor()->name == "first", "handle keeps the descriptor of an erased component");
+
+	// The slot of the erased component is reused, the stale handle must not erase its new component.
+	di::component_id second = reg->set("second", std::make_shared<Filter>()).id;
+	di::registry::erase(first);
+	check(reg->get(second) != nullptr && reg->size() == 1, "stale handle does not erase a component reusing its slot");
+
+	di::component_handle handle = reg->handle(second);
+	di::registry::erase(handle);
+	di::registry::erase(handle);
+	check(reg->size() == 0, "double erase() of a handle");
+
+	di::component_handle orphan = reg->handle(reg->set("orphan", std::make_shared<Filter>()).id);
+	reg.reset();
+	check(orphan.owner() == nullptr, "handle of a destroyed registry has no owner");
+	di::registry::erase(orphan);
+	check(orphan.descriptor() != nullptr && orphan.descriptor()->name == "orphan", "erase() after the registry is destroyed");
+}
+
+//
+// Name, id and pointer indexes follow registrations and erasures: the first
+// registered of components sharing a name wins, erased components are no
+// more found, even once their slots are reused and their indexes compacted.
+//
+
+static void test_indexes()
+{
+	di::registry reg;
+
+	std::shared_ptr<Filter> first = std::make_shared<Filter>(), second = std::make_shared<Filter>(), third = std::make_shared<Filter>();
+	di::component_id first_id = reg.set("duplicate", first).id;
+	di::component_id second_id = reg.set("duplicate", second).id;
+	check(reg.find("duplicate") == first, "first registered of duplicate names is found");
+	di::registry::erase(first_id);
+	check(reg.find("duplicate") == second, "next duplicate name is found once the first is erased");
+	di::component_id third_id = reg.set("duplicate", third).id;
+	check(reg.find("duplicate") == second, "duplicate name registered later does not win");
+	di::registry::erase(second_id);
+	check(reg.find("duplicate") == third, "last duplicate name is found");
+	di::registry::erase(third_id);
+	check(reg.find("duplicate") == nullptr, "erased duplicate names are not found");
+
+	const std::size_t count = 64;
+	std::vector<std::shared_ptr<Filter>> comps;
+	std::vector<di::component_id> ids;
+	for(std::size_t n = 0; n < count; ++n)
+	{
+		comps.push_back(std::make_shared<Filter>());
+		ids.push_back(reg.set(di::component_descriptor(-1, "filter-" + std::to_string(n), comps.back(),
+				di::properties_t(), di::interfaces_of<Filter>())).id);
+	}
+	// Erasing most components compacts the index of their interface.
+	for(std::size_t n = 0; n < count; ++n)
+	{
+		if(n % 8 != 0)
+		{
+			di::registry::erase(ids[n]);
+		}
+	}
+	bool found = true, erased = true;
+	for(std::size_t n = 0; n < count; ++n)
+	{
+		if(n % 8 == 0)
+		{
+			found = found && reg.get(ids[n]) != nullptr && reg.get(comps[n].get()) == reg.get(ids[n]);
+		}
+		else
+		{
+			erased = erased && reg.get(ids[n]) == nullptr && reg.get(comps[n].get()) == nullptr;
+		}
+	}
+	check(found, "get(id) and get(ptr) of remaining components after erasures");
+	check(erased, "get(id) and get(ptr) of erased components after erasures");
+	check(reg.find_all<Filter>().size() == count / 8, "typed lookups after compaction");
+
+	// New components reuse the slots of the erased ones.
+	std::vector<std::shared_ptr<Filter>> others;
+	for(std::size_t n = 0; n < count; ++n)
+	{
+		others.push_back(std::make_shared<Filter>());
+		reg.set(di::component_descriptor(-1, "other-" + std::to_string(n), others.back(), di::properties_t(), di::interfaces_of<Filter>()));
+	}
+	found = true;
+	erased = true;
+	for(std::size_t n = 0; n < count; ++n)
+	{
+		found = found && reg.get(others[n].get()) != nullptr && reg.get(others[n].get())->comp == others[n];
+		if(n % 8 != 0)
+		{
+			erased = erased && reg.get(ids[n]) == nullptr && reg.get(comps[n].get()) == nullptr;
+		}
+	}
+	check(found, "get(ptr) of components reusing slots");
+	check(erased, "get(id) and get(ptr) of erased components once their slots are reused");
+	std::vector<std::shared_ptr<Filter>> all = reg.find_all<Filter>();
+	check(all.size() == count / 8 + count && all.front() == comps.front() && all.back() == others.back(),
+			"typed lookups in registration order once slots are reused");
+}
+
+//
+// Property maps keep their entries sorted by key, inline up to 4 entries
+// and on the heap beyond, and hold references on their interned strings.
+//
+
+static bool same(const di::property_map& map, const di::properties_t& expected)
+{
+	return map.size() == expected.size() && map.to_map() == expected;
+}
+
+static void test_property_map()
+{
+	{
+		di::property_map map;
+		check(map.empty() && map.find("key") == map.end(), "empty property map");
+		map.set("b", "2");
+		map.set("a", "1");
+		map.set("b", "two");
+		check(same(map, {{"a", "1"}, {"b", "two"}}) && map.at("b") == "two", "set() inserts and replaces");
+		check((*map.begin()).first == "a", "properties are iterated in key order");
+		bool thrown = false;
+		try
+		{
+			map.at("missing");
+		}
+		catch(const std::out_of_range&)
+		{
+			thrown = true;
+		}
+		check(thrown, "at() of a missing key throws");
+		check(map.erase("a") == 1 && map.erase("a") == 0 && same(map, {{"b", "two"}}), "erase()");
+	}
+
+	di::properties_t small{{"k1", "v1"}, {"k2", "v2"}, {"k3", "v3"}};
+	di::properties_t large;
+	for(std::size_t n = 0; n < 12; ++n)
+	{
+		large["key-" + std::to_string(n)] = "value-" + std::to_string(n);
+	}
+	{
+		di::property_map map(small);
+		for(const auto& p : large)
+		{
+			map.set(p.first, p.second);
+		}
+		di::properties_t all = large;
+		all.insert(small.begin(), small.end());
+		check(same(map, all), "properties spill past the inline entries");
+		for(std::size_t n = 0; n < 12; n += 2)
+		{
+			map.erase("key-" + std::to_string(n));
+			all.erase("key-" + std::to_string(n));
+		}
+		check(same(map, all) && map.at("key-11") == "value-11", "erase() from heap entries");
+	}
+
+	for(const di::properties_t* prop : {&small, &large})
+	{
+		di::property_map map(*prop);
+		di::property_map copy(map);
+		check(same(copy, *prop) && same(map, *prop), "copy construction");
+		di::property_map assigned({{"other", "value"}});
+		assigned = map;
+		check(same(assigned, *prop), "copy assignment");
+		copy.set("k1", "changed");
+		check(map.find("k1") == map.end() || map.at("k1") == "v1", "copies are independent");
+
+		di::property_map moved(std::move(copy));
+		check(moved.at("k1") == "changed" && moved.size() == prop->size() + (prop == &large ? 1 : 0), "move construction");
+		di::property_map target(large);
+		target = std::move(moved);
+		check(target.at("k1") == "changed", "move assignment");
+		di::property_map& self = target;
+		target = std::move(self);
+		check(target.at("k1") == "changed", "self move assignment");
+	}
+
+	check(!di::find_interned("key-0") && !di::find_interned("changed"), "property maps release their interned strings");
+}
+
+//
+// visit<T>() visits components of a registry, then of its parents, each in
+// registration order, whether declared, untyped or lazy, like find_all<T>().
+//
+
+static void test_visit()
+{
+	di::registry parent;
+	di::registry child(&parent);
+
+	std::shared_ptr<CodecImpl> declared = std::make_shared<CodecImpl>();
+	std::shared_ptr<CodecImpl> untyped = std::make_shared<CodecImpl>();
+	parent.set(di::component_descriptor(-1, "declared", declared, di::properties_t(), di::interfaces_of<CodecImpl, Codec>()));
+	parent.set("filter", std::make_shared<Filter>());
+	parent.set("untyped", untyped);
+	parent.set(di::component_descriptor(-1, "lazy", std::make_shared<di::component_factory>([](){return std::make_shared<CodecImpl>();}),
+			di::properties_t(), di::interfaces_of<CodecImpl, Codec>()));
+
+	std::shared_ptr<CodecImpl> child_untyped = std::make_shared<CodecImpl>();
+	std::shared_ptr<CodecImpl> child_declared = std::make_shared<CodecImpl>();
+	child.set("child-untyped", child_untyped);
+	child.set(di::component_descriptor(-1, "child-declared", child_declared, di::properties_t(), di::interfaces_of<CodecImpl, Codec>()));
+
+	std::vector<const Codec*> visited;
+	child.visit<Codec>([&](const Codec& codec){
+			visited.push_back(&codec);
+		});
+	di::component_ptr_t lazy = parent.find("lazy");
+	std::vector<const Codec*> expected{child_untyped.get(), child_declared.get(), declared.get(), untyped.get(),
+			std::dynamic_pointer_cast<Codec>(lazy).get()};
+	check(lazy != nullptr && visited == expected, "visit<T>() visits the registry then its parents, in registration order");
+
+	std::vector<const Codec*> found;
+	for(const std::shared_ptr<Codec>& codec : child.find_all<Codec>())
+	{
+		found.push_back(codec.get());
+	}
+	check(found == visited, "visit<T>() visits components in the order of find_all<T>()");
+
+	std::size_t count = 0;
+	parent.visit<Codec>([&](const Codec&){
+			++count;
+		});
+	check(count == 3, "visit<T>() does not visit children");
+	count = 0;
+	child.visit<Parser>([&](const Parser&){
+			++count;
+		});
+	check(count == 0, "visit<T>() does not visit components of other types");
+}
+
+//
+// Property queries must select the same components as predicates would,
+// and follow registrations and erasures.
+//
+
+static void test_property_query()
+{
+	di::registry parent;
+	di::registry reg(&parent);
+
+	di::component_id first = reg.set(di::component_descriptor(-1, "codec-a", std::make_shared<CodecImpl>(),
+			di::properties_t{{"role", "codec"}, {"format", "audio/ogg"}}, di::interfaces_of<CodecImpl, Codec>())).id;
+	reg.set("codec-b", std::make_shared<CodecImpl>(), {{"role", "codec"}, {"format", "video/webm"}});
+	reg.set("filter", std::make_shared<Filter>(), {{"role", "filter"}, {"format", "audio/ogg"}});
+	parent.set("codec-c", std::make_shared<CodecImpl>(), {{"role", "codec"}, {"format", "audio/mpeg"}, {"priority", "1"}});
+
+	check(reg.find_all(di::property_query().equals("role", "codec")).size() == 3, "equals() on registry and parent");
+	check(reg.find_all(di::property_query().equals("role", "codec").equals("format", "audio/ogg")).size() == 1, "equals() conjunction");
+	check(reg.find_all(di::property_query().has("priority")).size() == 1, "has()");
+	check(reg.find_all(di::property_query().prefix("format", "audio/")).size() == 3, "prefix()");
+	check(reg.find_all(di::property_query().equals("role", "muxer")).empty(), "equals() on a missing value");
+	check(reg.find_all(di::property_query().has("missing")).empty(), "has() on a missing key");
+	check(reg.find_all(di::property_query()).size() == 4, "empty query matches all components");
+	check(!di::find_interned("missing"), "queries do not intern their strings");
+
+	di::property_query later;
+	later.equals("stage", "late-value");
+	check(reg.find_all(later).empty(), "query on strings not interned yet");
+	di::component_id late = reg.set("late", std::make_shared<Filter>(), {{"stage", "late-value"}}).id;
+	check(reg.find_all(later).size() == 1, "query matches properties interned after it was built");
+	{
+		di::property_query kept;
+		kept.equals("stage", "late-value");
+		di::registry::erase(late);
+		check(di::find_interned("late-value") && reg.find_all(kept).empty(), "queries keep their interned strings");
+	}
+	check(!di::find_interned("stage") && !di::find_interned("late-value"), "interned strings are released with their last user");
+
+	check(reg.find(di::property_query().equals("role", "codec")) == reg.find("codec-a"), "find() returns the first registered component");
+	check(reg.find_all<Codec>(di::property_query().prefix("format", "audio/")).size() == 2, "typed find_all() on declared and untyped components");
+	check(!reg.find<Codec>(di::property_query().equals("role", "filter")), "typed find() skips components of other types");
+
+	di::registry::erase(first);
+	check(reg.find_all(di::property_query().equals("format", "audio/ogg")).size() == 1, "erased components are unindexed");
+	reg.set("codec-d", std::make_shared<CodecImpl>(), {{"role", "codec"}, {"format", "audio/ogg"}});
+	std::vector<di::component_ptr_t> found = reg.find_all(di::property_query().equals("role", "codec"));
+	check(found.size() == 3 && found[1] == reg.find("codec-d"), "components are found in registration order");
+}
+
+//
+// Lookups through flattened registries must find what the hierarchy holds,
+// and follow modifications of the registry and its parents.
+//
+
+static void test_flatten()
+{
+	di::registry global;
+	di::registry process(&global);
+	di::registry tenant(&process);
+	di::registry request(&tenant);
+	tenant.flatten(true);
+
+	global.set("shadowed", std::make_shared<Filter>());
+	std::shared_ptr<CodecImpl> codec = std::make_shared<CodecImpl>();
+	global.set(di::component_descriptor(-1, "codec", codec, di::properties_t{{"role", "codec"}}, di::interfaces_of<CodecImpl, Codec>()));
+	std::shared_ptr<Filter> filter = std::make_shared<Filter>();
+	tenant.set("shadowed", filter);
+
+	check(request.size() == 3, "size() through a flattened parent");
+	check(request.find("shadowed") == filter, "find(name) returns the nearest component");
+	check(request.find<Codec>() == codec, "find<T>() through a flattened parent");
+	check(request.find_all<di::component>().size() == 3, "find_all<T>() through a flattened parent");
+	check(request.find_all(di::property_query().equals("role", "codec")).size() == 1, "property query through a flattened parent");
+
+	std::shared_ptr<CodecImpl> other = std::make_shared<CodecImpl>();
+	process.set(di::component_descriptor(-1, "other", other, di::properties_t(), di::interfaces_of<CodecImpl, Codec>()));
+	check(request.find<Codec>() == other, "flattened view follows modifications of parents");
+	check(request.find_all<Codec>().size() == 2, "find_all<T>() after modification of parents");
+
+	di::registry replacement;
+	tenant.parent(&replacement);
+	check(request.find<Codec>() == nullptr && request.size() == 1, "flattened view follows parent changes");
+	tenant.parent(&process);
+	check(request.find<Codec>() == other && request.size() == 4, "flattened view follows parent restoration");
+
+	{
+		di::registry temporary;
+		temporary.set("temporary", std::make_shared<Filter>());
+		tenant.parent(&temporary);
+		check(request.find("temporary") != nullptr, "flattened view through a temporary parent");
+		tenant.parent(&process);
+	}
+	check(request.find("temporary") == nullptr && request.find<Codec>() == other, "flattened view after a former parent is destroyed");
+	global.set("after", std::make_shared<Filter>());
+	check(request.find("after") != nullptr, "flattened view follows parents after a former parent is destroyed");
+
+	tenant.flatten(false);
+	check(request.find<Codec>() == other && request.size() == 5, "lookups after unflattening");
+}
+
+//
+// Scoped registries override their parent and release their components.
+//
+
+static void test_scoped_registry()
+{
+	di::registry parent;
+	std::shared_ptr<CodecImpl> inherited = std::make_shared<CodecImpl>();
+	parent.set(di::component_descriptor(-1, "codec", inherited, di::properties_t(), di::interfaces_of<CodecImpl, Codec>()));
+	parent.set("filter", std::make_shared<Filter>());
+
+	std::weak_ptr<CodecImpl> released;
+	{
+		di::scoped_registry scope(parent);
+		std::shared_ptr<CodecImpl> codec = std::make_shared<CodecImpl>();
+		released = codec;
+		scope.set("codec", codec, di::interfaces_of<CodecImpl, Codec>());
+		check(scope.find("codec") == codec, "find(name) returns the scoped override");
+		check(scope.find("filter") == parent.find("filter"), "find(name) falls back to the parent");
+		check(scope.find<Codec>() == codec, "find<T>() returns the scoped override");
+		check(scope.find_all<Codec>().size() == 2 && scope.find_all<Codec>().back() == inherited, "find_all<T>() returns scoped components first");
+		check(scope.size() == 3, "size() includes the parent");
+
+		// Overflow the inline arena buffer.
+		for(std::size_t n = 0; n < 100; ++n)
+		{
+			scope.set("a rather long component name, not fitting in small strings " + std::to_string(n), std::make_shared<Filter>());
+		}
+		check(scope.find("a rather long component name, not fitting in small strings 99") != nullptr, "find(name) beyond the inline arena");
+		check(scope.find_all<Filter>().size() == 101, "find_all<T>() of untyped components");
+	}
+	check(released.expired(), "scoped components are released with their registry");
+}
+
+//
+// Injected components are created with their dependencies, and report
+// missing dependencies and cycles.
+//
+
+static void test_injection()
+{
+	di::registry& reg = di::registry::get();
+
+	di::injected_component_instance<Service, di::dependencies<Database, Logger>> service("service");
+	di::injected_component_instance<Database, di::dependencies<Logger>> database("database");
+	check(!service.created() && !database.created(), "injected components are created on demand");
+
+	std::string error;
+	try
+	{
+		reg.find<Service>();
+	}
+	catch(const di::resolution_error& ex)
+	{
+		error = ex.what();
+	}
+	check(error == "unresolved dependency Logger of component database", "missing dependency is reported");
+
+	di::component_instance<Logger> logger("logger");
+	std::shared_ptr<Service> found = reg.find<Service>();
+	check(found && found->database == database.get() && found->logger == logger.get() && found->database->logger == logger.get(),
+		"dependencies are injected once resolvable");
+	check(reg.find("service") == found, "injected component is found by name");
+
+	std::weak_ptr<Service> released;
+	{
+		di::injected_component_instance<Service, di::dependencies<Database, Logger>> scoped("scoped-service");
+		released = scoped.get();
+	}
+	check(released.expired(), "injected component is destroyed with its instance");
+
+	di::injected_component_instance<Egg, di::dependencies<Chicken>> egg("egg");
+	di::injected_component_instance<Chicken, di::dependencies<Egg>> chicken("chicken");
+	error.clear();
+	try
+	{
+		egg.get();
+	}
+	catch(const di::resolution_error& ex)
+	{
+		error = ex.what();
+	}
+	check(error == "dependency cycle: egg -> chicken -> egg", "dependency cycle is reported");
+	check(!egg.created() && !chicken.created(), "components of a cycle are not created");
+}
+
+//
+// Per thread components are created once per thread, transient components
+// at each lookup.
+//
+
+static void test_lifetimes()
+{
+	di::registry& reg = di::registry::get();
+
+	{
+		di::lazy_component_instance<ParserImpl, Parser> parser("per-thread-parser", di::per_thread);
+		std::shared_ptr<Parser> first = reg.find<Parser>();
+		check(first && reg.find<Parser>() == first && reg.find("per-thread-parser") == first, "per thread component is shared by its thread");
+		check(reg.get(first.get()) != nullptr, "per thread component is found by pointer in its thread");
+
+		std::shared_ptr<Parser> other;
+		bool found = true;
+		std::thread([&](){
+				other = reg.find<Parser>();
+				found = reg.get(first.get()) != nullptr;
+			}).join();
+		check(other && other != first, "per thread component is created for each thread");
+		check(!found, "per thread component is not found by pointer in other threads");
+	}
+
+	{
+		di::lazy_component_instance<ParserImpl, Parser> parser("transient-parser", di::transient);
+		check(!parser.created(), "transient component is created on demand");
+		std::shared_ptr<Parser> first = reg.find<Parser>();
+		std::shared_ptr<Parser> second = reg.find<Parser>();
+		check(first && second && first != second, "transient component is created by each find<T>()");
+		check(reg.find("transient-parser") != first, "transient component is created by each find(name)");
+		check(reg.find_all<Parser>().size() == 1, "transient component is found once by find_all<T>()");
+		check(parser.created() && parser.get() != parser.get(), "transient component is created by each get()");
+	}
+}
+
+//
+// Per thread instances are released with their factory: at once by the
+// thread destroying it, on their next per thread request by other threads.
+//
+
+static void test_per_thread_release()
+{
+	di::registry reg;
+	di::component_id id = reg.set(di::component_descriptor(-1, "tracked", std::make_shared<di::component_factory>([](){
+			return std::make_shared<TrackedParser>();
+		}, "tracked", di::per_thread), di::properties_t(), di::interfaces_t())).id;
+	di::lazy_component_instance<ParserImpl, Parser> other("other-parser", di::per_thread);
+
+	std::atomic<int> step{0};
+	std::thread thread([&](){
+			check(reg.find("tracked") != nullptr, "per thread component is created by another thread");
+			step = 1;
+			while(step != 2)
+			{
+				std::this_thread::yield();
+			}
+			check(TrackedParser::alive == 1, "per thread instances of other threads are kept until their next request");
+			check(other.get() != nullptr, "other per thread component is created");
+			check(TrackedParser::alive == 0, "per thread instances of other threads are released by their next request");
+		});
+	while(step != 1)
+	{
+		std::this_thread::yield();
+	}
+	check(reg.find("tracked") != nullptr && TrackedParser::alive == 2, "per thread component is created for each thread");
+
+	di::registry::erase(id);
+	check(TrackedParser::alive == 1, "per thread instance is released when its component is erased");
+	step = 2;
+	thread.join();
+}
+
+//
+// Pooled components are recycled, within the capacity of their pool.
+//
+
+static void test_pool()
+{
+	di::registry& reg = di::registry::get();
+	di::pooled_component_instance<ParserImpl, Parser> parser("pooled-parser", 2);
+
+	Parser* first = reg.find<Parser>().get();
+	check(reg.find<Parser>().get() == first && parser.pool().created() == 1, "released pooled component is recycled");
+
+	std::vector<std::shared_ptr<Parser>> held;
+	for(std::size_t n = 0; n < 5; ++n)
+	{
+		held.push_back(parser.get());
+	}
+	check(parser.pool().created() == 5, "pool creates components when none is idle");
+	held.clear();
+	check(parser.pool().idle() == 2, "pool keeps released components within its capacity");
+
+	for(std::size_t n = 0; n < 4; ++n)
+	{
+		held.push_back(parser.get());
+	}
+	check(parser.pool().created() == 5, "thread cache and shared components are recycled");
+	held.push_back(parser.get());
+	check(parser.pool().created() == 6, "extra components were destroyed");
+
+	std::thread([&](){
+			held.clear();
+			check(parser.pool().idle() == 2, "components released by another thread are shared");
+		}).join();
+}
+
+//
+// Batches register their components as set() would, in order.
+//
+
+static void test_set_batch()
+{
+	di::registry reg(nullptr, di::registry::concurrent);
+	reg.set("filter", std::make_shared<Filter>(), {{"role", "filter"}});
+
+	std::vector<di::component_descriptor> descs;
+	for(std::size_t n = 0; n < 100; ++n)
+	{
+		descs.emplace_back(-1, "codec-" + std::to_string(n), std::make_shared<CodecImpl>(),
+				di::properties_t{{"role", "codec"}}, n % 2 == 0 ? di::interfaces_of<CodecImpl, Codec>() : di::interfaces_t());
+	}
+	std::vector<di::component_id> ids = reg.set_batch(std::move(descs));
+
+	check(ids.size() == 100 && reg.size() == 101, "batch components are registered");
+	check(reg.get(ids[42]) != nullptr && reg.get(ids[42])->name == "codec-42", "batch components are found by id");
+	check(reg.find("codec-99") != nullptr, "batch components are found by name");
+	check(reg.find<Codec>() == reg.find("codec-0"), "batch components are indexed by type");
+	std::vector<std::shared_ptr<Codec>> codecs = reg.find_all<Codec>();
+	check(codecs.size() == 100 && codecs[1] == reg.find("codec-1"), "batch components are found in batch order");
+	check(reg.find_all(di::property_query().equals("role", "codec")).size() == 100, "batch components are indexed by property");
+	check(reg.set_batch(std::vector<di::component_descriptor>()).empty() && reg.size() == 101, "empty batch");
+
+	di::registry::erase(ids[0]);
+	check(reg.find<Codec>() == reg.find("codec-1"), "batch components are erased as others");
+
+	// Erase most components, interleaving typed and untyped ones, so erased index entries are compacted.
+	for(std::size_t n = 1; n < 100; ++n)
+	{
+		if(n % 3 != 0)
+		{
+			di::registry::erase(ids[n]);
+		}
+	}
+	reg.set("codec-last", std::make_shared<CodecImpl>(), {{"role", "codec"}});
+	codecs = reg.find_all<Codec>();
+	bool ordered = codecs.size() == 34 && codecs.back() == reg.find("codec-last");
+	for(std::size_t n = 0; ordered && n + 1 < codecs.size(); ++n)
+	{
+		ordered = codecs[n] == reg.find("codec-" + std::to_string(3 * (n + 1)));
+	}
+	check(ordered, "remaining components are found in registration order");
+	check(reg.find_all(di::property_query().equals("role", "codec")).size() == 34, "erased components are unindexed by property");
+}
+
+//
+// Names and properties of component instances are moved to the registry,
+// never copied: strings longer than any small string buffer are allocated
+// once, by the caller.
+//
+
+static void test_registration_copies()
+{
+	std::string name(301, 'n');
+	std::string value(203, 'v');
+	std::string expected_name = name;
+	di::properties_t prop{{"registration-copies", value}};
+	std::shared_ptr<CodecImpl> comp = std::make_shared<CodecImpl>();
+
+	// Strings allocate their size plus a terminator.
+	watched_size = name.size() + 1;
+	watched_allocations = 0;
+	std::string copy(name);
+	std::size_t allocations = watched_allocations;
+	check(allocations == 1 && copy == expected_name, "allocations are counted");
+
+	watched_allocations = 0;
+	{
+		di::component_instance<CodecImpl, Codec> instance(std::move(name), comp, std::move(prop));
+		allocations = watched_allocations;
+		watched_size = 0;
+
+		check(instance.name() == expected_name && instance.get() == comp, "instance keeps its registered component");
+		const di::component_descriptor* desc = di::registry::get().get(instance.id());
+		check(desc != nullptr && desc->prop.at("registration-copies") == value, "instance properties are registered");
+		check(di::registry::get().find(expected_name) == comp, "instance is found by name");
+	}
+	check(allocations == 0, "component name is not copied");
+	check(!di::registry::get().find(expected_name), "instance is erased");
+
+	// Other instances keep their name in their descriptor too.
+	name = expected_name;
+	watched_size = name.size() + 1;
+	watched_allocations = 0;
+	{
+		di::lazy_component_instance<CodecImpl, Codec> instance(std::move(name), di::per_thread);
+		allocations = watched_allocations;
+		watched_size = 0;
+		check(instance.name() == expected_name && di::registry::get().find(expected_name) == instance.get(), "lazy instance is registered");
+	}
+	check(allocations == 0, "lazy component name is not copied");
+
+	name = expected_name;
+	watched_size = name.size() + 1;
+	watched_allocations = 0;
+	{
+		di::pooled_component_instance<CodecImpl, Codec> instance(std::move(name), 1);
+		allocations = watched_allocations;
+		watched_size = 0;
+		check(instance.name() == expected_name && di::registry::get().get(expected_name) != nullptr, "pooled instance is registered");
+	}
+	check(allocations == 0, "pooled component name is not copied");
+
+	name = expected_name;
+	watched_size = name.size() + 1;
+	watched_allocations = 0;
+	{
+		di::injected_component_instance<CodecImpl, di::dependencies<>, Codec> instance(std::move(name));
+		allocations = watched_allocations;
+		watched_size = 0;
+		check(instance.name() == expected_name && di::registry::get().find(expected_name) == instance.get(), "injected instance is registered");
+	}
+	check(allocations == 0, "injected component name is not copied");
+
+	prop = di::properties_t{{"registration-copies", std::string(value.size(), 'w')}};
+	watched_size = value.size() + 1;
+	watched_allocations = 0;
+	{
+		di::component_instance<CodecImpl, Codec> instance(std::string("copies"), comp, std::move(prop));
+		allocations = watched_allocations;
+		watched_size = 0;
+	}
+	check(allocations == 0, "property values are moved to the interned strings");
+}
+
+int main()
+{
+	test_interfaces();
+	test_erase_handle();
+	test_indexes();
+	test_property_map();
+	test_visit();
+	test_property_query();
+	test_flatten();
+	test_scoped_registry();
+	test_injection();
+	test_lifetimes();
+	test_per_thread_release();
+	test_pool();
+	test_set_batch();
+	test_registration_copies();
+
+	std::cout << "registry: " << failures << " failure(s)" << std::endl;
+	return failures == 0 ? 0 : 1;
+}